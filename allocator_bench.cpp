@@ -0,0 +1,242 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Host microbenchmark for the buddy allocator. Build it once per bitset
+ * backend (and with or without -DBUDDY_FREE_INDEX) and compare the reported
+ * times, for example (-march=native lets the popcount/ctz builtins map to
+ * single instructions on the host):
+ *
+ * g++ -O2 -march=native -o bench_byte allocator_bench.cpp buddy_allocator.cpp
+ * g++ -O2 -march=native -o bench_word -DBUDDY_WORD_BITSET allocator_bench.cpp buddy_allocator.cpp
+ * ./bench_byte && ./bench_word
+ *
+ * The large arena workload has metadata well beyond the L2 cache, build it
+ * also with -DBUDDY_BLOCKED_LAYOUT or -DBUDDY_FIXED_STATUS to compare the
+ * bitset layouts. The metadata size is reported for each workload.
+ *
+ * Every build also times the BuddyAllocator template on the same workload, and
+ * compares the startup of buddy_init_alignment and buddy_init_lazy on a large
+ * arena, as time and as metadata pages made resident.
+ */
+
+#include "buddy_allocator.h"
+#include "buddy_allocator_template.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char backend[]=
+#if defined(BUDDY_FIXED_STATUS)
+    "fixed-status"
+#elif defined(BUDDY_WORD_BITSET)
+    "word"
+#else //BUDDY_WORD_BITSET
+    "byte"
+#endif //BUDDY_WORD_BITSET
+#ifdef BUDDY_FREE_INDEX
+    "+free-index"
+#endif //BUDDY_FREE_INDEX
+#ifdef BUDDY_BLOCKED_LAYOUT
+    "+blocked"
+#endif //BUDDY_BLOCKED_LAYOUT
+    ;
+
+///Arena managed by the benchmark, never actually touched by the allocator
+static const size_t arenaSize=64*1024*1024;
+///Minimum block size, the same order of magnitude of a process image page
+static const size_t alignment=1024;
+///Number of blocks kept live during the steady state phase
+static const unsigned int liveBlocks=4096;
+///Number of free+malloc pairs in each round of the steady state phase
+static const unsigned int churnOps=500000;
+///The best round is reported, to filter out noise from the host
+static const unsigned int rounds=7;
+///Arena of the large workload, only reserved, never committed
+static const size_t largeArenaSize=static_cast<size_t>(1)<<30;
+///Minimum block size of the large workload, about 10MB of tree metadata
+static const size_t largeAlignment=64;
+///Number of blocks kept live by the large workload, spread over most of the arena
+static const unsigned int largeLiveBlocks=49152;
+///Arena used to time the startup, only reserved, never committed
+static const size_t startupArenaSize=static_cast<size_t>(1)<<37;
+///Minimum block size of the startup arena, a page
+static const size_t startupAlignment=4096;
+
+/**
+ * Small deterministic generator, so that every backend sees the same sequence
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * \return a power of two size between alignment and 32 times alignment
+ */
+static size_t randomSize(unsigned int& state)
+{
+    return alignment<<(xorshift(state) % 6);
+}
+
+/**
+ * Run the churn workload
+ * \param allocate callable taking a size and returning a block
+ * \param deallocate callable taking a block
+ * \param failed incremented for every failed allocation
+ * \param blocks number of blocks kept live
+ * \return best time in ns per malloc/free pair
+ */
+template<typename Allocate, typename Deallocate>
+static double churn(Allocate allocate, Deallocate deallocate, unsigned int& failed,
+                    unsigned int blocks=liveBlocks)
+{
+    vector<void*> live(blocks,static_cast<void*>(NULL));
+    unsigned int state=0x2545f491;
+    for(unsigned int i=0;i<blocks;i++) live[i]=allocate(randomSize(state));
+
+    double best=0;
+    for(unsigned int r=0;r<rounds;r++)
+    {
+        auto start=chrono::steady_clock::now();
+        for(unsigned int i=0;i<churnOps;i++)
+        {
+            unsigned int victim=xorshift(state) % blocks;
+            deallocate(live[victim]);
+            live[victim]=allocate(randomSize(state));
+            if(live[victim]==NULL) failed++;
+        }
+        auto end=chrono::steady_clock::now();
+        double ns=chrono::duration<double,nano>(end-start).count()/churnOps;
+        if(r==0 || ns<best) best=ns;
+    }
+    for(unsigned int i=0;i<blocks;i++) deallocate(live[i]);
+    return best;
+}
+
+/**
+ * Initialize a buddy for startupArenaSize bytes on freshly mapped metadata
+ * \param lazy true to use buddy_init_lazy, false for buddy_init_alignment
+ * \param us set to the initialization time in microseconds
+ * \param resident set to the metadata bytes made resident by the initialization
+ * \return false if the memory could not be mapped
+ */
+static bool startup(bool lazy, double& us, size_t& resident)
+{
+    size_t page=sysconf(_SC_PAGESIZE);
+    size_t size=buddy_sizeof_alignment(startupArenaSize,startupAlignment);
+    size=(size+page-1)/page*page;
+    void *metadata=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    void *arena=mmap(NULL,startupArenaSize,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(metadata==MAP_FAILED || arena==MAP_FAILED) return false;
+
+    unsigned char *at=static_cast<unsigned char*>(metadata);
+    unsigned char *main=static_cast<unsigned char*>(arena);
+    auto start=chrono::steady_clock::now();
+    struct buddy *buddy=lazy ? buddy_init_lazy(at,main,startupArenaSize,startupAlignment)
+                             : buddy_init_alignment(at,main,startupArenaSize,startupAlignment);
+    auto end=chrono::steady_clock::now();
+    us=chrono::duration<double,micro>(end-start).count();
+
+    vector<unsigned char> pages(size/page);
+    resident=0;
+    if(mincore(metadata,size,pages.data())==0)
+        for(size_t i=0;i<pages.size();i++) if(pages[i] & 1) resident+=page;
+    munmap(arena,startupArenaSize);
+    munmap(metadata,size);
+    return buddy!=NULL;
+}
+
+///Static, as the template allocator holds its metadata inline
+static BuddyAllocator<arenaSize,alignment> *fixed;
+
+int main()
+{
+    vector<unsigned char> metadata(buddy_sizeof_alignment(arenaSize,alignment));
+    unsigned char *arena=static_cast<unsigned char*>(malloc(arenaSize));
+    struct buddy *buddy=buddy_init_alignment(metadata.data(),arena,arenaSize,alignment);
+    if(buddy==NULL || arena==NULL)
+    {
+        fprintf(stderr,"buddy_init_alignment failed\n");
+        return 1;
+    }
+
+    unsigned int failed=0;
+    double best=churn([buddy](size_t size) { return buddy_malloc(buddy,size); },
+                      [buddy](void *ptr) { buddy_dealloc(buddy,ptr); },failed);
+    printf("backend %s: %zu KB of metadata, %u malloc/free pairs, best of %u rounds %.1f ns/pair, %u failed\n",
+           backend,metadata.size()>>10,churnOps,rounds,best,failed);
+
+    static BuddyAllocator<arenaSize,alignment> instance(arena);
+    fixed=&instance;
+    failed=0;
+    best=churn([](size_t size) { return fixed->malloc(size); },
+               [](void *ptr) { fixed->dealloc(ptr); },failed);
+    printf("backend template: %u malloc/free pairs, best of %u rounds %.1f ns/pair, %u failed\n",
+           churnOps,rounds,best,failed);
+    free(arena);
+
+    size_t largeMetadataSize=buddy_sizeof_alignment(largeArenaSize,largeAlignment);
+    vector<unsigned char> largeMetadata(largeMetadataSize);
+    void *largeArena=mmap(NULL,largeArenaSize,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(largeArena==MAP_FAILED)
+    {
+        fprintf(stderr,"large arena mapping failed\n");
+        return 1;
+    }
+    struct buddy *large=buddy_init_alignment(largeMetadata.data(),static_cast<unsigned char*>(largeArena),
+                                             largeArenaSize,largeAlignment);
+    failed=0;
+    best=churn([large](size_t size) { return buddy_malloc(large,size); },
+               [large](void *ptr) { buddy_dealloc(large,ptr); },failed,largeLiveBlocks);
+    printf("backend %s large: %zu KB of metadata, %u malloc/free pairs, best of %u rounds %.1f ns/pair, %u failed\n",
+           backend,largeMetadataSize>>10,churnOps,rounds,best,failed);
+    munmap(largeArena,largeArenaSize);
+
+    for(int lazy=0;lazy<2;lazy++)
+    {
+        double us;
+        size_t resident;
+        if(!startup(lazy,us,resident))
+        {
+            fprintf(stderr,"startup mapping failed\n");
+            return 1;
+        }
+        printf("startup %s: %zu MB arena, %zu byte blocks, %.1f us, %zu of %zu KB of metadata resident\n",
+               lazy ? "buddy_init_lazy" : "buddy_init_alignment",startupArenaSize>>20,startupAlignment,us,
+               resident>>10,buddy_sizeof_alignment(startupArenaSize,startupAlignment)>>10);
+    }
+    return 0;
+}
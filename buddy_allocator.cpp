@@ -1,8 +1,11 @@
 #include "buddy_allocator.h" 
+#include <cstddef>
 #include <cstdint>
 #include <climits>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
 
 #ifndef BUDDY_ALLOC_ALIGN
 #define BUDDY_ALLOC_ALIGN (sizeof(size_t) * CHAR_BIT)
@@ -16,6 +19,84 @@
 #define BUDDY_PRINTF printf
 #endif
 
+/*
+ * Define BUDDY_TRACE_LEVEL to record allocator events in a per-thread ring
+ * buffer, drained and decoded by buddy_trace_drain and buddy_trace_print:
+ * 0 (default) records nothing and costs nothing, 1 records failed operations,
+ * 2 records every operation. Events are timestamped with
+ * BUDDY_TRACE_TIMESTAMP(), which reads the cycle counter on x86 and can be
+ * defined to read the one of the target.
+ */
+#ifndef BUDDY_TRACE_LEVEL
+#define BUDDY_TRACE_LEVEL 0
+#endif
+
+#if BUDDY_TRACE_LEVEL > 0
+#include <atomic>
+#include <new>
+
+#ifndef BUDDY_TRACE_RING_SIZE
+#define BUDDY_TRACE_RING_SIZE 1024
+#endif
+
+#ifndef BUDDY_TRACE_TIMESTAMP
+#if defined(__x86_64__) || defined(__i386__)
+#define BUDDY_TRACE_TIMESTAMP() __builtin_ia32_rdtsc()
+#else
+#define BUDDY_TRACE_TIMESTAMP() 0
+#endif
+#endif
+
+static void buddy_trace_record(enum buddy_trace_op op, size_t size, size_t depth, void *address);
+#endif //BUDDY_TRACE_LEVEL
+
+#if BUDDY_TRACE_LEVEL >= 1
+#define BUDDY_TRACE_FAILURE(op, size, depth, address) buddy_trace_record(op, size, depth, address)
+#else
+#define BUDDY_TRACE_FAILURE(op, size, depth, address) do { } while (0)
+#endif
+
+#if BUDDY_TRACE_LEVEL >= 2
+#define BUDDY_TRACE_OPERATION(op, size, depth, address) buddy_trace_record(op, size, depth, address)
+#else
+#define BUDDY_TRACE_OPERATION(op, size, depth, address) do { } while (0)
+#endif
+
+/*
+ * Define BUDDY_WORD_BITSET to have the tree bitset read and written one
+ * size_t at a time using the compiler popcount/ctz builtins, instead of one
+ * byte at a time through the lookup tables.
+ */
+
+/*
+ * Define BUDDY_BLOCKED_LAYOUT to store the tree bitset as blocks of a few
+ * consecutive depths that fit a 64 byte cache line, instead of one depth after
+ * the other, so that a descent from the root touches about one line per block
+ * rather than one per depth once the metadata does not fit the cache. Blocks
+ * are aligned from the start of the bitset and padded to a power of two, which
+ * costs up to about a quarter more metadata. buddy_resize cannot change the
+ * tree order with this layout.
+ */
+
+/*
+ * Define BUDDY_FIXED_STATUS to store the status of each tree position in a
+ * byte of its own, indexed by position, instead of as a count of bits of a
+ * width that depends on the depth. Reading, writing and comparing a status
+ * are then a single load or store. The bitset takes one byte per position,
+ * against about two bits per position otherwise, see buddy_sizeof_alignment.
+ */
+#if defined(BUDDY_FIXED_STATUS) && defined(BUDDY_BLOCKED_LAYOUT)
+#error "BUDDY_FIXED_STATUS and BUDDY_BLOCKED_LAYOUT are alternative layouts"
+#endif
+
+/*
+ * Define BUDDY_FREE_INDEX to keep a per-depth index of the free blocks that
+ * are not part of a larger free block. buddy_malloc then takes a block of
+ * exactly the requested size without descending the tree, and only searches
+ * the tree when a larger block has to be split. The index costs about one
+ * more bit of metadata per tree position.
+ */
+
 /*
  * A binary buddy memory allocator
  */
@@ -28,6 +109,8 @@ struct buddy {
         ptrdiff_t main_offset;
     } arena;
     size_t buddy_flags;
+    size_t policy;          /* one of buddy_policy */
+    size_t two_ended_depth; /* deepest position allocated from the high end */
 };
 
 struct buddy_embed_check {
@@ -36,6 +119,25 @@ struct buddy_embed_check {
     size_t buddy_size;
 };
 
+/*
+ * A snapshot is this header followed by the struct buddy and its tree, as
+ * they are in memory. The tree only holds offsets, so the copy can be used in
+ * place wherever it is loaded.
+ */
+struct buddy_snapshot_header {
+    char magic[4];              /* "BDSN" */
+    uint32_t version;           /* BUDDY_SNAPSHOT_VERSION */
+    uint32_t layout;            /* build options the metadata depends on, see buddy_snapshot_layout */
+    uint32_t word_size;         /* sizeof(size_t) of the build that saved the snapshot */
+    uint64_t metadata_size;     /* bytes following the header */
+    uint64_t metadata_checksum; /* of the bytes following the header when saved */
+    uint64_t saved_arena;       /* arena binding of the copy when saved, restored by buddy_snapshot_sync */
+    uint64_t saved_flags;       /* buddy_flags of the copy when saved, restored by buddy_snapshot_sync */
+    uint64_t header_checksum;   /* of the fields above */
+};
+
+const uint32_t BUDDY_SNAPSHOT_VERSION = 2;
+
 const unsigned int BUDDY_RELATIVE_MODE = 1;
 
 struct buddy_tree;
@@ -73,18 +175,31 @@ struct bitset_range {
 };
 
 /* Forward declarations (ignore) */
+static struct buddy *buddy_init_internal(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment,
+    unsigned int zeroed);
+static struct buddy *buddy_embed_internal(unsigned char *main, size_t memory_size, size_t alignment,
+    unsigned int zeroed);
 static unsigned int is_valid_alignment(size_t alignment);
+static uint32_t buddy_snapshot_layout(void);
+static uint64_t buddy_snapshot_checksum(const unsigned char *data, size_t size);
+static unsigned int buddy_relative_mode(struct buddy *buddy);
 static unsigned char *buddy_main(struct buddy *buddy);
 static void buddy_toggle_virtual_slots(struct buddy *buddy, unsigned int state);
 static struct buddy_embed_check buddy_embed_offset(size_t memory_size, size_t alignment);
+static struct buddy *buddy_resize_standard(struct buddy *buddy, size_t new_memory_size);
+static struct buddy *buddy_resize_embedded(struct buddy *buddy, size_t new_memory_size);
+static bool buddy_is_range_free(struct buddy *buddy, size_t from, size_t to);
 static inline size_t size_for_depth(struct buddy *buddy, size_t depth);
 static size_t depth_for_size(struct buddy *buddy, size_t requested_size);
 static unsigned char *address_for_position(struct buddy *buddy, struct buddy_tree_pos pos);
 static struct buddy_tree_pos position_for_address(struct buddy *buddy, const unsigned char *addr);
+static struct buddy_tree_pos deepest_position_for_offset(struct buddy *buddy, size_t offset);
 static size_t buddy_tree_sizeof(uint8_t order);
 static size_t buddy_tree_order_for_memory(size_t memory_size, size_t alignment);
 static struct buddy_tree *buddy_tree(struct buddy *buddy);
-static struct buddy_tree *buddy_tree_init(unsigned char *at, uint8_t order);
+static uint8_t buddy_tree_order(struct buddy_tree *t);
+static struct buddy_tree *buddy_tree_init(unsigned char *at, uint8_t order, unsigned int zeroed);
+static void buddy_tree_resize(struct buddy_tree *t, uint8_t desired_order);
 static size_t buddy_tree_index(struct buddy_tree_pos pos);
 static size_t buddy_tree_status(struct buddy_tree *t, struct buddy_tree_pos pos);
 static inline size_t buddy_tree_depth(struct buddy_tree_pos pos);
@@ -92,11 +207,31 @@ static struct buddy_tree_pos buddy_tree_root(void);
 static inline struct buddy_tree_pos buddy_tree_parent(struct buddy_tree_pos pos);
 static inline struct buddy_tree_pos buddy_tree_right_child(struct buddy_tree_pos pos);
 static inline struct buddy_tree_pos buddy_tree_left_child(struct buddy_tree_pos pos);
+static inline struct buddy_tree_pos buddy_tree_sibling(struct buddy_tree_pos pos);
+static bool buddy_tree_is_free(struct buddy_tree *t, struct buddy_tree_pos pos);
 static struct buddy_tree_pos buddy_tree_leftmost_child(struct buddy_tree *t);
+static struct buddy_tree_pos buddy_find_free(struct buddy *buddy, struct buddy_tree *t, uint8_t target_depth);
 static struct buddy_tree_pos buddy_tree_find_free(struct buddy_tree *t, uint8_t target_depth);
+static struct buddy_tree_pos buddy_tree_find_first(struct buddy_tree *t, uint8_t target_depth, unsigned int from_high);
+static struct buddy_tree_pos buddy_tree_find_best_fit(struct buddy_tree *t, uint8_t target_depth);
+static struct buddy_tree_pos buddy_tree_best_fit_walk(struct buddy_tree *t, size_t target_depth, struct buddy_tree_pos exclude);
+static size_t buddy_defrag_region_blocks(struct buddy *buddy, struct buddy_tree_pos region, size_t limit,
+    int (*movable)(void *block, void *context), void *context, struct buddy_move *moves);
+static struct buddy_tree_pos buddy_defrag_next_region(struct buddy *buddy, size_t target_depth, size_t max_moves,
+    int (*movable)(void *block, void *context), void *context, size_t *last_cost, size_t *last_index);
+static size_t buddy_defrag_place(struct buddy *buddy, struct buddy_tree_pos region, size_t max_moves,
+    int (*movable)(void *block, void *context), void *context, struct buddy_move *moves);
 static enum buddy_tree_release_status buddy_tree_release(struct buddy_tree *t, struct buddy_tree_pos pos);
 static bool buddy_tree_valid(struct buddy_tree *t, struct buddy_tree_pos pos);
 static void buddy_tree_mark(struct buddy_tree *t, struct buddy_tree_pos pos);
+static void buddy_tree_release_batch(struct buddy_tree *t, struct buddy_tree_pos pos, struct buddy_tree_pos next);
+static struct buddy_tree_pos buddy_tree_resize_in_place(struct buddy_tree *t, struct buddy_tree_pos pos, uint8_t target_depth);
+static size_t buddy_tree_free_blocks(struct buddy_tree *t, size_t depth);
+static inline size_t *buddy_tree_allocated_counts(struct buddy_tree *t);
+static unsigned char buddy_tree_fragmentation(struct buddy_tree *t);
+#ifdef BUDDY_FREE_INDEX
+static struct buddy_tree_pos buddy_free_index_find(struct buddy_tree *t, uint8_t depth);
+#endif //BUDDY_FREE_INDEX
 static size_t highest_bit_position(size_t value);
 static inline size_t ceiling_power_of_two(size_t value);
 
@@ -122,6 +257,15 @@ struct buddy *buddy_init(unsigned char *at, unsigned char *main, size_t memory_s
 }
 
 struct buddy *buddy_init_alignment(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment) {
+    return buddy_init_internal(at, main, memory_size, alignment, 0);
+}
+
+struct buddy *buddy_init_lazy(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment) {
+    return buddy_init_internal(at, main, memory_size, alignment, 1);
+}
+
+static struct buddy *buddy_init_internal(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment,
+        unsigned int zeroed) {
     size_t at_alignment, main_alignment, buddy_size, buddy_tree_order;
     struct buddy *buddy;
 
@@ -159,8 +303,10 @@ struct buddy *buddy_init_alignment(unsigned char *at, unsigned char *main, size_
     buddy->arena.main = main;
     buddy->memory_size = memory_size;
     buddy->buddy_flags = 0;
+    buddy->policy = BUDDY_POLICY_BUSIEST;
+    buddy->two_ended_depth = 0;
     buddy->alignment = alignment;
-    buddy_tree_init((unsigned char *)buddy + sizeof(*buddy), (uint8_t) buddy_tree_order);
+    buddy_tree_init((unsigned char *)buddy + sizeof(*buddy), (uint8_t) buddy_tree_order, zeroed);
     buddy_toggle_virtual_slots(buddy, 1);
     return buddy;
 }
@@ -170,6 +316,15 @@ struct buddy *buddy_embed(unsigned char *main, size_t memory_size) {
 }
 
 struct buddy *buddy_embed_alignment(unsigned char *main, size_t memory_size, size_t alignment) {
+    return buddy_embed_internal(main, memory_size, alignment, 0);
+}
+
+struct buddy *buddy_embed_lazy(unsigned char *main, size_t memory_size, size_t alignment) {
+    return buddy_embed_internal(main, memory_size, alignment, 1);
+}
+
+static struct buddy *buddy_embed_internal(unsigned char *main, size_t memory_size, size_t alignment,
+        unsigned int zeroed) {
     struct buddy_embed_check check_result;
     struct buddy *buddy;
 
@@ -184,7 +339,7 @@ struct buddy *buddy_embed_alignment(unsigned char *main, size_t memory_size, siz
         return NULL;
     }
 
-    buddy = buddy_init_alignment(main+check_result.offset, main, check_result.offset, alignment);
+    buddy = buddy_init_internal(main+check_result.offset, main, check_result.offset, alignment, zeroed);
     if (! buddy) { /* regular initialization failed */
         return NULL;
     }
@@ -194,6 +349,27 @@ struct buddy *buddy_embed_alignment(unsigned char *main, size_t memory_size, siz
     return buddy;
 }
 
+struct buddy *buddy_resize(struct buddy *buddy, size_t new_memory_size) {
+    if (buddy == NULL) {
+        return NULL;
+    }
+    if (buddy_relative_mode(buddy)) {
+        return buddy_resize_embedded(buddy, new_memory_size);
+    }
+    return buddy_resize_standard(buddy, new_memory_size);
+}
+
+void buddy_set_policy(struct buddy *buddy, enum buddy_policy policy, size_t threshold) {
+    if (buddy == NULL) {
+        return;
+    }
+    buddy->policy = policy;
+    buddy->two_ended_depth = 0;
+    if (policy == BUDDY_POLICY_TWO_ENDED && threshold <= buddy->memory_size) {
+        buddy->two_ended_depth = depth_for_size(buddy, threshold);
+    }
+}
+
 void *buddy_malloc(struct buddy *buddy, size_t requested_size) {
     size_t target_depth;
     struct buddy_tree *tree;
@@ -209,23 +385,36 @@ void *buddy_malloc(struct buddy *buddy, size_t requested_size) {
         requested_size = 1;
     }
     if (requested_size > buddy->memory_size) {
+        BUDDY_TRACE_FAILURE(BUDDY_TRACE_MALLOC_FAILED, requested_size, 0, NULL);
         return NULL;
     }
 
     target_depth = depth_for_size(buddy, requested_size);
-    BUDDY_PRINTF("buddy_malloc: requested size %zu, target depth %zu\n",
-        requested_size, target_depth);
     tree = buddy_tree(buddy);
 
+#ifdef BUDDY_FREE_INDEX
+    /* O(1) lookup of a free block of exactly the requested size */
+    pos = INVALID_POS;
+    if (buddy->policy == BUDDY_POLICY_BUSIEST) {
+        pos = buddy_free_index_find(tree, (uint8_t) target_depth);
+    }
+    if (! buddy_tree_valid(tree, pos)) {
+        /* O(log(n)) traversal through the tree, a larger block will be split */
+        pos = buddy_find_free(buddy, tree, (uint8_t) target_depth);
+    }
+#else //BUDDY_FREE_INDEX
     /* O(log(n)) traversal through the tree */
-    pos = buddy_tree_find_free(tree, (uint8_t) target_depth);
+    pos = buddy_find_free(buddy, tree, (uint8_t) target_depth);
+#endif //BUDDY_FREE_INDEX
 
     if (! buddy_tree_valid(tree, pos)) {
+        BUDDY_TRACE_FAILURE(BUDDY_TRACE_MALLOC_FAILED, requested_size, target_depth, NULL);
         return NULL; /* no slot found */
     }
 
     /* Allocate the slot */
     buddy_tree_mark(tree, pos);
+    BUDDY_TRACE_OPERATION(BUDDY_TRACE_MALLOC, requested_size, target_depth, address_for_position(buddy, pos));
 
     /* Find and return the actual memory address */
     return address_for_position(buddy, pos);
@@ -258,29 +447,49 @@ void buddy_dealloc(struct buddy *buddy, void *ptr) {
 
     /* Release the position */
     buddy_tree_release(tree, pos);
+    BUDDY_TRACE_OPERATION(BUDDY_TRACE_DEALLOC, size_for_depth(buddy, pos.depth), pos.depth, ptr);
 }
 
 void *buddy_realloc(struct buddy *buddy, void *ptr, size_t requested_size) {
+    return buddy_realloc_report(buddy, ptr, requested_size, NULL);
+}
+
+void *buddy_realloc_report(struct buddy *buddy, void *ptr, size_t requested_size,
+        enum buddy_realloc_outcome *outcome) {
     struct buddy_tree *tree;
     struct buddy_tree_pos origin, new_pos;
-    size_t current_depth, target_depth;
-    void *source, *destination;
+    size_t target_depth;
+    enum buddy_realloc_outcome ignored;
+    void *destination;
 
     /*
      * - NULL ptr degrades into malloc
      * - Zero size degrades into free
-     * - Same size as previous malloc is a no-op or a rellocation
-     * - Smaller size than previous *alloc decrease the allocated size with an optional rellocation
+     * - Same size as previous malloc is a no-op
+     * - Smaller size than previous *alloc splits the block in place, giving back the right-hand halves
      * - If the new allocation cannot be satisfied NULL is returned BUT the slot is preserved
-     * - Larger size than previous *alloc increase tha allocated size with an optional rellocation
+     * - Larger size than previous *alloc extends the block in place if its buddies are free,
+     *   otherwise the block is relocated
      * - unlike the C realloc, this reallocator does not copy data from the previous block to the 
      *   new block as for the intended use it's unnecessary
      */
+    if (outcome == NULL) {
+        outcome = &ignored;
+    }
+    *outcome = BUDDY_REALLOC_FAILED;
+    if (buddy == NULL) {
+        return NULL;
+    }
     if (ptr == NULL) {
-        return buddy_malloc(buddy, requested_size);
+        destination = buddy_malloc(buddy, requested_size);
+        if (destination) {
+            *outcome = BUDDY_REALLOC_MOVED;
+        }
+        return destination;
     }
     if (requested_size == 0) {
         buddy_dealloc(buddy, ptr);
+        *outcome = BUDDY_REALLOC_FREED;
         return NULL;
     }
     if (requested_size > buddy->memory_size) {
@@ -293,208 +502,839 @@ void *buddy_realloc(struct buddy *buddy, void *ptr, size_t requested_size) {
     if (! buddy_tree_valid(tree, origin)) {
         return NULL;
     }
-    current_depth = buddy_tree_depth(origin);
     target_depth = depth_for_size(buddy, requested_size);
 
+    /* Resize without moving if possible */
+    if (buddy_tree_valid(tree, buddy_tree_resize_in_place(tree, origin, (uint8_t) target_depth))) {
+        *outcome = BUDDY_REALLOC_IN_PLACE;
+        BUDDY_TRACE_OPERATION(BUDDY_TRACE_REALLOC_IN_PLACE, requested_size, target_depth, ptr);
+        return ptr;
+    }
+
     /* Release the position and perform a search */
     buddy_tree_release(tree, origin);
-    new_pos = buddy_tree_find_free(tree, (uint8_t) target_depth);
+    new_pos = buddy_find_free(buddy, tree, (uint8_t) target_depth);
 
     if (! buddy_tree_valid(tree, new_pos)) {
         /* allocation failure, restore mark and return null */
         buddy_tree_mark(tree, origin);
+        BUDDY_TRACE_FAILURE(BUDDY_TRACE_REALLOC_FAILED, requested_size, target_depth, ptr);
         return NULL;
     }
 
-    if (origin.index == new_pos.index) {
-        /* Allocated to the same slot, restore mark and return null */
-        buddy_tree_mark(tree, origin);
-        return ptr;
-    }
-
     destination = address_for_position(buddy, new_pos);
+    *outcome = destination == ptr ? BUDDY_REALLOC_IN_PLACE : BUDDY_REALLOC_MOVED;
+    BUDDY_TRACE_OPERATION(destination == ptr ? BUDDY_TRACE_REALLOC_IN_PLACE : BUDDY_TRACE_REALLOC_MOVED,
+        requested_size, target_depth, destination);
 
     /* Allocate and return */
     buddy_tree_mark(tree, new_pos);
     return destination;
 }
 
-static unsigned int is_valid_alignment(size_t alignment) {
-    return ceiling_power_of_two(alignment) == alignment;
-}
-
-static size_t buddy_effective_memory_size(struct buddy *buddy) {
-    return ceiling_power_of_two(buddy->memory_size);
-}
-
-static size_t buddy_tree_order_for_memory(size_t memory_size, size_t alignment) {
-    size_t blocks = memory_size / alignment;
-    return highest_bit_position(ceiling_power_of_two(blocks));
-}
+size_t buddy_malloc_batch(struct buddy *buddy, const size_t *requested_sizes, void **results, size_t count) {
+    size_t i;
 
-static size_t depth_for_size(struct buddy *buddy, size_t requested_size) {
-    size_t depth, effective_memory_size;
-    if (requested_size < buddy->alignment) {
-        requested_size = buddy->alignment;
+    if (buddy == NULL) {
+        return 0;
     }
-    depth = 1;
-    effective_memory_size = buddy_effective_memory_size(buddy);
-    while ((effective_memory_size / requested_size) >> 1u) {
-        depth++;
-        effective_memory_size >>= 1u;
+    for (i = 0; i < count; i++) {
+        results[i] = buddy_malloc(buddy, requested_sizes[i]);
+        if (results[i] == NULL) {
+            /* All or nothing, give back the blocks allocated so far */
+            buddy_dealloc_batch(buddy, results, i);
+            memset(results, 0, count * sizeof(void *));
+            return 0;
+        }
     }
-    return depth;
+    return count;
 }
 
-static inline size_t size_for_depth(struct buddy *buddy, size_t depth) {
-    return ceiling_power_of_two(buddy->memory_size) >> (depth-1);
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t lhs = (uintptr_t) *(void * const *) a;
+    uintptr_t rhs = (uintptr_t) *(void * const *) b;
+    return (lhs > rhs) - (lhs < rhs);
 }
 
-static struct buddy_tree *buddy_tree(struct buddy *buddy) {
-    return (struct buddy_tree*) ((unsigned char *)buddy + sizeof(*buddy));
-}
+/* Returns the position of the next block of a sorted batch that can be released */
+static struct buddy_tree_pos buddy_dealloc_batch_next(struct buddy *buddy, void **ptrs, size_t count, size_t *i) {
+    unsigned char *dst, *main;
+    struct buddy_tree *tree;
+    struct buddy_tree_pos pos;
 
-static size_t buddy_virtual_slots(struct buddy *buddy) {
-    size_t memory_size = buddy->memory_size;
-    size_t effective_memory_size = buddy_effective_memory_size(buddy);
-    if (effective_memory_size == memory_size) {
-        return 0;
+    tree = buddy_tree(buddy);
+    main = buddy_main(buddy);
+    for (; *i < count; (*i)++) {
+        dst = (unsigned char *) ptrs[*i];
+        if ((dst == NULL) || (*i && (ptrs[*i - 1] == ptrs[*i]))) {
+            continue; /* duplicates are adjacent after sorting */
+        }
+        if ((dst < main) || (dst >= (main + buddy->memory_size))) {
+            continue;
+        }
+        pos = position_for_address(buddy, dst);
+        if (! buddy_tree_valid(tree, pos)) {
+            continue;
+        }
+        if (buddy_tree_status(tree, pos) != buddy_tree_order(tree) - buddy_tree_depth(pos) + 1) {
+            continue; /* partially used, as in buddy_tree_release */
+        }
+        (*i)++;
+        return pos;
     }
-    return (effective_memory_size - memory_size) / buddy->alignment;
-}
-
-static unsigned char *address_for_position(struct buddy *buddy, struct buddy_tree_pos pos) {
-    size_t block_size = size_for_depth(buddy, buddy_tree_depth(pos));
-    size_t addr = block_size * buddy_tree_index(pos);
-    return buddy_main(buddy) + addr;
-}
-
-static struct buddy_tree_pos deepest_position_for_offset(struct buddy *buddy, size_t offset) {
-    size_t index = offset / buddy->alignment;
-    struct buddy_tree_pos pos = buddy_tree_leftmost_child(buddy_tree(buddy));
-    pos.index += index;
-    return pos;
+    return INVALID_POS;
 }
 
-static struct buddy_tree_pos position_for_address(struct buddy *buddy, const unsigned char *addr) {
-    unsigned char *main;
+void buddy_dealloc_batch(struct buddy *buddy, void **ptrs, size_t count) {
     struct buddy_tree *tree;
-    struct buddy_tree_pos pos;
-    size_t offset;
+    struct buddy_tree_pos pos, next;
+    size_t i;
 
-    main = buddy_main(buddy);
-    offset = (size_t) (addr - main);
-
-    if (offset % buddy->alignment) {
-        return INVALID_POS; /* invalid alignment */
+    if ((buddy == NULL) || (ptrs == NULL)) {
+        return;
     }
 
+    /*
+     * In address order, the blocks below an ancestor are adjacent, so each
+     * release only updates the ancestors below the one it shares with the
+     * next block, which is updated once all the blocks below it are released.
+     */
+    qsort(ptrs, count, sizeof(void *), compare_addresses);
     tree = buddy_tree(buddy);
-    pos = deepest_position_for_offset(buddy, offset);
+    i = 0;
+    pos = buddy_dealloc_batch_next(buddy, ptrs, count, &i);
+    while (buddy_tree_valid(tree, pos)) {
+        next = buddy_dealloc_batch_next(buddy, ptrs, count, &i);
+        buddy_tree_release_batch(tree, pos, next);
+        BUDDY_TRACE_OPERATION(BUDDY_TRACE_DEALLOC, size_for_depth(buddy, pos.depth), pos.depth,
+            address_for_position(buddy, pos));
+        pos = next;
+    }
+}
 
-    /* Find the actual allocated position tracking this address */
-    while (!buddy_tree_status(tree, pos)) {
-        pos = buddy_tree_parent(pos);
+void buddy_stats(struct buddy *buddy, struct buddy_stats *stats) {
+    struct buddy_tree *tree;
+    size_t *counts;
+    size_t depth, order, root_status, allocated_size;
 
-        if (!buddy_tree_valid(tree, pos)) {
-            return INVALID_POS;
-        }
+    memset(stats, 0, sizeof(*stats));
+    if (buddy == NULL) {
+        return;
     }
+    tree = buddy_tree(buddy);
+    order = buddy_tree_order(tree);
+    counts = buddy_tree_allocated_counts(tree);
+    allocated_size = 0;
+    for (depth = 1; depth <= order; depth++) {
+        stats->allocated_blocks += counts[depth];
+        stats->allocated_blocks_per_order[order - depth] = counts[depth];
+        allocated_size += counts[depth] * size_for_depth(buddy, depth);
+    }
+    stats->total_bytes = buddy->memory_size;
+    stats->free_bytes = buddy->memory_size - allocated_size;
+
+    /* A free position exists at every depth below the root status */
+    root_status = buddy_tree_status(tree, buddy_tree_root());
+    stats->largest_free_block = root_status < order ? size_for_depth(buddy, root_status + 1) : 0;
+    stats->fragmentation = buddy_tree_fragmentation(tree);
+}
+
+size_t buddy_defrag_plan(struct buddy *buddy, size_t requested_size, struct buddy_move *moves, size_t max_moves,
+        int (*movable)(void *block, void *context), void *context) {
+    size_t target_depth, last_cost, last_index, count;
+    struct buddy_tree *tree;
+    struct buddy_tree_pos region;
 
-    if (address_for_position(buddy, pos) != addr) {
-        return INVALID_POS; /* invalid alignment */
+    if (buddy == NULL) {
+        return SIZE_MAX;
+    }
+    if (requested_size == 0) {
+        requested_size = 1;
+    }
+    if (requested_size > buddy->memory_size) {
+        return SIZE_MAX;
+    }
+    target_depth = depth_for_size(buddy, requested_size);
+    tree = buddy_tree(buddy);
+    if (buddy_tree_valid(tree, buddy_tree_find_free(tree, (uint8_t) target_depth))) {
+        return 0; /* Nothing to move */
     }
 
-    return pos;
-}
-
-static unsigned int buddy_relative_mode(struct buddy *buddy) {
-    return (unsigned int)buddy->buddy_flags & BUDDY_RELATIVE_MODE;
-}
-
-static unsigned char *buddy_main(struct buddy *buddy) {
-    if (buddy_relative_mode(buddy)) {
-        return (unsigned char *)buddy - buddy->arena.main_offset;
+    /* Try the regions in order of blocks to move, until their blocks fit elsewhere */
+    last_cost = 0;
+    last_index = 0;
+    for (;;) {
+        region = buddy_defrag_next_region(buddy, target_depth, max_moves, movable, context, &last_cost, &last_index);
+        if (! buddy_tree_valid(tree, region)) {
+            return SIZE_MAX;
+        }
+        count = buddy_defrag_place(buddy, region, max_moves, movable, context, moves);
+        if (count != SIZE_MAX) {
+            return count;
+        }
     }
-    return buddy->arena.main;
 }
 
-static void buddy_toggle_virtual_slots(struct buddy *buddy, unsigned int state) {
-    size_t delta, memory_size, effective_memory_size;
+size_t buddy_defrag_apply(struct buddy *buddy, const struct buddy_move *moves, size_t count) {
     struct buddy_tree *tree;
-    struct buddy_tree_pos pos;
+    struct buddy_tree_pos from, to;
+    unsigned char *main;
+    size_t i, j;
 
-    memory_size = buddy->memory_size;
-    /* Mask/unmask the virtual space if memory is not a power of two */
-    effective_memory_size = buddy_effective_memory_size(buddy);
-    if (effective_memory_size == memory_size) {
-        return;
+    if (buddy == NULL) {
+        return 0;
     }
+    tree = buddy_tree(buddy);
+    main = buddy_main(buddy);
 
-    /* Get the area that we need to mask and pad it to alignment */
-    /* Node memory size is already aligned to buddy->alignment */
-    delta = effective_memory_size - memory_size;
+    /* Validate the whole plan before changing anything */
+    for (i = 0; i < count; i++) {
+        from = position_for_address(buddy, (unsigned char *) moves[i].from);
+        if (! buddy_tree_valid(tree, from)) {
+            return 0;
+        }
+        if (buddy_tree_status(tree, from) != buddy_tree_order(tree) - buddy_tree_depth(from) + 1) {
+            return 0; /* not an allocated block */
+        }
+        if (size_for_depth(buddy, buddy_tree_depth(from)) != moves[i].size) {
+            return 0;
+        }
+        if (((unsigned char *) moves[i].to < main) || ((unsigned char *) moves[i].to >= main + buddy->memory_size)) {
+            return 0;
+        }
+    }
 
-    tree = buddy_tree(buddy);
-    pos = buddy_tree_right_child(buddy_tree_root());
-    while (delta) {
-        size_t current_pos_size = size_for_depth(buddy, buddy_tree_depth(pos));
-        if (delta == current_pos_size) {
-            /* toggle current pos */
-            if (state) {
-                buddy_tree_mark(tree, pos);
-            }
-            else {
-                buddy_tree_release(tree, pos);
-            }
-            break;
+    /* Reserve the destinations, a destination that is not free undoes the plan */
+    for (i = 0; i < count; i++) {
+        from = position_for_address(buddy, (unsigned char *) moves[i].from);
+        to = deepest_position_for_offset(buddy, (size_t) ((unsigned char *) moves[i].to - main));
+        while (to.depth != from.depth) {
+            to = buddy_tree_parent(to);
         }
-        if (delta <= (current_pos_size / 2)) {
-            /* re-run for right child */
-            pos = buddy_tree_right_child(pos);
-            continue;
-        } else {
-            /* toggle right child */
-            if (state) {
-                buddy_tree_mark(tree, buddy_tree_right_child(pos));
+        if ((address_for_position(buddy, to) != moves[i].to) || ! buddy_tree_is_free(tree, to)) {
+            for (j = 0; j < i; j++) {
+                buddy_tree_release(tree, position_for_address(buddy, (unsigned char *) moves[j].to));
             }
-            else {
-                buddy_tree_release(tree, buddy_tree_right_child(pos));
-            }
-            /* reduce delta */
-            delta -= current_pos_size / 2;
-            /* re-run for left child */
-            pos = buddy_tree_left_child(pos);
-            continue;
+            return 0;
         }
+        buddy_tree_mark(tree, to);
     }
+    for (i = 0; i < count; i++) {
+        buddy_tree_release(tree, position_for_address(buddy, (unsigned char *) moves[i].from));
+    }
+    return count;
 }
 
-static struct buddy_embed_check buddy_embed_offset(size_t memory_size, size_t alignment) {
-    size_t buddy_size, offset;
-    struct buddy_embed_check check_result;
+size_t buddy_free_blocks(struct buddy *buddy, size_t order) {
+    struct buddy_tree *tree;
 
-    memset(&check_result, 0, sizeof(check_result));
-    check_result.can_fit = 1;
-    buddy_size = buddy_sizeof_alignment(memory_size, alignment);
-    if (buddy_size >= memory_size) {
-        check_result.can_fit = 0;
+    if (buddy == NULL) {
+        return 0;
     }
+    tree = buddy_tree(buddy);
+    if (order >= buddy_tree_order(tree)) {
+        return 0;
+    }
+    return buddy_tree_free_blocks(tree, buddy_tree_order(tree) - order);
+}
 
-    offset = memory_size - buddy_size;
-    if (offset % BUDDY_ALIGNOF(struct buddy) != 0) {
-        buddy_size += offset % BUDDY_ALIGNOF(struct buddy);
-        if (buddy_size >= memory_size) {
-            check_result.can_fit = 0;
-        }
-        offset = memory_size - buddy_size;
+unsigned char *buddy_arena(struct buddy *buddy) {
+    if (buddy == NULL) {
+        return NULL;
     }
+    return buddy_main(buddy);
+}
 
-    if (check_result.can_fit) {
-        check_result.offset = offset;
-        check_result.buddy_size = buddy_size;
+size_t buddy_alignment(struct buddy *buddy) {
+    if (buddy == NULL) {
+        return 0;
     }
-    return check_result;
+    return buddy->alignment;
+}
+
+size_t buddy_snapshot_size(struct buddy *buddy) {
+    if (buddy == NULL) {
+        return 0;
+    }
+    return sizeof(struct buddy_snapshot_header) + buddy_sizeof_alignment(buddy->memory_size, buddy->alignment);
+}
+
+size_t buddy_snapshot_save(struct buddy *buddy, unsigned char *to, size_t size) {
+    struct buddy_snapshot_header header;
+    size_t metadata_size;
+
+    if ((buddy == NULL) || (to == NULL)) {
+        return 0;
+    }
+    if (size < buddy_snapshot_size(buddy)) {
+        return 0;
+    }
+    metadata_size = buddy_sizeof_alignment(buddy->memory_size, buddy->alignment);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BDSN", sizeof(header.magic));
+    header.version = BUDDY_SNAPSHOT_VERSION;
+    header.layout = buddy_snapshot_layout();
+    header.word_size = sizeof(size_t);
+    header.metadata_size = metadata_size;
+    header.metadata_checksum = buddy_snapshot_checksum((unsigned char *) buddy, metadata_size);
+    memcpy(&header.saved_arena, &buddy->arena, sizeof(buddy->arena));
+    header.saved_flags = buddy->buddy_flags;
+    header.header_checksum = buddy_snapshot_checksum((unsigned char *) &header,
+        offsetof(struct buddy_snapshot_header, header_checksum));
+
+    memcpy(to, &header, sizeof(header));
+    memcpy(to + sizeof(header), buddy, metadata_size);
+    return sizeof(header) + metadata_size;
+}
+
+struct buddy *buddy_snapshot_load(unsigned char *from, size_t size, unsigned char *main) {
+    struct buddy_snapshot_header *header;
+    struct buddy *buddy;
+
+    if ((from == NULL) || (main == NULL)) {
+        return NULL;
+    }
+    if ((((uintptr_t) from) % BUDDY_ALIGNOF(struct buddy)) || (((uintptr_t) main) % BUDDY_ALIGNOF(size_t))) {
+        return NULL;
+    }
+    if (size < sizeof(*header) + sizeof(*buddy)) {
+        return NULL;
+    }
+
+    /* The header tells if the snapshot is complete and was saved by a compatible build */
+    header = (struct buddy_snapshot_header *) from;
+    if ((memcmp(header->magic, "BDSN", sizeof(header->magic)) != 0)
+            || (header->version != BUDDY_SNAPSHOT_VERSION)
+            || (header->layout != buddy_snapshot_layout())
+            || (header->word_size != sizeof(size_t))
+            || (header->metadata_size > size - sizeof(*header))) {
+        return NULL;
+    }
+    if (header->header_checksum != buddy_snapshot_checksum((unsigned char *) header,
+            offsetof(struct buddy_snapshot_header, header_checksum))) {
+        return NULL;
+    }
+
+    /* The geometry has to match the metadata size, no need to walk the tree */
+    buddy = (struct buddy *) (from + sizeof(*header));
+    if (header->metadata_size != buddy_sizeof_alignment(buddy->memory_size, buddy->alignment)) {
+        return NULL;
+    }
+    if (buddy_tree_order(buddy_tree(buddy))
+            != buddy_tree_order_for_memory(buddy->memory_size, buddy->alignment)) {
+        return NULL;
+    }
+
+    /* The metadata is not at the end of the arena any more */
+    buddy->buddy_flags &= ~((size_t) BUDDY_RELATIVE_MODE);
+    buddy->arena.main = main;
+    return buddy;
+}
+
+size_t buddy_snapshot_sync(unsigned char *from, size_t size) {
+    struct buddy_snapshot_header *header = (struct buddy_snapshot_header *) from;
+    struct buddy *buddy;
+
+    if ((from == NULL) || (((uintptr_t) from) % BUDDY_ALIGNOF(struct buddy))) {
+        return 0;
+    }
+    if ((size < sizeof(*header) + sizeof(*buddy)) || (header->metadata_size > size - sizeof(*header))) {
+        return 0;
+    }
+    if (header->header_checksum != buddy_snapshot_checksum((unsigned char *) header,
+            offsetof(struct buddy_snapshot_header, header_checksum))) {
+        return 0;
+    }
+
+    /* Undo the binding written by buddy_snapshot_load, then seal the metadata as it is now */
+    buddy = (struct buddy *) (from + sizeof(*header));
+    memcpy(&buddy->arena, &header->saved_arena, sizeof(buddy->arena));
+    buddy->buddy_flags = (size_t) header->saved_flags;
+    header->metadata_checksum = buddy_snapshot_checksum((unsigned char *) buddy, (size_t) header->metadata_size);
+    header->header_checksum = buddy_snapshot_checksum((unsigned char *) header,
+        offsetof(struct buddy_snapshot_header, header_checksum));
+    return sizeof(*header) + (size_t) header->metadata_size;
+}
+
+size_t buddy_snapshot_verify(const unsigned char *from, size_t size) {
+    const struct buddy_snapshot_header *header = (const struct buddy_snapshot_header *) from;
+
+    if ((from == NULL) || (size < sizeof(*header))) {
+        return 0;
+    }
+    if ((header->metadata_size > size - sizeof(*header))
+            || (header->metadata_checksum != buddy_snapshot_checksum(from + sizeof(*header),
+                (size_t) header->metadata_size))) {
+        return 0;
+    }
+    return sizeof(*header) + (size_t) header->metadata_size;
+}
+
+static unsigned int is_valid_alignment(size_t alignment) {
+    return ceiling_power_of_two(alignment) == alignment;
+}
+
+/* Build options that change the metadata layout, a snapshot is only loaded by a build with the same ones */
+static uint32_t buddy_snapshot_layout(void) {
+    uint32_t layout = 0;
+#ifdef BUDDY_WORD_BITSET
+    layout |= 1u;
+#endif //BUDDY_WORD_BITSET
+#ifdef BUDDY_FREE_INDEX
+    layout |= 2u;
+#endif //BUDDY_FREE_INDEX
+#ifdef BUDDY_BLOCKED_LAYOUT
+    layout |= 4u;
+#endif //BUDDY_BLOCKED_LAYOUT
+#ifdef BUDDY_FIXED_STATUS
+    layout |= 8u;
+#endif //BUDDY_FIXED_STATUS
+    return layout;
+}
+
+/* 64 bit FNV-1a */
+static uint64_t buddy_snapshot_checksum(const unsigned char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t buddy_effective_memory_size(struct buddy *buddy) {
+    return ceiling_power_of_two(buddy->memory_size);
+}
+
+static size_t buddy_tree_order_for_memory(size_t memory_size, size_t alignment) {
+    size_t blocks = memory_size / alignment;
+    return highest_bit_position(ceiling_power_of_two(blocks));
+}
+
+static size_t depth_for_size(struct buddy *buddy, size_t requested_size) {
+    size_t depth, effective_memory_size;
+    if (requested_size < buddy->alignment) {
+        requested_size = buddy->alignment;
+    }
+    depth = 1;
+    effective_memory_size = buddy_effective_memory_size(buddy);
+    while ((effective_memory_size / requested_size) >> 1u) {
+        depth++;
+        effective_memory_size >>= 1u;
+    }
+    return depth;
+}
+
+static struct buddy_tree_pos buddy_find_free(struct buddy *buddy, struct buddy_tree *t, uint8_t target_depth) {
+    switch (buddy->policy) {
+        case BUDDY_POLICY_LOWEST:
+            return buddy_tree_find_first(t, target_depth, 0);
+        case BUDDY_POLICY_BEST_FIT:
+            return buddy_tree_find_best_fit(t, target_depth);
+        case BUDDY_POLICY_TWO_ENDED:
+            /* Large blocks from the high end, so small ones do not split them */
+            return buddy_tree_find_first(t, target_depth, target_depth <= buddy->two_ended_depth);
+        default:
+            return buddy_tree_find_free(t, target_depth);
+    }
+}
+
+/*
+ * Returns true if pos was marked as a block, rather than being full because
+ * both its children are
+ */
+static bool buddy_tree_is_block(struct buddy_tree *t, struct buddy_tree_pos pos, size_t status) {
+    if (status != buddy_tree_order(t) - buddy_tree_depth(pos) + 1) {
+        return false;
+    }
+    return (buddy_tree_depth(pos) == buddy_tree_order(t)) || ! buddy_tree_status(t, buddy_tree_left_child(pos));
+}
+
+/*
+ * Walks the allocated blocks inside region, storing them in moves if not NULL.
+ * Returns their number, or SIZE_MAX if there are more than limit or one of them
+ * cannot be moved.
+ */
+static size_t buddy_defrag_region_blocks(struct buddy *buddy, struct buddy_tree_pos region, size_t limit,
+        int (*movable)(void *block, void *context), void *context, struct buddy_move *moves) {
+    struct buddy_tree *tree = buddy_tree(buddy);
+    struct buddy_tree_pos pos = region;
+    unsigned char *block;
+    size_t status, count = 0;
+
+    for (;;) {
+        status = buddy_tree_status(tree, pos);
+        if (buddy_tree_is_block(tree, pos, status)) {
+            block = address_for_position(buddy, pos);
+            if (block >= buddy_main(buddy) + buddy->memory_size) {
+                return SIZE_MAX; /* virtual slot */
+            }
+            if ((count == limit) || (movable && ! movable(block, context))) {
+                return SIZE_MAX;
+            }
+            if (moves) {
+                moves[count].from = block;
+                moves[count].to = NULL;
+                moves[count].size = size_for_depth(buddy, buddy_tree_depth(pos));
+            }
+            count++;
+        } else if (status) {
+            pos = buddy_tree_left_child(pos);
+            continue;
+        }
+        /* Move to the next subtree on the right, without leaving the region */
+        while ((pos.index != region.index) && (pos.index & 1u)) {
+            pos = buddy_tree_parent(pos);
+        }
+        if (pos.index == region.index) {
+            return count;
+        }
+        pos = buddy_tree_sibling(pos);
+    }
+}
+
+/*
+ * Returns the region at target_depth with the fewest blocks to move, the
+ * leftmost one on ties, that comes after the region described by last_cost and
+ * last_index, which are updated. Regions are walked from the root, skipping the
+ * subtrees of the allocated blocks larger than a region.
+ */
+static struct buddy_tree_pos buddy_defrag_next_region(struct buddy *buddy, size_t target_depth, size_t max_moves,
+        int (*movable)(void *block, void *context), void *context, size_t *last_cost, size_t *last_index) {
+    struct buddy_tree *tree = buddy_tree(buddy);
+    struct buddy_tree_pos pos = buddy_tree_root();
+    struct buddy_tree_pos best = INVALID_POS;
+    size_t status, cost, best_cost = SIZE_MAX;
+
+    for (;;) {
+        status = buddy_tree_status(tree, pos);
+        if (pos.depth < target_depth) {
+            if (status && ! buddy_tree_is_block(tree, pos, status)) {
+                pos = buddy_tree_left_child(pos);
+                continue;
+            }
+        } else {
+            cost = buddy_defrag_region_blocks(buddy, pos, max_moves, movable, context, NULL);
+            if ((cost != SIZE_MAX) && (cost < best_cost)
+                    && ((cost > *last_cost) || ((cost == *last_cost) && (pos.index > *last_index)))) {
+                best = pos;
+                best_cost = cost;
+            }
+        }
+        /* Move to the next subtree on the right */
+        while (pos.index & 1u) {
+            pos = buddy_tree_parent(pos);
+        }
+        if (pos.index == 0) {
+            break;
+        }
+        pos = buddy_tree_sibling(pos);
+    }
+    if (buddy_tree_valid(tree, best)) {
+        *last_cost = best_cost;
+        *last_index = best.index;
+    }
+    return best;
+}
+
+static int compare_move_sizes(const void *a, const void *b) {
+    size_t lhs = ((const struct buddy_move *) a)->size;
+    size_t rhs = ((const struct buddy_move *) b)->size;
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+/*
+ * Finds a destination outside region for each of its blocks, largest first.
+ * The destinations are marked while planning and released before returning,
+ * so the tree is left as it was. Returns the number of moves, or SIZE_MAX if
+ * the blocks do not fit.
+ */
+static size_t buddy_defrag_place(struct buddy *buddy, struct buddy_tree_pos region, size_t max_moves,
+        int (*movable)(void *block, void *context), void *context, struct buddy_move *moves) {
+    struct buddy_tree *tree = buddy_tree(buddy);
+    struct buddy_tree_pos dest;
+    size_t i, depth, placed, count;
+
+    count = buddy_defrag_region_blocks(buddy, region, max_moves, movable, context, moves);
+    if (count == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    qsort(moves, count, sizeof(struct buddy_move), compare_move_sizes);
+    for (placed = 0; placed < count; placed++) {
+        depth = depth_for_size(buddy, moves[placed].size);
+        dest = buddy_tree_best_fit_walk(tree, depth, region);
+        if (! buddy_tree_valid(tree, dest)) {
+            break;
+        }
+        while (dest.depth != depth) {
+            dest = buddy_tree_left_child(dest);
+        }
+        moves[placed].to = address_for_position(buddy, dest);
+        buddy_tree_mark(tree, dest);
+    }
+    for (i = 0; i < placed; i++) {
+        buddy_tree_release(tree, position_for_address(buddy, (unsigned char *) moves[i].to));
+    }
+    return placed == count ? count : SIZE_MAX;
+}
+
+static inline size_t size_for_depth(struct buddy *buddy, size_t depth) {
+    return ceiling_power_of_two(buddy->memory_size) >> (depth-1);
+}
+
+static struct buddy_tree *buddy_tree(struct buddy *buddy) {
+    return (struct buddy_tree*) ((unsigned char *)buddy + sizeof(*buddy));
+}
+
+static size_t buddy_virtual_slots(struct buddy *buddy) {
+    size_t memory_size = buddy->memory_size;
+    size_t effective_memory_size = buddy_effective_memory_size(buddy);
+    if (effective_memory_size == memory_size) {
+        return 0;
+    }
+    return (effective_memory_size - memory_size) / buddy->alignment;
+}
+
+static unsigned char *address_for_position(struct buddy *buddy, struct buddy_tree_pos pos) {
+    size_t block_size = size_for_depth(buddy, buddy_tree_depth(pos));
+    size_t addr = block_size * buddy_tree_index(pos);
+    return buddy_main(buddy) + addr;
+}
+
+static struct buddy_tree_pos deepest_position_for_offset(struct buddy *buddy, size_t offset) {
+    size_t index = offset / buddy->alignment;
+    struct buddy_tree_pos pos = buddy_tree_leftmost_child(buddy_tree(buddy));
+    pos.index += index;
+    return pos;
+}
+
+static struct buddy_tree_pos position_for_address(struct buddy *buddy, const unsigned char *addr) {
+    unsigned char *main;
+    struct buddy_tree *tree;
+    struct buddy_tree_pos pos;
+    size_t offset;
+
+    main = buddy_main(buddy);
+    offset = (size_t) (addr - main);
+
+    if (offset % buddy->alignment) {
+        return INVALID_POS; /* invalid alignment */
+    }
+
+    tree = buddy_tree(buddy);
+    pos = deepest_position_for_offset(buddy, offset);
+
+    /* Find the actual allocated position tracking this address */
+    while (!buddy_tree_status(tree, pos)) {
+        pos = buddy_tree_parent(pos);
+
+        if (!buddy_tree_valid(tree, pos)) {
+            return INVALID_POS;
+        }
+    }
+
+    if (address_for_position(buddy, pos) != addr) {
+        return INVALID_POS; /* invalid alignment */
+    }
+
+    return pos;
+}
+
+static unsigned int buddy_relative_mode(struct buddy *buddy) {
+    return (unsigned int)buddy->buddy_flags & BUDDY_RELATIVE_MODE;
+}
+
+static unsigned char *buddy_main(struct buddy *buddy) {
+    if (buddy_relative_mode(buddy)) {
+        return (unsigned char *)buddy - buddy->arena.main_offset;
+    }
+    return buddy->arena.main;
+}
+
+static void buddy_toggle_virtual_slot(struct buddy_tree *tree, struct buddy_tree_pos pos, unsigned int state) {
+    if (state) {
+        buddy_tree_mark(tree, pos);
+        buddy_tree_allocated_counts(tree)[pos.depth]--; /* not an allocation */
+    }
+    else {
+        buddy_tree_release(tree, pos);
+        buddy_tree_allocated_counts(tree)[pos.depth]++;
+    }
+}
+
+static void buddy_toggle_virtual_slots(struct buddy *buddy, unsigned int state) {
+    size_t delta, memory_size, effective_memory_size;
+    struct buddy_tree *tree;
+    struct buddy_tree_pos pos;
+
+    memory_size = buddy->memory_size;
+    /* Mask/unmask the virtual space if memory is not a power of two */
+    effective_memory_size = buddy_effective_memory_size(buddy);
+    if (effective_memory_size == memory_size) {
+        return;
+    }
+
+    /* Get the area that we need to mask and pad it to alignment */
+    /* Node memory size is already aligned to buddy->alignment */
+    delta = effective_memory_size - memory_size;
+
+    tree = buddy_tree(buddy);
+    pos = buddy_tree_right_child(buddy_tree_root());
+    while (delta) {
+        size_t current_pos_size = size_for_depth(buddy, buddy_tree_depth(pos));
+        if (delta == current_pos_size) {
+            /* toggle current pos */
+            buddy_toggle_virtual_slot(tree, pos, state);
+            break;
+        }
+        if (delta <= (current_pos_size / 2)) {
+            /* re-run for right child */
+            pos = buddy_tree_right_child(pos);
+            continue;
+        } else {
+            /* toggle right child */
+            buddy_toggle_virtual_slot(tree, buddy_tree_right_child(pos), state);
+            /* reduce delta */
+            delta -= current_pos_size / 2;
+            /* re-run for left child */
+            pos = buddy_tree_left_child(pos);
+            continue;
+        }
+    }
+}
+
+static struct buddy_embed_check buddy_embed_offset(size_t memory_size, size_t alignment) {
+    size_t buddy_size, offset;
+    struct buddy_embed_check check_result;
+
+    memset(&check_result, 0, sizeof(check_result));
+    check_result.can_fit = 1;
+    buddy_size = buddy_sizeof_alignment(memory_size, alignment);
+    if (buddy_size >= memory_size) {
+        check_result.can_fit = 0;
+    }
+
+    offset = memory_size - buddy_size;
+    if (offset % BUDDY_ALIGNOF(struct buddy) != 0) {
+        buddy_size += offset % BUDDY_ALIGNOF(struct buddy);
+        if (buddy_size >= memory_size) {
+            check_result.can_fit = 0;
+        }
+        offset = memory_size - buddy_size;
+    }
+
+    if (check_result.can_fit) {
+        check_result.offset = offset;
+        check_result.buddy_size = buddy_size;
+    }
+    return check_result;
+}
+
+static struct buddy *buddy_resize_standard(struct buddy *buddy, size_t new_memory_size) {
+    size_t old_order, new_order, delta;
+    struct buddy_tree *tree;
+
+    /* Trim down memory to alignment */
+    if (new_memory_size % buddy->alignment) {
+        new_memory_size -= (new_memory_size % buddy->alignment);
+    }
+    if (new_memory_size < buddy->alignment) {
+        return NULL; /* invalid */
+    }
+    if (new_memory_size == buddy->memory_size) {
+        return buddy;
+    }
+    /* Allocations cannot be dropped */
+    if ((new_memory_size < buddy->memory_size)
+            && !buddy_is_range_free(buddy, new_memory_size, buddy->memory_size)) {
+        return NULL;
+    }
+
+    tree = buddy_tree(buddy);
+    old_order = buddy_tree_order(tree);
+    new_order = buddy_tree_order_for_memory(new_memory_size, buddy->alignment);
+#ifdef BUDDY_BLOCKED_LAYOUT
+    /* The blocks do not move to the next depth as a whole, unlike the rows */
+    if (new_order != old_order) {
+        return NULL;
+    }
+#endif //BUDDY_BLOCKED_LAYOUT
+
+    /* Unmask the virtual space of the old size, the tree can then be resized */
+    buddy_toggle_virtual_slots(buddy, 0);
+    buddy_tree_resize(tree, (uint8_t) new_order);
+    buddy->memory_size = new_memory_size;
+    buddy_toggle_virtual_slots(buddy, 1);
+
+    /* The same threshold is one depth further from the root for every order */
+    if (buddy->two_ended_depth) {
+        if (new_order > old_order) {
+            buddy->two_ended_depth += new_order - old_order;
+        } else {
+            delta = old_order - new_order;
+            buddy->two_ended_depth = buddy->two_ended_depth > delta ? buddy->two_ended_depth - delta : 0;
+        }
+    }
+    return buddy;
+}
+
+static struct buddy *buddy_resize_embedded(struct buddy *buddy, size_t new_memory_size) {
+    struct buddy_embed_check check_result;
+    unsigned char *main, *buddy_destination;
+
+    check_result = buddy_embed_offset(new_memory_size, buddy->alignment);
+    if (! check_result.can_fit) {
+        return NULL;
+    }
+    main = buddy_main(buddy);
+    buddy_destination = main + check_result.offset;
+
+    if (check_result.offset < buddy->memory_size) {
+        /* Resize in place, the tail that will hold the metadata must be free */
+        if (! buddy_resize_standard(buddy, check_result.offset)) {
+            return NULL;
+        }
+        memmove(buddy_destination, buddy, buddy_sizeof_alignment(buddy->memory_size, buddy->alignment));
+    } else {
+        /* Move first, there is no room to grow the metadata in place */
+        memmove(buddy_destination, buddy, buddy_sizeof_alignment(buddy->memory_size, buddy->alignment));
+        if (! buddy_resize_standard((struct buddy *) buddy_destination, check_result.offset)) {
+            /* The copy is exact, moving it back restores the buddy */
+            memmove(buddy, buddy_destination, buddy_sizeof_alignment(((struct buddy *) buddy_destination)->memory_size,
+                ((struct buddy *) buddy_destination)->alignment));
+            return NULL;
+        }
+    }
+
+    buddy = (struct buddy *) buddy_destination;
+    buddy->arena.main_offset = buddy_destination - main;
+    return buddy;
+}
+
+/* Returns true if no allocation overlaps the arena offsets [from, to) */
+static bool buddy_is_range_free(struct buddy *buddy, size_t from, size_t to) {
+    size_t effective_memory_size, block_size;
+    struct buddy_tree *tree;
+    struct buddy_tree_pos pos;
+
+    tree = buddy_tree(buddy);
+    effective_memory_size = buddy_effective_memory_size(buddy);
+    while (from < to) {
+        /* Check the largest position starting at "from" within the range */
+        block_size = buddy->alignment;
+        pos = deepest_position_for_offset(buddy, from);
+        while ((block_size < effective_memory_size) && ((from % (block_size * 2)) == 0)
+                && (from + (block_size * 2) <= to)) {
+            block_size *= 2;
+            pos = buddy_tree_parent(pos);
+        }
+        if (! buddy_tree_is_free(tree, pos)) {
+            return false;
+        }
+        from += block_size;
+    }
+    return true;
 }
 
 /*
@@ -504,6 +1344,8 @@ static struct buddy_embed_check buddy_embed_offset(size_t memory_size, size_t al
 struct buddy_tree {
     size_t upper_pos_bound;
     size_t size_for_order_offset;
+    size_t free_size;    /* sum of the sizes of the free blocks, in units of the smallest block */
+    size_t free_quality; /* sum of the squared sizes of the free blocks */
     uint8_t order;
     uint8_t flags;
 };
@@ -513,27 +1355,76 @@ struct internal_position {
     size_t bitset_location;
 };
 
+#ifndef BUDDY_BLOCKED_LAYOUT
+/* The memoization holds the offset of each node width */
+#define BUDDY_TREE_LAYOUT_WORDS 1u
+#else //BUDDY_BLOCKED_LAYOUT
+/* The memoization holds, per depth: offset of the band of blocks, bits of a
+ * block, offset of the depth in a block, bits of the index within a block */
+#define BUDDY_TREE_LAYOUT_WORDS 4u
+/* Blocks are sized to fit a cache line */
+#define BUDDY_TREE_LINE_BITS 512u
+#endif //BUDDY_BLOCKED_LAYOUT
+
 static inline size_t size_for_order(uint8_t order, uint8_t to);
+static size_t buddy_tree_bitset_bits(uint8_t order);
+#ifdef BUDDY_BLOCKED_LAYOUT
+static size_t buddy_tree_blocked_layout(uint8_t order, size_t *layout);
+#endif //BUDDY_BLOCKED_LAYOUT
 static inline size_t buddy_tree_index_internal(struct buddy_tree_pos pos);
 static struct buddy_tree_pos buddy_tree_leftmost_child_internal(size_t tree_order);
 static struct internal_position buddy_tree_internal_position_order(size_t tree_order, struct buddy_tree_pos pos);
 static struct internal_position buddy_tree_internal_position_tree(struct buddy_tree *t, struct buddy_tree_pos pos);
 static void update_parent_chain(struct buddy_tree *t, struct buddy_tree_pos pos,struct internal_position pos_internal, size_t size_current);
+static void update_parent_chain_until(struct buddy_tree *t, struct buddy_tree_pos pos,
+    struct internal_position pos_internal, size_t size_current, struct buddy_tree_pos stop);
+static struct buddy_tree_pos buddy_tree_common_ancestor(struct buddy_tree_pos a, struct buddy_tree_pos b);
 static inline unsigned char *buddy_tree_bits(struct buddy_tree *t);
 static void buddy_tree_populate_size_for_order(struct buddy_tree *t);
+#ifndef BUDDY_BLOCKED_LAYOUT
 static inline size_t buddy_tree_size_for_order(struct buddy_tree *t, uint8_t to);
+#else //BUDDY_BLOCKED_LAYOUT
+static inline size_t *buddy_tree_layout(struct buddy_tree *t);
+#endif //BUDDY_BLOCKED_LAYOUT
 static void write_to_internal_position(struct buddy_tree* t, struct internal_position pos, size_t value);
 static size_t read_from_internal_position(unsigned char *bitset, struct internal_position pos);
 static inline unsigned char compare_with_internal_position(unsigned char *bitset, struct internal_position pos, size_t value);
+static inline size_t internal_position_stride(struct internal_position pos);
+static inline void buddy_tree_free_block_add(struct buddy_tree *t, struct buddy_tree_pos pos);
+static inline void buddy_tree_free_block_remove(struct buddy_tree *t, struct buddy_tree_pos pos);
+static void buddy_tree_free_split(struct buddy_tree *t, struct buddy_tree_pos pos);
+static void buddy_tree_free_merge(struct buddy_tree *t, struct buddy_tree_pos pos);
+static unsigned char buddy_tree_fragmentation_walk(struct buddy_tree *t);
+#ifdef BUDDY_FREE_INDEX
+static size_t buddy_free_index_sizeof(uint8_t order);
+static void buddy_free_index_insert(struct buddy_tree *t, struct buddy_tree_pos pos);
+static void buddy_free_index_remove(struct buddy_tree *t, struct buddy_tree_pos pos);
+static bool buddy_free_index_test(struct buddy_tree *t, struct buddy_tree_pos pos);
+static size_t *buddy_free_index_counts(struct buddy_tree *t);
+static void buddy_free_index_split(struct buddy_tree *t, struct buddy_tree_pos pos);
+static void buddy_free_index_merge(struct buddy_tree *t, struct buddy_tree_pos pos);
+#endif //BUDDY_FREE_INDEX
 size_t bitset_sizeof(size_t elements);
 static inline size_t two_to_the_power_of(size_t order);
 static inline struct bitset_range bitset_range(size_t from_pos, size_t to_pos);
-static void bitset_set_range(unsigned char *bitset, struct bitset_range range);
 static inline bool bitset_test(const unsigned char *bitset, size_t pos);
-static size_t bitset_count_range(unsigned char *bitset, struct bitset_range range);
 static inline size_t integer_square_root(size_t op);
+#ifndef BUDDY_WORD_BITSET
 static inline unsigned int popcount_byte(unsigned char b);
+#else //BUDDY_WORD_BITSET
+static inline unsigned int popcount_word(size_t w);
+static inline size_t bitset_word_mask(uint8_t from, uint8_t to);
+#endif //BUDDY_WORD_BITSET
+static inline unsigned int ctz_word(size_t w);
+#ifndef BUDDY_FIXED_STATUS
+static void bitset_set_range(unsigned char *bitset, struct bitset_range range);
 static void bitset_clear_range(unsigned char *bitset,  struct bitset_range range);
+static size_t bitset_count_range(unsigned char *bitset, struct bitset_range range);
+static void bitset_shift_left(unsigned char *bitset, size_t from_pos, size_t to_pos, size_t by);
+static void bitset_shift_right(unsigned char *bitset, size_t from_pos, size_t to_pos, size_t by);
+#endif //BUDDY_FIXED_STATUS
+static struct buddy_tree_walk_state buddy_tree_walk_state_root(void);
+static unsigned int buddy_tree_walk(struct buddy_tree *t, struct buddy_tree_walk_state *state);
 
 static inline size_t size_for_order(uint8_t order, uint8_t to) {
     size_t result = 0;
@@ -549,51 +1440,288 @@ static inline size_t size_for_order(uint8_t order, uint8_t to) {
 static inline struct internal_position buddy_tree_internal_position_order(
         size_t tree_order, struct buddy_tree_pos pos) {
     struct internal_position p;
+#ifndef BUDDY_FIXED_STATUS
     size_t total_offset, local_index;
+#endif //BUDDY_FIXED_STATUS
 
     p.local_offset = tree_order - buddy_tree_depth(pos) + 1;
+#ifndef BUDDY_FIXED_STATUS
     total_offset = size_for_order((uint8_t) tree_order, (uint8_t) p.local_offset);
     local_index = buddy_tree_index_internal(pos);
     p.bitset_location = total_offset + (p.local_offset * local_index);
+#else //BUDDY_FIXED_STATUS
+    p.bitset_location = pos.index; /* one byte per position */
+#endif //BUDDY_FIXED_STATUS
     return p;
 }
 
+#ifndef BUDDY_BLOCKED_LAYOUT
 static inline struct internal_position buddy_tree_internal_position_tree(
         struct buddy_tree *t, struct buddy_tree_pos pos) {
     struct internal_position p;
+#ifndef BUDDY_FIXED_STATUS
     size_t total_offset, local_index;
+#endif //BUDDY_FIXED_STATUS
 
     p.local_offset = t->order - buddy_tree_depth(pos) + 1;
+#ifndef BUDDY_FIXED_STATUS
     total_offset = buddy_tree_size_for_order(t, (uint8_t) p.local_offset);
     local_index = buddy_tree_index_internal(pos);
     p.bitset_location = total_offset + (p.local_offset * local_index);
+#else //BUDDY_FIXED_STATUS
+    p.bitset_location = pos.index; /* one byte per position */
+#endif //BUDDY_FIXED_STATUS
     return p;
 }
+#else //BUDDY_BLOCKED_LAYOUT
+static inline struct internal_position buddy_tree_internal_position_tree(
+        struct buddy_tree *t, struct buddy_tree_pos pos) {
+    struct internal_position p;
+    size_t local_index, *layout;
+
+    p.local_offset = t->order - buddy_tree_depth(pos) + 1;
+    layout = buddy_tree_layout(t) + (buddy_tree_depth(pos) * BUDDY_TREE_LAYOUT_WORDS);
+    local_index = buddy_tree_index_internal(pos);
+    /* Siblings share a block, and are next to each other within their depth */
+    p.bitset_location = layout[0] + ((local_index >> layout[3]) * layout[1]) + layout[2]
+        + (p.local_offset * (local_index & (two_to_the_power_of(layout[3]) - 1u)));
+    return p;
+}
+
+/*
+ * The bitset is split in bands of consecutive depths. The nodes of a band
+ * under the same parent, two siblings and their descendants within the band,
+ * form a block of at most BUDDY_TREE_LINE_BITS bits, in depth order. The root
+ * is alone in the first block. Fills layout, if not NULL, with
+ * BUDDY_TREE_LAYOUT_WORDS words per depth and returns the bits of the bitset.
+ */
+static size_t buddy_tree_blocked_layout(uint8_t order, size_t *layout) {
+    size_t top, levels, depth, nodes, block_bits, level_bits, offset;
+
+    offset = 0;
+    for (top = 1; top <= order; top += levels) {
+        /* As many depths as fit in a line, at least one */
+        block_bits = 0;
+        nodes = (top == 1) ? 1u : 2u;
+        for (levels = 0; top + levels <= order; levels++) {
+            level_bits = (nodes << levels) * (order - (top + levels) + 1u);
+            if ((levels != 0) && (block_bits + level_bits > BUDDY_TREE_LINE_BITS)) {
+                break;
+            }
+            block_bits += level_bits;
+        }
+        /* Padded to a power of two and aligned to it, a block never straddles a line */
+        block_bits = ceiling_power_of_two(block_bits);
+        offset += (block_bits - (offset % block_bits)) % block_bits;
+
+        if (layout != NULL) {
+            level_bits = 0;
+            for (depth = top; depth < top + levels; depth++) {
+                layout[(depth * BUDDY_TREE_LAYOUT_WORDS) + 0] = offset;
+                layout[(depth * BUDDY_TREE_LAYOUT_WORDS) + 1] = block_bits;
+                layout[(depth * BUDDY_TREE_LAYOUT_WORDS) + 2] = level_bits;
+                layout[(depth * BUDDY_TREE_LAYOUT_WORDS) + 3] = depth - top + ((top == 1) ? 0u : 1u);
+                level_bits += (nodes << (depth - top)) * (order - depth + 1u);
+            }
+        }
+
+        /* One block per node of the depth above the band */
+        offset += block_bits * ((top == 1) ? 1u : two_to_the_power_of(top - 2u));
+    }
+    return offset;
+}
+#endif //BUDDY_BLOCKED_LAYOUT
+
+/* Returns the number of bits of the bitset of a tree of the specified order */
+static size_t buddy_tree_bitset_bits(uint8_t order) {
+#if defined(BUDDY_FIXED_STATUS)
+    return two_to_the_power_of(order) * CHAR_BIT;
+#elif !defined(BUDDY_BLOCKED_LAYOUT)
+    return size_for_order(order, 0);
+#else //BUDDY_BLOCKED_LAYOUT
+    return buddy_tree_blocked_layout(order, NULL);
+#endif //BUDDY_BLOCKED_LAYOUT
+}
 
 static size_t buddy_tree_sizeof(uint8_t order) {
     size_t tree_size, bitset_size, size_for_order_size;
 
     tree_size = sizeof(struct buddy_tree);
     /* Account for the bitset */
-    bitset_size = bitset_sizeof(size_for_order(order, 0));
+    bitset_size = bitset_sizeof(buddy_tree_bitset_bits(order));
     if (bitset_size % sizeof(size_t)) {
         bitset_size += (bitset_size % sizeof(size_t));
     }
     /* Account for the size_for_order memoization */
-    size_for_order_size = ((order+2) * sizeof(size_t));
+    size_for_order_size = (((BUDDY_TREE_LAYOUT_WORDS * (order+1)) + 1) * sizeof(size_t));
+    /* Account for the allocation counts */
+    size_for_order_size += (order+1) * sizeof(size_t);
+#ifdef BUDDY_FREE_INDEX
+    /* Account for the free block index */
+    size_for_order_size += buddy_free_index_sizeof(order);
+#endif //BUDDY_FREE_INDEX
     return tree_size + bitset_size + size_for_order_size;
 }
 
-static struct buddy_tree *buddy_tree_init(unsigned char *at, uint8_t order) {
-    size_t size = buddy_tree_sizeof(order);
+/*
+ * Initializes a tree with every position free. If the memory at "at" is known
+ * to be zero it is not cleared, only the few words written below are touched.
+ */
+static struct buddy_tree *buddy_tree_init(unsigned char *at, uint8_t order, unsigned int zeroed) {
     struct buddy_tree *t = (struct buddy_tree*) at;
-    memset(at, 0, size);
+    if (! zeroed) {
+        memset(at, 0, buddy_tree_sizeof(order));
+    }
     t->order = order;
     t->upper_pos_bound = two_to_the_power_of(t->order);
     buddy_tree_populate_size_for_order(t);
+    /* The whole tree starts as a single free block */
+#ifdef BUDDY_FREE_INDEX
+    buddy_free_index_insert(t, buddy_tree_root());
+#else //BUDDY_FREE_INDEX
+    buddy_tree_free_block_add(t, buddy_tree_root());
+#endif //BUDDY_FREE_INDEX
     return t;
 }
 
+#ifdef BUDDY_FIXED_STATUS
+/* Doubles the tree, the current tree becomes the left subtree of the new root */
+static void buddy_tree_grow(struct buddy_tree *t) {
+    unsigned char *status = buddy_tree_bits(t);
+    size_t depth, row;
+
+    /* Whatever followed the statuses becomes part of them */
+    memset(status + two_to_the_power_of(t->order), 0, two_to_the_power_of(t->order));
+
+    /* A row moves to the left half of the next one, move the deepest one first */
+    for (depth = t->order; depth >= 1u; depth--) {
+        row = two_to_the_power_of(depth - 1u);
+        memmove(status + (2u * row), status + row, row);
+        memset(status + row, 0, row);
+    }
+    t->order++;
+
+    /* The new right half is free, the root is free only if the old tree was */
+    status[1] = status[2] ? 1u : 0u;
+}
+
+/* Halves the tree, the left subtree becomes the tree, the right one must be free */
+static void buddy_tree_shrink(struct buddy_tree *t) {
+    unsigned char *status = buddy_tree_bits(t);
+    size_t depth, row;
+
+    /* The left half of a row moves to the previous one, move the shallowest one first */
+    for (depth = 2; depth <= t->order; depth++) {
+        row = two_to_the_power_of(depth - 1u);
+        memmove(status + (row / 2u), status + row, row / 2u);
+    }
+    t->order--;
+}
+#else //BUDDY_FIXED_STATUS
+/* Doubles the tree, the current tree becomes the left subtree of the new root */
+static void buddy_tree_grow(struct buddy_tree *t) {
+    unsigned char *bits = buddy_tree_bits(t);
+    uint8_t order = t->order;
+    size_t depth, width, from, to, old_bits, new_bits;
+    struct buddy_tree_pos left;
+
+    /* Whatever followed the bitset becomes part of it */
+    old_bits = size_for_order(order, 0);
+    new_bits = size_for_order((uint8_t) (order + 1u), 0);
+    bitset_clear_range(bits, bitset_range(old_bits, (bitset_sizeof(new_bits) * CHAR_BIT) - 1u));
+
+    /* A row keeps its width one depth deeper, move the deepest one first */
+    for (depth = order; depth >= 1u; depth--) {
+        width = order - depth + 1u;
+        from = size_for_order(order, (uint8_t) width);
+        to = size_for_order((uint8_t) (order + 1u), (uint8_t) width);
+        bitset_shift_right(bits, from, from + (width * two_to_the_power_of(depth - 1u)) - 1u, to - from);
+    }
+    t->order++;
+
+    /* The new right half is free, the root is free only if the old tree was */
+    left = buddy_tree_left_child(buddy_tree_root());
+    if (read_from_internal_position(bits, buddy_tree_internal_position_order(t->order, left))) {
+        write_to_internal_position(t, buddy_tree_internal_position_order(t->order, buddy_tree_root()), 1);
+    }
+}
+
+/* Halves the tree, the left subtree becomes the tree, the right one must be free */
+static void buddy_tree_shrink(struct buddy_tree *t) {
+    unsigned char *bits = buddy_tree_bits(t);
+    uint8_t order = t->order;
+    size_t depth, width, from, to;
+
+    /* A row keeps its width one depth closer to the root, move the shallowest one first */
+    for (depth = 2; depth <= order; depth++) {
+        width = order - depth + 1u;
+        from = size_for_order(order, (uint8_t) width);
+        to = size_for_order((uint8_t) (order - 1u), (uint8_t) width);
+        bitset_shift_left(bits, from, from + (width * two_to_the_power_of(depth - 2u)), from - to);
+    }
+    t->order--;
+}
+#endif //BUDDY_FIXED_STATUS
+
+/* Rebuilds the free block sums, and the free block index if enabled, from the tree */
+static void buddy_tree_rebuild_free_blocks(struct buddy_tree *t) {
+    struct buddy_tree_walk_state state;
+    size_t pos_status;
+
+    t->free_size = 0;
+    t->free_quality = 0;
+    state = buddy_tree_walk_state_root();
+    do {
+        pos_status = buddy_tree_status(t, state.current_pos);
+        if (pos_status == 0) {
+            /* Largest free block, ascend */
+#ifdef BUDDY_FREE_INDEX
+            buddy_free_index_insert(t, state.current_pos);
+#else //BUDDY_FREE_INDEX
+            buddy_tree_free_block_add(t, state.current_pos);
+#endif //BUDDY_FREE_INDEX
+            state.going_up = 1;
+        } else if (pos_status == (t->order - state.current_pos.depth + 1)) {
+            /* Busy node, ascend */
+            state.going_up = 1;
+        }
+    } while (buddy_tree_walk(t, &state));
+}
+
+/*
+ * Changes the order of the tree one order at a time, moving the rows of the
+ * bitset so that every position keeps tracking the same memory. When
+ * shrinking, the positions past the new order must be free.
+ */
+static void buddy_tree_resize(struct buddy_tree *t, uint8_t desired_order) {
+    size_t counts[(sizeof(size_t) * CHAR_BIT) + 2u];
+    size_t *allocated_counts, bitset_size, depth;
+
+    /* The allocation counts move to the depth their positions move to */
+    memset(counts, 0, sizeof(counts));
+    allocated_counts = buddy_tree_allocated_counts(t);
+    for (depth = 1; depth <= t->order; depth++) {
+        if (depth + desired_order > t->order) {
+            counts[depth + desired_order - t->order] = allocated_counts[depth];
+        }
+    }
+
+    while (t->order < desired_order) {
+        buddy_tree_grow(t);
+    }
+    while (t->order > desired_order) {
+        buddy_tree_shrink(t);
+    }
+
+    /* Everything past the bitset depends on the order, rebuild it */
+    t->upper_pos_bound = two_to_the_power_of(t->order);
+    bitset_size = bitset_sizeof(buddy_tree_bitset_bits(t->order));
+    memset(buddy_tree_bits(t) + bitset_size, 0, buddy_tree_sizeof(t->order) - sizeof(*t) - bitset_size);
+    buddy_tree_populate_size_for_order(t);
+    memcpy(buddy_tree_allocated_counts(t), counts, (t->order + 1u) * sizeof(size_t));
+    buddy_tree_rebuild_free_blocks(t);
+}
+
 static bool buddy_tree_valid(struct buddy_tree *t, struct buddy_tree_pos pos) {
     return pos.index && (pos.index < t->upper_pos_bound);
 }
@@ -671,22 +1799,57 @@ static inline unsigned char *buddy_tree_bits(struct buddy_tree *t) {
 }
 
 static void buddy_tree_populate_size_for_order(struct buddy_tree *t) {
-    size_t bitset_offset = bitset_sizeof(size_for_order(t->order, 0));
+    size_t bitset_offset = bitset_sizeof(buddy_tree_bitset_bits(t->order));
     if (bitset_offset % sizeof(size_t)) {
         bitset_offset += (bitset_offset % sizeof(size_t));
     }
     t->size_for_order_offset = bitset_offset / sizeof(size_t);
     t->size_for_order_offset++;
+#ifndef BUDDY_BLOCKED_LAYOUT
     for (size_t i = 0; i <= t->order; i++) {
         *((size_t *)(((unsigned char *) t) + sizeof(*t)) + t->size_for_order_offset + i) = size_for_order(t->order, (uint8_t) i);
     }
+#else //BUDDY_BLOCKED_LAYOUT
+    buddy_tree_blocked_layout(t->order, buddy_tree_layout(t));
+#endif //BUDDY_BLOCKED_LAYOUT
 }
 
+#ifndef BUDDY_BLOCKED_LAYOUT
 static inline size_t buddy_tree_size_for_order(struct buddy_tree *t,
          uint8_t to) {
     return *((size_t *)(((unsigned char *) t) + sizeof(*t)) + t->size_for_order_offset + to);
 }
+#else //BUDDY_BLOCKED_LAYOUT
+static inline size_t *buddy_tree_layout(struct buddy_tree *t) {
+    return (size_t *) buddy_tree_bits(t) + t->size_for_order_offset;
+}
+#endif //BUDDY_BLOCKED_LAYOUT
+
+static inline size_t *buddy_tree_allocated_counts(struct buddy_tree *t) {
+    /* The number of allocated positions per depth follows the size_for_order memoization */
+    return (size_t *) buddy_tree_bits(t) + t->size_for_order_offset + (BUDDY_TREE_LAYOUT_WORDS * (t->order + 1u));
+}
+
+#ifdef BUDDY_FIXED_STATUS
+static void write_to_internal_position(struct buddy_tree* t, struct internal_position pos, size_t value) {
+    buddy_tree_bits(t)[pos.bitset_location] = (unsigned char) value;
+}
 
+static size_t read_from_internal_position(unsigned char *bitset, struct internal_position pos) {
+    return bitset[pos.bitset_location];
+}
+
+static inline unsigned char compare_with_internal_position(unsigned char *bitset, struct internal_position pos, size_t value) {
+    return bitset[pos.bitset_location] >= value;
+}
+
+/* Siblings are next to each other, one byte apart */
+static inline size_t internal_position_stride(struct internal_position pos) {
+    (void) pos;
+    return 1u;
+}
+#else //BUDDY_FIXED_STATUS
+#ifndef BUDDY_WORD_BITSET
 static void write_to_internal_position(struct buddy_tree* t, struct internal_position pos, size_t value) {
     unsigned char *bitset = buddy_tree_bits(t);
     struct bitset_range clear_range = bitset_range(pos.bitset_location, pos.bitset_location + pos.local_offset - 1);
@@ -696,18 +1859,63 @@ static void write_to_internal_position(struct buddy_tree* t, struct internal_pos
         bitset_set_range(bitset, bitset_range(pos.bitset_location, pos.bitset_location+value-1));
     }
 }
+#else //BUDDY_WORD_BITSET
+static void write_to_internal_position(struct buddy_tree* t, struct internal_position pos, size_t value) {
+    unsigned char *bitset = buddy_tree_bits(t);
+    size_t *words = (size_t *) bitset;
+    struct bitset_range clear_range = bitset_range(pos.bitset_location, pos.bitset_location + pos.local_offset - 1);
+    size_t word;
+
+    if (clear_range.from_bucket != clear_range.to_bucket) {
+        bitset_clear_range(bitset, clear_range);
+        if (value) {
+            bitset_set_range(bitset, bitset_range(pos.bitset_location, pos.bitset_location+value-1));
+        }
+        return;
+    }
+    /* Common case, the whole node fits in a word: clear and set in one store */
+    word = words[clear_range.from_bucket] & ~bitset_word_mask(clear_range.from_index, clear_range.to_index);
+    if (value) {
+        word |= bitset_word_mask(clear_range.from_index, (uint8_t) (clear_range.from_index + value - 1));
+    }
+    words[clear_range.from_bucket] = word;
+}
+#endif //BUDDY_WORD_BITSET
 
+#ifndef BUDDY_WORD_BITSET
 static size_t read_from_internal_position(unsigned char *bitset, struct internal_position pos) {
     if (! bitset_test(bitset, pos.bitset_location)) {
         return 0; /* Fast test without complete extraction */
     }
     return bitset_count_range(bitset, bitset_range(pos.bitset_location, pos.bitset_location+pos.local_offset-1));
 }
+#else //BUDDY_WORD_BITSET
+static size_t read_from_internal_position(unsigned char *bitset, struct internal_position pos) {
+    const size_t *words = (const size_t *) bitset;
+    struct bitset_range range;
+    size_t inverted, run;
+
+    range = bitset_range(pos.bitset_location, pos.bitset_location+pos.local_offset-1);
+    if (range.from_bucket != range.to_bucket) {
+        return bitset_count_range(bitset, range);
+    }
+    /* The status is a run of ones starting at the node, count the trailing ones */
+    inverted = ~(words[range.from_bucket] >> range.from_index);
+    run = inverted ? ctz_word(inverted) : sizeof(size_t) * CHAR_BIT;
+    return run < pos.local_offset ? run : pos.local_offset;
+}
+#endif //BUDDY_WORD_BITSET
 
 static inline unsigned char compare_with_internal_position(unsigned char *bitset, struct internal_position pos, size_t value) {
     return bitset_test(bitset, pos.bitset_location+value-1);
 }
 
+/* Siblings are next to each other, one status width apart */
+static inline size_t internal_position_stride(struct internal_position pos) {
+    return pos.local_offset;
+}
+#endif //BUDDY_FIXED_STATUS
+
 static struct buddy_tree_interval buddy_tree_interval(struct buddy_tree *t, struct buddy_tree_pos pos) {
     struct buddy_tree_interval result;
     size_t depth;
@@ -770,8 +1978,11 @@ static void buddy_tree_mark(struct buddy_tree *t, struct buddy_tree_pos pos) {
     /* Calling mark on a used position is a bug in caller */
     struct internal_position internal = buddy_tree_internal_position_tree(t, pos);
 
+    buddy_tree_free_split(t, pos);
+
     /* Mark the node as used */
     write_to_internal_position(t, internal, internal.local_offset);
+    buddy_tree_allocated_counts(t)[pos.depth]++;
 
     /* Update the tree upwards */
     update_parent_chain(t, pos, internal, internal.local_offset);
@@ -787,21 +1998,72 @@ static enum buddy_tree_release_status buddy_tree_release(struct buddy_tree *t, s
 
     /* Mark the node as unused */
     write_to_internal_position(t, internal, 0);
+    buddy_tree_allocated_counts(t)[pos.depth]--;
 
     /* Update the tree upwards */
     update_parent_chain(t, pos, internal, 0);
 
+    buddy_tree_free_merge(t, pos);
+
     return BUDDY_TREE_RELEASE_SUCCESS;
 }
 
+static void buddy_tree_release_batch(struct buddy_tree *t, struct buddy_tree_pos pos, struct buddy_tree_pos next) {
+    /* Calling release on an unused or a partially-used position a bug in caller */
+    struct internal_position internal = buddy_tree_internal_position_tree(t, pos);
+    struct buddy_tree_pos stop = INVALID_POS;
+
+    /* Mark the node as unused */
+    write_to_internal_position(t, internal, 0);
+    buddy_tree_allocated_counts(t)[pos.depth]--;
+
+    /* Update the tree upwards, leaving the ancestors shared with next to it */
+    if (buddy_tree_valid(t, next)) {
+        stop = buddy_tree_common_ancestor(pos, next);
+    }
+    update_parent_chain_until(t, pos, internal, 0, stop);
+
+    /* The siblings below stop are up to date, the one containing next is used */
+    buddy_tree_free_merge(t, pos);
+}
+
+/*
+ * Moves the mark of a used position to the ancestor or the leftmost descendant
+ * at the target depth, which start at the same address. Returns the new
+ * position, or an invalid one if the position cannot grow in place.
+ */
+static struct buddy_tree_pos buddy_tree_resize_in_place(struct buddy_tree *t, struct buddy_tree_pos pos, uint8_t target_depth) {
+    struct buddy_tree_pos target = pos;
+
+    if (target_depth > pos.depth) {
+        /* Shrink, the right-hand halves are given back */
+        while (target.depth != target_depth) {
+            target = buddy_tree_left_child(target);
+        }
+    } else {
+        /* Grow, the position must be the left half of each ancestor and the right halves free */
+        while (target.depth != target_depth) {
+            if ((target.index & 1u) || buddy_tree_status(t, buddy_tree_sibling(target))) {
+                return INVALID_POS;
+            }
+            target = buddy_tree_parent(target);
+        }
+    }
+    if (target.index != pos.index) {
+        buddy_tree_release(t, pos);
+        buddy_tree_mark(t, target);
+    }
+    return target;
+}
+
 static void update_parent_chain(struct buddy_tree *t, struct buddy_tree_pos pos,
         struct internal_position pos_internal, size_t size_current) {
     size_t size_sibling, size_parent, target_parent;
     unsigned char *bits = buddy_tree_bits(t);
 
     while (pos.index != 1) {
-        pos_internal.bitset_location += pos_internal.local_offset
-            - (2 * pos_internal.local_offset * (pos.index & 1u));
+        pos_internal.bitset_location += internal_position_stride(pos_internal)
+            - (2 * internal_position_stride(pos_internal) * (pos.index & 1u));
         size_sibling = read_from_internal_position(bits, pos_internal);
 
         pos = buddy_tree_parent(pos);
@@ -819,52 +2081,385 @@ static void update_parent_chain(struct buddy_tree *t, struct buddy_tree_pos pos,
     };
 }
 
-static struct buddy_tree_pos buddy_tree_find_free(struct buddy_tree *t, uint8_t target_depth) {
-    struct buddy_tree_pos current_pos, left_pos, right_pos;
-    uint8_t target_status;
-    size_t current_depth, right_status;
-    struct internal_position left_internal, right_internal;
-    unsigned char *tree_bits;
+/*
+ * Like update_parent_chain, but the ancestors from stop upwards are left to a
+ * later update of the same batch. Since the ancestors may be pending updates of
+ * earlier blocks of the batch, the walk does not stop at an unchanged parent.
+ */
+static void update_parent_chain_until(struct buddy_tree *t, struct buddy_tree_pos pos,
+        struct internal_position pos_internal, size_t size_current, struct buddy_tree_pos stop) {
+    size_t size_sibling, size_parent, target_parent;
+    unsigned char *bits = buddy_tree_bits(t);
+
+    while (pos.index != 1) {
+        if (buddy_tree_parent(pos).index == stop.index) {
+            return;
+        }
+        pos_internal.bitset_location += internal_position_stride(pos_internal)
+            - (2 * internal_position_stride(pos_internal) * (pos.index & 1u));
+        size_sibling = read_from_internal_position(bits, pos_internal);
+
+        pos = buddy_tree_parent(pos);
+        pos_internal = buddy_tree_internal_position_tree(t, pos);
+        size_parent = read_from_internal_position(bits, pos_internal);
+
+        target_parent = (size_current || size_sibling)
+            * ((size_current <= size_sibling ? size_current : size_sibling) + 1);
+        if (target_parent != size_parent) {
+            write_to_internal_position(t, pos_internal, target_parent);
+        }
+        size_current = target_parent;
+    };
+}
+
+static struct buddy_tree_pos buddy_tree_common_ancestor(struct buddy_tree_pos a, struct buddy_tree_pos b) {
+    while (a.depth > b.depth) {
+        a = buddy_tree_parent(a);
+    }
+    while (b.depth > a.depth) {
+        b = buddy_tree_parent(b);
+    }
+    while (a.index != b.index) {
+        a = buddy_tree_parent(a);
+        b = buddy_tree_parent(b);
+    }
+    return a;
+}
+
+static struct buddy_tree_pos buddy_tree_find_free(struct buddy_tree *t, uint8_t target_depth) {
+    struct buddy_tree_pos current_pos, left_pos, right_pos;
+    uint8_t target_status;
+    size_t current_depth, right_status;
+    struct internal_position left_internal, right_internal;
+    unsigned char *tree_bits;
+
+    current_pos = buddy_tree_root();
+    target_status = target_depth - 1;
+    current_depth = buddy_tree_depth(current_pos);
+    if (buddy_tree_status(t, current_pos) > target_status) {
+        return INVALID_POS; /* No position available down the tree */
+    }
+    tree_bits = buddy_tree_bits(t);
+    while (current_depth != target_depth) {
+        /* Advance criteria */
+        target_status -= 1;
+        current_depth += 1;
+
+        left_pos = buddy_tree_left_child(current_pos);
+        right_pos = buddy_tree_sibling(left_pos);
+
+        left_internal = buddy_tree_internal_position_tree(t, left_pos);
+
+        right_internal = left_internal;
+        right_internal.bitset_location += internal_position_stride(right_internal); /* advance to the right */
+
+        if (compare_with_internal_position(tree_bits, left_internal, target_status+1)) { /* left branch is busy, pick right */
+            current_pos = right_pos;
+        } else if (compare_with_internal_position(tree_bits, right_internal, target_status+1)) { /* right branch is busy, pick left */
+            current_pos = left_pos;
+        } else {
+            /* One of the child nodes must be read in order to compare it to its sibling. */
+            right_status = read_from_internal_position(tree_bits, right_internal);
+            if (right_status) {
+                if (compare_with_internal_position(tree_bits, left_internal, right_status)) {
+                    current_pos = left_pos; /* Left is equal or more busy than right, prefer left */
+                } else {
+                    current_pos = right_pos;
+                }
+            } else { /* Right is empty, prefer left */
+                current_pos = left_pos;
+            }
+        }
+    }
+    return current_pos;
+}
+
+static struct buddy_tree_pos buddy_tree_find_first(struct buddy_tree *t, uint8_t target_depth, unsigned int from_high) {
+    struct buddy_tree_pos current_pos, first_pos;
+
+    current_pos = buddy_tree_root();
+    if (buddy_tree_status(t, current_pos) > (size_t) target_depth - 1) {
+        return INVALID_POS; /* No position available down the tree */
+    }
+    while (buddy_tree_depth(current_pos) != target_depth) {
+        /* One of the children fits, try the one on the preferred end first */
+        first_pos = from_high ? buddy_tree_right_child(current_pos) : buddy_tree_left_child(current_pos);
+        if (buddy_tree_status(t, first_pos) <= target_depth - buddy_tree_depth(first_pos)) {
+            current_pos = first_pos;
+        } else {
+            current_pos = buddy_tree_sibling(first_pos);
+        }
+    }
+    return current_pos;
+}
+
+static struct buddy_tree_pos buddy_tree_find_best_fit(struct buddy_tree *t, uint8_t target_depth) {
+    struct buddy_tree_pos best = INVALID_POS;
+#ifdef BUDDY_FREE_INDEX
+    size_t depth;
+
+    /* The deepest indexed depth that fits holds the smallest free blocks */
+    for (depth = target_depth; depth >= 1; depth--) {
+        best = buddy_free_index_find(t, (uint8_t) depth);
+        if (buddy_tree_valid(t, best)) {
+            break;
+        }
+    }
+#else //BUDDY_FREE_INDEX
+    best = buddy_tree_best_fit_walk(t, target_depth, INVALID_POS);
+#endif //BUDDY_FREE_INDEX
+    if (! buddy_tree_valid(t, best)) {
+        return INVALID_POS;
+    }
+    /* Split the block from its start, as buddy_tree_find_free would */
+    while (best.depth != target_depth) {
+        best = buddy_tree_left_child(best);
+    }
+    return best;
+}
+
+/* Returns true if b is a or one of its descendants */
+static inline bool buddy_tree_contains(struct buddy_tree_pos a, struct buddy_tree_pos b) {
+    return a.index && (b.depth >= a.depth) && ((b.index >> (b.depth - a.depth)) == a.index);
+}
+
+/*
+ * Returns the deepest free node that fits target_depth, the leftmost one on
+ * ties, ignoring the subtree of exclude. Depth first walk of the subtrees that
+ * fit, from the left: free nodes are the candidates and their subtrees are
+ * skipped, the walk ends at the first free node of the target depth.
+ */
+static struct buddy_tree_pos buddy_tree_best_fit_walk(struct buddy_tree *t, size_t target_depth,
+        struct buddy_tree_pos exclude) {
+    struct buddy_tree_pos best = INVALID_POS;
+    struct buddy_tree_pos pos = buddy_tree_root();
+    size_t status;
+
+    for (;;) {
+        if (buddy_tree_contains(exclude, pos)) {
+            /* Skip the excluded subtree */
+        } else if (buddy_tree_contains(pos, exclude)) {
+            /* The status counts the excluded subtree, look at both children */
+            if (pos.depth < target_depth) {
+                pos = buddy_tree_left_child(pos);
+                continue;
+            }
+        } else {
+            status = buddy_tree_status(t, pos);
+            if (status <= target_depth - buddy_tree_depth(pos)) {
+                if (status == 0) {
+                    if (best.depth < pos.depth) {
+                        best = pos;
+                    }
+                    if (pos.depth == target_depth) {
+                        break;
+                    }
+                } else {
+                    pos = buddy_tree_left_child(pos);
+                    continue;
+                }
+            }
+        }
+        /* Move to the next subtree on the right */
+        while (pos.index & 1u) {
+            pos = buddy_tree_parent(pos);
+        }
+        if (pos.index == 0) {
+            break;
+        }
+        pos = buddy_tree_sibling(pos);
+    }
+    return best;
+}
+
+#ifdef BUDDY_FREE_INDEX
+
+/*
+ * Free block index
+ *
+ * Level zero has one bit per tree position, set if the position is a free
+ * block whose parent is not free. Since positions are numbered breadth first,
+ * the blocks of a given depth are a contiguous run of bits. Each further level
+ * has one bit per word of the level below, set if that word is not zero, up to
+ * a level that fits in a single word. A count of indexed blocks per depth
+ * follows the levels.
+ */
+
+#define FREE_INDEX_WORD_BITS (sizeof(size_t) * CHAR_BIT)
+
+static inline size_t free_index_words(size_t bits) {
+    return (bits + FREE_INDEX_WORD_BITS - 1u) / FREE_INDEX_WORD_BITS;
+}
+
+static size_t buddy_free_index_levels_sizeof(uint8_t order) {
+    size_t bits = two_to_the_power_of(order);
+    size_t words = 0;
+    for (;;) {
+        size_t level_words = free_index_words(bits);
+        words += level_words;
+        if (level_words == 1) {
+            return words;
+        }
+        bits = level_words;
+    }
+}
+
+static size_t buddy_free_index_sizeof(uint8_t order) {
+    return (buddy_free_index_levels_sizeof(order) + order + 1u) * sizeof(size_t);
+}
+
+static inline size_t *buddy_free_index(struct buddy_tree *t) {
+    /* The index follows the allocation counts */
+    return buddy_tree_allocated_counts(t) + t->order + 1u;
+}
+
+static size_t *buddy_free_index_counts(struct buddy_tree *t) {
+    return buddy_free_index(t) + buddy_free_index_levels_sizeof(t->order);
+}
+
+static bool buddy_free_index_test(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    size_t *words = buddy_free_index(t);
+    return (words[pos.index / FREE_INDEX_WORD_BITS] >> (pos.index % FREE_INDEX_WORD_BITS)) & 1u;
+}
+
+static void buddy_free_index_insert(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    size_t *words = buddy_free_index(t);
+    size_t bits = t->upper_pos_bound;
+    size_t bit = pos.index;
+
+    buddy_free_index_counts(t)[pos.depth]++;
+    buddy_tree_free_block_add(t, pos);
+    for (;;) {
+        size_t level_words = free_index_words(bits);
+        size_t word = bit / FREE_INDEX_WORD_BITS;
+        size_t previous = words[word];
+        words[word] |= ((size_t) 1u) << (bit % FREE_INDEX_WORD_BITS);
+        if (previous || (level_words == 1)) {
+            return; /* upper levels already know about this word */
+        }
+        words += level_words;
+        bits = level_words;
+        bit = word;
+    }
+}
+
+static void buddy_free_index_remove(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    size_t *words = buddy_free_index(t);
+    size_t bits = t->upper_pos_bound;
+    size_t bit = pos.index;
+
+    buddy_free_index_counts(t)[pos.depth]--;
+    buddy_tree_free_block_remove(t, pos);
+    for (;;) {
+        size_t level_words = free_index_words(bits);
+        size_t word = bit / FREE_INDEX_WORD_BITS;
+        words[word] &= ~(((size_t) 1u) << (bit % FREE_INDEX_WORD_BITS));
+        if (words[word] || (level_words == 1)) {
+            return; /* the word is still in use */
+        }
+        words += level_words;
+        bits = level_words;
+        bit = word;
+    }
+}
+
+/* Returns the first set bit at or after "from" in the level, SIZE_MAX if none */
+static size_t buddy_free_index_next(size_t *words, size_t bits, size_t from) {
+    size_t level_words = free_index_words(bits);
+    size_t word, value;
+
+    if (from >= bits) {
+        return SIZE_MAX;
+    }
+    word = from / FREE_INDEX_WORD_BITS;
+    value = words[word] & (SIZE_MAX << (from % FREE_INDEX_WORD_BITS));
+    if (value) {
+        return word * FREE_INDEX_WORD_BITS + ctz_word(value);
+    }
+    if (level_words == 1) {
+        return SIZE_MAX;
+    }
+    /* Ask the upper level for the next non-empty word */
+    word = buddy_free_index_next(words + level_words, level_words, word + 1u);
+    if (word == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    return word * FREE_INDEX_WORD_BITS + ctz_word(words[word]);
+}
+
+static struct buddy_tree_pos buddy_free_index_find(struct buddy_tree *t, uint8_t depth) {
+    struct buddy_tree_pos pos;
+    size_t first = two_to_the_power_of(depth - 1u);
+    size_t found;
+
+    if (buddy_free_index_counts(t)[depth] == 0) {
+        return INVALID_POS;
+    }
+    found = buddy_free_index_next(buddy_free_index(t), t->upper_pos_bound, first);
+    if (found >= 2 * first) {
+        return INVALID_POS;
+    }
+    pos.index = found;
+    pos.depth = depth;
+    return pos;
+}
+
+/* Update the index before the free position "pos" gets marked */
+static void buddy_free_index_split(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    struct buddy_tree_pos block = pos;
 
-    current_pos = buddy_tree_root();
-    target_status = target_depth - 1;
-    current_depth = buddy_tree_depth(current_pos);
-    if (buddy_tree_status(t, current_pos) > target_status) {
-        return INVALID_POS; /* No position available down the tree */
+    /* Find the indexed block that contains the position */
+    while (! buddy_free_index_test(t, block)) {
+        block = buddy_tree_parent(block);
+        if (! buddy_tree_valid(t, block)) {
+            return; /* not a free position, bug in caller */
+        }
     }
-    tree_bits = buddy_tree_bits(t);
-    while (current_depth != target_depth) {
-        /* Advance criteria */
-        target_status -= 1;
-        current_depth += 1;
+    buddy_free_index_remove(t, block);
+    /* The halves that are not on the path to the position become free blocks */
+    while (pos.index != block.index) {
+        buddy_free_index_insert(t, buddy_tree_sibling(pos));
+        pos = buddy_tree_parent(pos);
+    }
+}
 
-        left_pos = buddy_tree_left_child(current_pos);
-        right_pos = buddy_tree_sibling(left_pos);
+/* Update the index after the position "pos" got released */
+static void buddy_free_index_merge(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    while ((pos.index != 1) && buddy_free_index_test(t, buddy_tree_sibling(pos))) {
+        buddy_free_index_remove(t, buddy_tree_sibling(pos));
+        pos = buddy_tree_parent(pos);
+    }
+    buddy_free_index_insert(t, pos);
+}
 
-        left_internal = buddy_tree_internal_position_tree(t, left_pos);
+#endif //BUDDY_FREE_INDEX
 
-        right_internal = left_internal;
-        right_internal.bitset_location += right_internal.local_offset; /* advance to the right */
+static size_t buddy_tree_free_blocks(struct buddy_tree *t, size_t depth) {
+#ifdef BUDDY_FREE_INDEX
+    return buddy_free_index_counts(t)[depth];
+#else //BUDDY_FREE_INDEX
+    struct buddy_tree_pos pos, parent;
+    size_t parent_status, parent_local_offset, count = 0;
 
-        if (compare_with_internal_position(tree_bits, left_internal, target_status+1)) { /* left branch is busy, pick right */
-            current_pos = right_pos;
-        } else if (compare_with_internal_position(tree_bits, right_internal, target_status+1)) { /* right branch is busy, pick left */
-            current_pos = left_pos;
-        } else {
-            /* One of the child nodes must be read in order to compare it to its sibling. */
-            right_status = read_from_internal_position(tree_bits, right_internal);
-            if (right_status) {
-                if (compare_with_internal_position(tree_bits, left_internal, right_status)) {
-                    current_pos = left_pos; /* Left is equal or more busy than right, prefer left */
-                } else {
-                    current_pos = right_pos;
-                }
-            } else { /* Right is empty, prefer left */
-                current_pos = left_pos;
-            }
+    /* A free block counts if its parent is partially used */
+    pos.depth = depth;
+    for (pos.index = two_to_the_power_of(depth - 1u); pos.index < two_to_the_power_of(depth); pos.index++) {
+        if (buddy_tree_status(t, pos)) {
+            continue;
+        }
+        if (pos.index == 1) {
+            count++;
+            continue;
+        }
+        parent = buddy_tree_parent(pos);
+        parent_status = buddy_tree_status(t, parent);
+        parent_local_offset = t->order - buddy_tree_depth(parent) + 1;
+        if (parent_status && (parent_status != parent_local_offset)) {
+            count++;
         }
     }
-    return current_pos;
+    return count;
+#endif //BUDDY_FREE_INDEX
 }
 
 static bool buddy_tree_is_free(struct buddy_tree *t, struct buddy_tree_pos pos) {
@@ -909,12 +2504,18 @@ unsigned int buddy_tree_check_invariant(struct buddy_tree *t, struct buddy_tree_
     struct buddy_tree_walk_state state = buddy_tree_walk_state_root();
     state.current_pos = pos;
     do {
-        struct internal_position current_internal = buddy_tree_internal_position_tree(t, pos);
+        struct buddy_tree_pos current = state.current_pos;
+        struct internal_position current_internal = buddy_tree_internal_position_tree(t, current);
         size_t current_status = read_from_internal_position(buddy_tree_bits(t), current_internal);
-        size_t left_child_status = buddy_tree_status(t, buddy_tree_left_child(pos));
-        size_t right_child_status = buddy_tree_status(t, buddy_tree_right_child(pos));
+        size_t left_child_status = 0, right_child_status = 0;
         unsigned int violated = 0;
 
+        /* Leaves have no children to compare with */
+        if (buddy_tree_depth(current) < buddy_tree_order(t)) {
+            left_child_status = buddy_tree_status(t, buddy_tree_left_child(current));
+            right_child_status = buddy_tree_status(t, buddy_tree_right_child(current));
+        }
+
         if (left_child_status || right_child_status) {
             size_t min = left_child_status <= right_child_status
                 ? left_child_status : right_child_status;
@@ -929,22 +2530,99 @@ unsigned int buddy_tree_check_invariant(struct buddy_tree *t, struct buddy_tree_
 
         if (violated) {
             fail = 1;
-            BUDDY_PRINTF("invariant violation at position [ index: %zu depth: %zu ]!\n", pos.index, pos.depth);
+            BUDDY_PRINTF("invariant violation at position [ index: %zu depth: %zu ]!\n", current.index, current.depth);
             BUDDY_PRINTF("current: %zu left %zu right %zu max %zu\n",
                 current_status, left_child_status, right_child_status, current_internal.local_offset);
         }
 
     } while (buddy_tree_walk(t, &state));
+
+    if (pos.index == 1) {
+        unsigned char walked = buddy_tree_fragmentation_walk(t);
+        if (walked != buddy_tree_fragmentation(t)) {
+            fail = 1;
+            BUDDY_PRINTF("fragmentation mismatch: incremental %u walk %u\n",
+                (unsigned int) buddy_tree_fragmentation(t), (unsigned int) walked);
+        }
+    }
     return fail;
 }
 
+static inline void buddy_tree_free_block_add(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    size_t virtual_size = two_to_the_power_of((t->order - pos.depth) % ((sizeof(size_t) * CHAR_BIT)-1));
+    t->free_size += virtual_size;
+    t->free_quality += virtual_size * virtual_size;
+}
+
+static inline void buddy_tree_free_block_remove(struct buddy_tree *t, struct buddy_tree_pos pos) {
+    size_t virtual_size = two_to_the_power_of((t->order - pos.depth) % ((sizeof(size_t) * CHAR_BIT)-1));
+    t->free_size -= virtual_size;
+    t->free_quality -= virtual_size * virtual_size;
+}
+
+/* Update the free blocks before the free position "pos" gets marked */
+static void buddy_tree_free_split(struct buddy_tree *t, struct buddy_tree_pos pos) {
+#ifdef BUDDY_FREE_INDEX
+    buddy_free_index_split(t, pos);
+#else //BUDDY_FREE_INDEX
+    struct buddy_tree_pos block = pos;
+
+    /* Find the largest free block that contains the position */
+    while ((block.index != 1) && (buddy_tree_status(t, buddy_tree_parent(block)) == 0)) {
+        block = buddy_tree_parent(block);
+    }
+    buddy_tree_free_block_remove(t, block);
+    /* The halves that are not on the path to the position become free blocks */
+    while (pos.index != block.index) {
+        buddy_tree_free_block_add(t, buddy_tree_sibling(pos));
+        pos = buddy_tree_parent(pos);
+    }
+#endif //BUDDY_FREE_INDEX
+}
+
+/* Update the free blocks after the position "pos" got released */
+static void buddy_tree_free_merge(struct buddy_tree *t, struct buddy_tree_pos pos) {
+#ifdef BUDDY_FREE_INDEX
+    buddy_free_index_merge(t, pos);
+#else //BUDDY_FREE_INDEX
+    while ((pos.index != 1) && (buddy_tree_status(t, buddy_tree_sibling(pos)) == 0)) {
+        buddy_tree_free_block_remove(t, buddy_tree_sibling(pos));
+        pos = buddy_tree_parent(pos);
+    }
+    buddy_tree_free_block_add(t, pos);
+#endif //BUDDY_FREE_INDEX
+}
+
 /*
- * Calculate tree fragmentation based on free slots.
+ * Calculate tree fragmentation based on free slots, from the sums kept up to
+ * date by buddy_tree_free_split and buddy_tree_free_merge.
  * Based on https://asawicki.info/news_1757_a_metric_for_memory_fragmentation
  */
 static unsigned char buddy_tree_fragmentation(struct buddy_tree *t) {
     const unsigned char fractional_bits = 8;
     const unsigned char fractional_mask = 255;
+    size_t quality_percent;
+
+    if (buddy_tree_status(t, buddy_tree_root()) == 0) { /* Empty tree */
+        return 0;
+    }
+    if (t->free_size == 0) { /* Fully-allocated tree */
+        return 0;
+    }
+
+    quality_percent = (integer_square_root(t->free_quality) << fractional_bits) / t->free_size;
+    quality_percent *= quality_percent;
+    quality_percent >>= fractional_bits;
+    return fractional_mask - (quality_percent & fractional_mask);
+}
+
+/*
+ * Same as buddy_tree_fragmentation, but walks the whole tree. Used by
+ * buddy_tree_check_invariant to cross-check the incremental sums.
+ */
+static unsigned char buddy_tree_fragmentation_walk(struct buddy_tree *t) {
+    const unsigned char fractional_bits = 8;
+    const unsigned char fractional_mask = 255;
 
     uint8_t tree_order;
     size_t root_status, quality, total_free_size, virtual_size, quality_percent;
@@ -994,6 +2672,8 @@ size_t bitset_sizeof(size_t elements) {
     return ((elements) + CHAR_BIT - 1u) / CHAR_BIT;
 }
 
+#ifndef BUDDY_WORD_BITSET
+
 static uint8_t bitset_index_mask[8] = {1, 2, 4, 8, 16, 32, 64, 128};
 
 static inline void bitset_set(unsigned char *bitset, size_t pos) {
@@ -1035,6 +2715,7 @@ static inline struct bitset_range bitset_range(size_t from_pos, size_t to_pos) {
     return range;
 }
 
+#ifndef BUDDY_FIXED_STATUS
 static void bitset_set_range(unsigned char *bitset, struct bitset_range range) {
     if (range.from_bucket == range.to_bucket) {
         bitset[range.from_bucket] |= bitset_char_mask[range.from_index][range.to_index];
@@ -1074,7 +2755,95 @@ static size_t bitset_count_range(unsigned char *bitset, struct bitset_range rang
     }
     return result;
 }
+#endif //BUDDY_FIXED_STATUS
+
+#else //BUDDY_WORD_BITSET
+
+/*
+ * A word-backed variant of the same bitset. The bitset must be size_t
+ * aligned, which the tree layout already guarantees.
+ */
+
+#define BITSET_WORD_BITS (sizeof(size_t) * CHAR_BIT)
+
+static inline void bitset_set(unsigned char *bitset, size_t pos) {
+    size_t *words = (size_t *) bitset;
+    words[pos / BITSET_WORD_BITS] |= ((size_t) 1u) << (pos % BITSET_WORD_BITS);
+}
+
+static inline void bitset_clear(unsigned char *bitset, size_t pos) {
+    size_t *words = (size_t *) bitset;
+    words[pos / BITSET_WORD_BITS] &= ~(((size_t) 1u) << (pos % BITSET_WORD_BITS));
+}
+
+static inline bool bitset_test(const unsigned char *bitset, size_t pos) {
+    const size_t *words = (const size_t *) bitset;
+    return (words[pos / BITSET_WORD_BITS] >> (pos % BITSET_WORD_BITS)) & 1u;
+}
+
+/* Returns a word with the bits from "from" to "to" (inclusive) set */
+static inline size_t bitset_word_mask(uint8_t from, uint8_t to) {
+    return (SIZE_MAX << from) & (SIZE_MAX >> (BITSET_WORD_BITS - 1u - to));
+}
+
+static inline struct bitset_range bitset_range(size_t from_pos, size_t to_pos) {
+    struct bitset_range range = {0};
+    range.from_bucket = from_pos / BITSET_WORD_BITS;
+    range.to_bucket = to_pos / BITSET_WORD_BITS;
+
+    range.from_index = from_pos % BITSET_WORD_BITS;
+    range.to_index = to_pos % BITSET_WORD_BITS;
+    return range;
+}
+
+#ifndef BUDDY_FIXED_STATUS
+static void bitset_set_range(unsigned char *bitset, struct bitset_range range) {
+    size_t *words = (size_t *) bitset;
+    if (range.from_bucket == range.to_bucket) {
+        words[range.from_bucket] |= bitset_word_mask(range.from_index, range.to_index);
+    } else {
+        words[range.from_bucket] |= bitset_word_mask(range.from_index, BITSET_WORD_BITS - 1u);
+        words[range.to_bucket] |= bitset_word_mask(0, range.to_index);
+        while(++range.from_bucket != range.to_bucket) {
+            words[range.from_bucket] = SIZE_MAX;
+        }
+    }
+}
+
+static void bitset_clear_range(unsigned char* bitset, struct bitset_range range) {
+    size_t *words = (size_t *) bitset;
+    if (range.from_bucket == range.to_bucket) {
+        words[range.from_bucket] &= ~bitset_word_mask(range.from_index, range.to_index);
+    }
+    else {
+        words[range.from_bucket] &= ~bitset_word_mask(range.from_index, BITSET_WORD_BITS - 1u);
+        words[range.to_bucket] &= ~bitset_word_mask(0, range.to_index);
+        while (++range.from_bucket != range.to_bucket) {
+            words[range.from_bucket] = 0;
+        }
+    }
+}
+
+static size_t bitset_count_range(unsigned char *bitset, struct bitset_range range) {
+    const size_t *words = (const size_t *) bitset;
+    size_t result;
+
+    if (range.from_bucket == range.to_bucket) {
+        return popcount_word(words[range.from_bucket] & bitset_word_mask(range.from_index, range.to_index));
+    }
+
+    result = popcount_word(words[range.from_bucket] & bitset_word_mask(range.from_index, BITSET_WORD_BITS - 1u))
+        + popcount_word(words[range.to_bucket] & bitset_word_mask(0, range.to_index));
+    while(++range.from_bucket != range.to_bucket) {
+        result += popcount_word(words[range.from_bucket]);
+    }
+    return result;
+}
+#endif //BUDDY_FIXED_STATUS
 
+#endif //BUDDY_WORD_BITSET
+
+#ifndef BUDDY_FIXED_STATUS
 static void bitset_shift_left(unsigned char *bitset, size_t from_pos, size_t to_pos, size_t by) {
     size_t length = to_pos - from_pos;
     for(size_t i = 0; i < length; i++) {
@@ -1101,6 +2870,7 @@ static void bitset_shift_right(unsigned char *bitset, size_t from_pos, size_t to
         length -= 1;
     }
 }
+#endif //BUDDY_FIXED_STATUS
 
 void bitset_debug(unsigned char *bitset, size_t length) {
     for (size_t i = 0; i < length; i++) {
@@ -1112,6 +2882,8 @@ void bitset_debug(unsigned char *bitset, size_t length) {
  Bits
 */
 
+#ifndef BUDDY_WORD_BITSET
+
 static const unsigned char popcount_lookup[256] = {
     0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
     1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
@@ -1127,20 +2899,37 @@ static inline unsigned int popcount_byte(unsigned char b) {
     return popcount_lookup[b];
 }
 
+#else //BUDDY_WORD_BITSET
+
+static inline unsigned int popcount_word(size_t w) {
+#if SIZE_MAX > 0xFFFFFFFFu
+    return (unsigned int) __builtin_popcountll(w);
+#else
+    return (unsigned int) __builtin_popcount(w);
+#endif
+}
+
+#endif //BUDDY_WORD_BITSET
+
+/* Returns the number of trailing zero bits. Undefined for zero. */
+static inline unsigned int ctz_word(size_t w) {
+#if SIZE_MAX > 0xFFFFFFFFu
+    return (unsigned int) __builtin_ctzll(w);
+#else
+    return (unsigned int) __builtin_ctz(w);
+#endif
+}
+
 /* Returns the highest set bit position for the given value. Returns zero for zero. */
 static size_t highest_bit_position(size_t value) {
-    size_t result = 0;
-    /* some other millennia when size_t becomes 128-bit this will break :) */
-    const size_t all_set[] = {65535, 255, 15, 7, 3, 1};
-    const size_t count[] = {16, 8, 4, 2, 1, 1};
-
-    for (size_t i = 0; i < (sizeof all_set / sizeof *all_set); i++) {
-        if (value >= all_set[i]) {
-            value >>= count[i];
-            result += count[i];
-        }
+    if (value == 0) {
+        return 0;
     }
-    return result + value;
+#if SIZE_MAX > 0xFFFFFFFFu
+    return sizeof(unsigned long long) * CHAR_BIT - (size_t) __builtin_clzll(value);
+#else
+    return sizeof(unsigned int) * CHAR_BIT - (size_t) __builtin_clz(value);
+#endif
 }
 
 static inline size_t ceiling_power_of_two(size_t value) {
@@ -1171,46 +2960,147 @@ static inline size_t integer_square_root(size_t op) {
     return result;
 }
 
-static void _print_subtree(struct buddy *buddy,
-                           struct buddy_tree_pos pos,
-                           const char *prefix,
-                           bool is_last)
-{
-    struct buddy_tree *t = buddy_tree(buddy);
-    bool isFree = buddy_tree_is_free(t, pos);
-    size_t sz = size_for_depth(buddy, buddy_tree_depth(pos));
-    void *addr = address_for_position(buddy, pos);
-
-    // Print in the requested format:
-    //   └── size: 32, address: 0x5ccb73b0, occupied: true
-    printf("%s%s size: %zu, address: %p, occupied: %s\n",
-           prefix,
-           is_last ? "└──" : "├──",
-           sz,
-           addr,
-           isFree ? "false" : "true");
-
-    // Build prefix for children
-    char child_prefix[256];
-    strcpy(child_prefix, prefix);
-    strcat(child_prefix, is_last ? "    " : "│   ");
-
-    // Recurse left then right
-    struct buddy_tree_pos L = buddy_tree_left_child(pos);
-    struct buddy_tree_pos R = buddy_tree_right_child(pos);
-    bool has_left  = buddy_tree_valid(t, L);
-    bool has_right = buddy_tree_valid(t, R);
-
-    if (has_left)
-        _print_subtree(buddy, L, child_prefix, !has_right);
-    if (has_right)
-        _print_subtree(buddy, R, child_prefix, true);
-}
-
-void print_buddy_tree(struct buddy *buddy)
-{
-    struct buddy_tree_pos root = buddy_tree_root();                  /* :contentReference[oaicite:12]{index=12}:contentReference[oaicite:13]{index=13} */
-    _print_subtree(buddy, root, "", 1);
+/*
+ * Allocation map export
+ */
+
+/* Formatted runs are gathered here and passed to the sink in chunks */
+struct buddy_map_writer {
+    void (*sink)(const char *data, size_t length, void *context);
+    void *context;
+    size_t length;
+    char data[512];
+};
+
+static void buddy_map_flush(struct buddy_map_writer *writer) {
+    if (writer->length) {
+        writer->sink(writer->data, writer->length, writer->context);
+        writer->length = 0;
+    }
+}
+
+static void buddy_map_write(struct buddy_map_writer *writer, const char *format, ...) {
+    va_list args;
+    int written;
+    size_t space;
+
+    if (sizeof(writer->data) - writer->length < 128) {
+        buddy_map_flush(writer);
+    }
+    for (;;) {
+        space = sizeof(writer->data) - writer->length;
+        va_start(args, format);
+        written = vsnprintf(writer->data + writer->length, space, format, args);
+        va_end(args);
+        if (written < 0) {
+            return;
+        }
+        if ((size_t) written < space) {
+            writer->length += (size_t) written;
+            return;
+        }
+        if (writer->length == 0) {
+            /* Longer than the whole buffer, keep what fits without the terminator */
+            writer->length = space - 1;
+            return;
+        }
+        /* Truncated, flush what was gathered and format again */
+        buddy_map_flush(writer);
+    }
+}
+
+static void buddy_map_run(struct buddy_map_writer *writer, enum buddy_map_format format,
+        size_t runs, size_t offset, size_t size, bool used) {
+    const char *state = used ? "used" : "free";
+    if (format == BUDDY_MAP_JSON) {
+        buddy_map_write(writer, "%s{\"offset\":%zu,\"size\":%zu,\"state\":\"%s\"}",
+            runs ? "," : "", offset, size, state);
+    } else {
+        buddy_map_write(writer, "%zu %zu %s\n", offset, size, state);
+    }
+}
+
+size_t buddy_map_export(struct buddy *buddy, enum buddy_map_format format,
+        void (*sink)(const char *data, size_t length, void *context), void *context) {
+    struct buddy_map_writer writer;
+    struct buddy_tree *t;
+    struct buddy_tree_pos pos;
+    struct internal_position internal;
+    size_t status, offset, size, run_offset, run_size, runs;
+    bool used, run_used;
+
+    if ((buddy == NULL) || (sink == NULL)) {
+        return 0;
+    }
+    writer.sink = sink;
+    writer.context = context;
+    writer.length = 0;
+    if (format == BUDDY_MAP_JSON) {
+        buddy_map_write(&writer, "{\"memory_size\":%zu,\"alignment\":%zu,\"runs\":[",
+            buddy->memory_size, buddy->alignment);
+    }
+
+    /*
+     * Pre-order walk that only descends into partially used nodes, so free and
+     * fully used subtrees cost one status read each. The runs come out in
+     * address order and adjacent runs of the same state are merged.
+     */
+    t = buddy_tree(buddy);
+    pos = buddy_tree_root();
+    run_offset = run_size = runs = 0;
+    run_used = false;
+    for (;;) {
+        internal = buddy_tree_internal_position_tree(t, pos);
+        status = read_from_internal_position(buddy_tree_bits(t), internal);
+        if ((status != 0) && (status != internal.local_offset)) {
+            pos = buddy_tree_left_child(pos); /* Partially used, descend left */
+            continue;
+        }
+
+        /* The virtual slots past the end of the arena are not reported */
+        offset = (size_t) (address_for_position(buddy, pos) - buddy_main(buddy));
+        if (offset >= buddy->memory_size) {
+            break;
+        }
+        size = size_for_depth(buddy, buddy_tree_depth(pos));
+        if (size > buddy->memory_size - offset) {
+            size = buddy->memory_size - offset;
+        }
+        used = status != 0;
+        if (run_size && (used == run_used)) {
+            run_size += size;
+        } else {
+            if (run_size) {
+                buddy_map_run(&writer, format, runs++, run_offset, run_size, run_used);
+            }
+            run_offset = offset;
+            run_size = size;
+            run_used = used;
+        }
+
+        /* Ascend while on a right child, then move to the right sibling */
+        while ((pos.index & 1u) && (pos.index != buddy_tree_root().index)) {
+            pos = buddy_tree_parent(pos);
+        }
+        if (pos.index == buddy_tree_root().index) {
+            break;
+        }
+        pos = buddy_tree_right_adjacent(pos);
+    }
+    if (run_size) {
+        buddy_map_run(&writer, format, runs++, run_offset, run_size, run_used);
+    }
+
+    if (format == BUDDY_MAP_JSON) {
+        buddy_map_write(&writer, "]}\n");
+    }
+    buddy_map_flush(&writer);
+    return runs;
+}
+
+static void buddy_debug_sink(const char *data, size_t length, void *context) {
+    (void) context;
+    BUDDY_PRINTF("%.*s", (int) length, data);
 }
 
 void buddy_debug(struct buddy *buddy) {
@@ -1224,6 +3114,154 @@ void buddy_debug(struct buddy *buddy) {
     }
     BUDDY_PRINTF("\n");
     BUDDY_PRINTF("virtual slots: %zu\n", buddy_virtual_slots(buddy));
-    BUDDY_PRINTF("allocator tree follows:\n");
-    print_buddy_tree(buddy);
-}
\ No newline at end of file
+    BUDDY_PRINTF("allocation map follows (offset size state):\n");
+    buddy_map_export(buddy, BUDDY_MAP_TEXT, buddy_debug_sink, NULL);
+}
+
+/*
+ * Event tracing
+ */
+
+#if BUDDY_TRACE_LEVEL > 0
+
+/*
+ * Single producer, single consumer ring of events. The owning thread advances
+ * head, the draining thread advances tail. When the ring is full new events
+ * are dropped, rather than overwriting events the drain may be reading.
+ */
+struct buddy_trace_ring {
+    struct buddy_trace_event events[BUDDY_TRACE_RING_SIZE];
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<size_t> dropped;
+    std::atomic<bool> owned;
+    struct buddy_trace_ring *next;
+};
+
+/* Rings are never freed, the ring of a thread that exited is reused */
+static std::atomic<struct buddy_trace_ring *> buddy_trace_rings(NULL);
+
+/* Held by the thread draining the rings, each ring has a single consumer */
+static std::atomic_flag buddy_trace_draining = ATOMIC_FLAG_INIT;
+
+static struct buddy_trace_ring *buddy_trace_claim(void) {
+    struct buddy_trace_ring *ring, *first;
+    bool expected;
+
+    for (ring = buddy_trace_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return ring;
+        }
+    }
+    ring = new (std::nothrow) buddy_trace_ring();
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->owned.store(true, std::memory_order_relaxed);
+    first = buddy_trace_rings.load(std::memory_order_relaxed);
+    do {
+        ring->next = first;
+    } while (! buddy_trace_rings.compare_exchange_weak(first, ring, std::memory_order_release));
+    return ring;
+}
+
+/* Gives the ring back when the thread exits */
+struct buddy_trace_owner {
+    struct buddy_trace_ring *ring;
+    ~buddy_trace_owner() {
+        if (ring) {
+            ring->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+static struct buddy_trace_ring *buddy_trace_thread_ring(void) {
+    static thread_local struct buddy_trace_owner owner = { buddy_trace_claim() };
+    return owner.ring;
+}
+
+static void buddy_trace_record(enum buddy_trace_op op, size_t size, size_t depth, void *address) {
+    struct buddy_trace_ring *ring = buddy_trace_thread_ring();
+    struct buddy_trace_event *event;
+    size_t head;
+
+    if (ring == NULL) {
+        return;
+    }
+    head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == BUDDY_TRACE_RING_SIZE) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event = &ring->events[head % BUDDY_TRACE_RING_SIZE];
+    event->timestamp = BUDDY_TRACE_TIMESTAMP();
+    event->size = size;
+    event->address = address;
+    event->op = (uint8_t) op;
+    event->depth = (uint8_t) depth;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+size_t buddy_trace_drain(void (*sink)(const struct buddy_trace_event *event, void *context), void *context) {
+    struct buddy_trace_ring *ring;
+    size_t head, tail, count = 0;
+
+    if (buddy_trace_draining.test_and_set(std::memory_order_acquire)) {
+        return 0; /* another thread is draining, the events go to its sink */
+    }
+    for (ring = buddy_trace_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        head = ring->head.load(std::memory_order_acquire);
+        for (tail = ring->tail.load(std::memory_order_relaxed); tail != head; tail++) {
+            sink(&ring->events[tail % BUDDY_TRACE_RING_SIZE], context);
+            count++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    buddy_trace_draining.clear(std::memory_order_release);
+    return count;
+}
+
+size_t buddy_trace_dropped(void) {
+    struct buddy_trace_ring *ring;
+    size_t count = 0;
+
+    for (ring = buddy_trace_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        count += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+#else //BUDDY_TRACE_LEVEL
+
+size_t buddy_trace_drain(void (*sink)(const struct buddy_trace_event *event, void *context), void *context) {
+    (void) sink;
+    (void) context;
+    return 0;
+}
+
+size_t buddy_trace_dropped(void) {
+    return 0;
+}
+
+#endif //BUDDY_TRACE_LEVEL
+
+static void buddy_trace_print_event(const struct buddy_trace_event *event, void *context) {
+    static const char *const names[] = {
+        "malloc", "malloc failed", "dealloc", "realloc in place", "realloc moved", "realloc failed"
+    };
+    (void) context;
+    BUDDY_PRINTF("%llu %s size: %zu depth: %u address: %p\n", (unsigned long long) event->timestamp,
+        event->op < sizeof(names) / sizeof(names[0]) ? names[event->op] : "unknown",
+        event->size, (unsigned int) event->depth, event->address);
+}
+
+void buddy_trace_print(void) {
+    size_t dropped;
+
+    buddy_trace_drain(buddy_trace_print_event, NULL);
+    dropped = buddy_trace_dropped();
+    if (dropped) {
+        BUDDY_PRINTF("%zu events dropped\n", dropped);
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
 
 struct buddy;
 
@@ -30,14 +31,217 @@ struct buddy *buddy_embed(unsigned char *main, size_t memory_size);
  */
 struct buddy *buddy_embed_alignment(unsigned char *main, size_t memory_size, size_t alignment);
 
+/*
+ * Same as buddy_init_alignment, but the memory at the specified location must
+ * already be zero, for example freshly mapped anonymous memory. It is not
+ * cleared, so initialization does not depend on the arena size and only the
+ * metadata pages the allocator writes to get committed, on first touch.
+ */
+struct buddy *buddy_init_lazy(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment);
+
+/* Same as buddy_embed_alignment, the end of the arena must already be zero as for buddy_init_lazy */
+struct buddy *buddy_embed_lazy(unsigned char *main, size_t memory_size, size_t alignment);
+
+/*
+ * Resizes the arena of the specified buddy keeping the live allocations.
+ * Growing requires the memory past the current end to be available and, for
+ * a buddy created with buddy_init, the metadata to have room for
+ * buddy_sizeof_alignment(new_memory_size, alignment) bytes. Shrinking fails if
+ * an allocation overlaps the removed tail. An embedded buddy moves its
+ * metadata to the new end of the arena. When built with BUDDY_BLOCKED_LAYOUT
+ * the size can only change within the same power of two. Returns the buddy,
+ * or NULL leaving it unchanged if it cannot be resized.
+ */
+struct buddy *buddy_resize(struct buddy *buddy, size_t new_memory_size);
+
+/* How the allocator chooses among the free blocks that fit a request */
+enum buddy_policy {
+    BUDDY_POLICY_BUSIEST,   /* default, the busier half when both fit, the left one on ties */
+    BUDDY_POLICY_LOWEST,    /* the lowest address that fits */
+    BUDDY_POLICY_BEST_FIT,  /* the smallest free block that fits, the lowest one on ties */
+    BUDDY_POLICY_TWO_ENDED, /* lowest address, but blocks of at least threshold bytes from the high end */
+};
+
+/*
+ * Sets the placement policy of the specified buddy. threshold is only used by
+ * BUDDY_POLICY_TWO_ENDED. Best fit is O(order) when built with
+ * BUDDY_FREE_INDEX, otherwise it walks the tree until it finds a free block of
+ * the requested size.
+ */
+void buddy_set_policy(struct buddy *buddy, enum buddy_policy policy, size_t threshold);
+
 /* Use the specified buddy to allocate memory. */
 void *buddy_malloc(struct buddy *buddy, size_t requested_size);
 
 /* Use the specified buddy to deallocate memory. */
 void buddy_dealloc(struct buddy *buddy, void *ptr);
 
-/* Use the specified buddy to reallocate a memory block. */
+/* Use the specified buddy to reallocate a memory block, in place when possible. */
 void *buddy_realloc(struct buddy *buddy, void *ptr, size_t requested_size);
 
-/* Prints the buddy allocator tree */
-void buddy_debug(struct buddy *buddy);
\ No newline at end of file
+/* How buddy_realloc_report satisfied a request */
+enum buddy_realloc_outcome {
+    BUDDY_REALLOC_FAILED,   /* NULL was returned, the block is preserved */
+    BUDDY_REALLOC_IN_PLACE, /* the block was resized without moving it */
+    BUDDY_REALLOC_MOVED,    /* the block was allocated at a different address */
+    BUDDY_REALLOC_FREED,    /* the requested size was zero, the block was deallocated */
+};
+
+/* Same as buddy_realloc, also reporting whether the block was resized in place or moved. */
+void *buddy_realloc_report(struct buddy *buddy, void *ptr, size_t requested_size,
+    enum buddy_realloc_outcome *outcome);
+
+/*
+ * Use the specified buddy to allocate count blocks of the requested sizes,
+ * storing their addresses in results. Either all the blocks are allocated or
+ * none is: returns count on success, zero on failure.
+ */
+size_t buddy_malloc_batch(struct buddy *buddy, const size_t *requested_sizes, void **results, size_t count);
+
+/*
+ * Use the specified buddy to deallocate count blocks, updating each ancestor
+ * shared by the blocks once per batch. The array is sorted in place.
+ */
+void buddy_dealloc_batch(struct buddy *buddy, void **ptrs, size_t count);
+
+/*
+ * Returns the number of free blocks of alignment * 2^order bytes that are not
+ * part of a larger free block. O(1) when built with BUDDY_FREE_INDEX.
+ */
+size_t buddy_free_blocks(struct buddy *buddy, size_t order);
+
+/* A block to relocate, see buddy_defrag_plan */
+struct buddy_move {
+    void *from;  /* current address of the block */
+    void *to;    /* address the block has to be moved to */
+    size_t size; /* size of the block */
+};
+
+/*
+ * Plans the fewest block moves that would free a block of requested_size
+ * bytes, when the free space is enough but too fragmented. Only the blocks for
+ * which movable returns nonzero are moved, movable may be NULL if every block
+ * can move and may be called more than once per block. Returns the number of
+ * moves stored in moves, zero if a block is already free, SIZE_MAX if no plan
+ * with at most max_moves moves exists. The buddy is not changed.
+ */
+size_t buddy_defrag_plan(struct buddy *buddy, size_t requested_size, struct buddy_move *moves, size_t max_moves,
+    int (*movable)(void *block, void *context), void *context);
+
+/*
+ * Updates the specified buddy after the caller copied the data of the blocks
+ * as described by moves. Either all the moves are applied or none is: returns
+ * count on success, zero if a source is not allocated or a destination is not
+ * free, for example because the buddy was used after buddy_defrag_plan.
+ */
+size_t buddy_defrag_apply(struct buddy *buddy, const struct buddy_move *moves, size_t count);
+
+/* Allocator statistics, see buddy_stats */
+struct buddy_stats {
+    size_t total_bytes;        /* size of the arena */
+    size_t free_bytes;         /* bytes not allocated */
+    size_t largest_free_block; /* size of the largest block that can be allocated */
+    size_t allocated_blocks;   /* number of live allocations */
+    size_t allocated_blocks_per_order[sizeof(size_t) * 8]; /* live allocations of alignment * 2^order bytes */
+    unsigned char fragmentation; /* 0 if the free space is a single block, up to 255 */
+};
+
+/*
+ * Fills stats with the state of the specified buddy in O(order) time. The
+ * counts and the fragmentation sums are kept up to date by every operation.
+ */
+void buddy_stats(struct buddy *buddy, struct buddy_stats *stats);
+
+/* Returns the start of the arena of the specified buddy */
+unsigned char *buddy_arena(struct buddy *buddy);
+
+/* Returns the alignment of the specified buddy, the size of its smallest block */
+size_t buddy_alignment(struct buddy *buddy);
+
+/* Formats of buddy_map_export */
+enum buddy_map_format {
+    BUDDY_MAP_TEXT, /* one "offset size state" line per run */
+    BUDDY_MAP_JSON, /* {"memory_size":..,"alignment":..,"runs":[{"offset":..,"size":..,"state":..},..]} */
+};
+
+/*
+ * Writes the allocation map of the specified buddy to sink, in chunks, as runs
+ * of "free" or "used" bytes in address order. Offsets are relative to the
+ * arena, so maps of different runs can be diffed. Free and fully used
+ * subtrees are not descended into, so the cost grows with the number of runs
+ * rather than the size of the tree. Returns the number of runs.
+ */
+size_t buddy_map_export(struct buddy *buddy, enum buddy_map_format format,
+    void (*sink)(const char *data, size_t length, void *context), void *context);
+
+/* Prints the buddy allocator state and its allocation map */
+void buddy_debug(struct buddy *buddy);
+
+/* Returns the size of a snapshot of the specified buddy, see buddy_snapshot_save */
+size_t buddy_snapshot_size(struct buddy *buddy);
+
+/*
+ * Writes a snapshot of the specified buddy to "to": a versioned header with a
+ * checksum, followed by a copy of the allocator metadata. The arena itself is
+ * not saved. Returns the bytes written, zero if size is less than
+ * buddy_snapshot_size.
+ */
+size_t buddy_snapshot_save(struct buddy *buddy, unsigned char *to, size_t size);
+
+/*
+ * Returns a buddy for the arena at main that uses the snapshot at "from" in
+ * place, for example a file mapped in memory, or NULL if the snapshot was not
+ * saved by a build with the same layout or is truncated. Only the header is
+ * validated, in O(1), see buddy_snapshot_verify to also check the metadata.
+ * A snapshot of an embedded buddy is loaded as a standard one.
+ */
+struct buddy *buddy_snapshot_load(unsigned char *from, size_t size, unsigned char *main);
+
+/*
+ * Seals a snapshot that was loaded in place and then used, so that
+ * buddy_snapshot_verify accepts it again: the arena binding written by
+ * buddy_snapshot_load is restored as it was saved and the metadata checksum
+ * is recomputed. The buddy has to be loaded again before it is used. Returns
+ * the size of the snapshot, zero if the header is not valid.
+ */
+size_t buddy_snapshot_sync(unsigned char *from, size_t size);
+
+/*
+ * Checks the metadata of a snapshot against the checksum in its header, in
+ * time proportional to its size. The checksum describes the snapshot as saved,
+ * so this has to be called before buddy_snapshot_load, which rebinds the
+ * arena. Returns the size of the snapshot, zero if it does not match.
+ */
+size_t buddy_snapshot_verify(const unsigned char *from, size_t size);
+
+/* Allocator events, recorded when built with BUDDY_TRACE_LEVEL greater than zero */
+enum buddy_trace_op {
+    BUDDY_TRACE_MALLOC,
+    BUDDY_TRACE_MALLOC_FAILED,
+    BUDDY_TRACE_DEALLOC,
+    BUDDY_TRACE_REALLOC_IN_PLACE,
+    BUDDY_TRACE_REALLOC_MOVED,
+    BUDDY_TRACE_REALLOC_FAILED,
+};
+
+struct buddy_trace_event {
+    uint64_t timestamp; /* cycle counter when the event was recorded */
+    size_t size;        /* requested size, or block size for a dealloc */
+    void *address;      /* address of the block, NULL if the operation failed */
+    uint8_t op;         /* one of buddy_trace_op */
+    uint8_t depth;      /* tree depth of the block */
+};
+
+/*
+ * Passes the events recorded by all threads to sink, in order for each
+ * thread, and removes them. Returns the number of events. Safe to call while
+ * other threads allocate. Only one thread drains at a time: if another thread
+ * is already draining, returns zero and the events are passed to its sink.
+ */
+size_t buddy_trace_drain(void (*sink)(const struct buddy_trace_event *event, void *context), void *context);
+
+/* Returns and resets the number of events dropped because a ring was full */
+size_t buddy_trace_dropped(void);
+
+/* Drains the recorded events, printing them */
+void buddy_trace_print(void);
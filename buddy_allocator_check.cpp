@@ -0,0 +1,854 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Checks of the buddy allocator API against the expected results. Build it
+ * once per bitset layout, the checks do not depend on it:
+ *
+ * g++ -O2 -o check buddy_allocator_check.cpp buddy_allocator.cpp buddy_snapshot.cpp
+ * g++ -O2 -o check_word -DBUDDY_WORD_BITSET buddy_allocator_check.cpp \
+ *     buddy_allocator.cpp buddy_snapshot.cpp
+ * ./check && ./check_word
+ *
+ * -DBUDDY_FREE_INDEX, -DBUDDY_BLOCKED_LAYOUT and -DBUDDY_FIXED_STATUS select
+ * the other layouts. Prints the failed checks and returns 1 if any.
+ */
+
+#include "buddy_allocator.h"
+#include "buddy_snapshot.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+///Minimum block size of the buddies under test
+static const size_t alignment=64;
+///Arena size, not a power of two so that the virtual slots are exercised
+static const size_t arenaSize=1024*1024-5*alignment;
+
+static unsigned int errors=0;
+
+static void check(bool ok, const char *what)
+{
+    if(ok) return;
+    printf("FAILED: %s\n",what);
+    errors++;
+}
+
+/**
+ * Small deterministic generator, so that runs are reproducible
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * Metadata of a buddy, aligned for struct buddy
+ */
+static vector<size_t> metadataFor(size_t size)
+{
+    return vector<size_t>(buddy_sizeof_alignment(size,alignment)/sizeof(size_t)+1);
+}
+
+/**
+ * Allocate blocks of random sizes, then free some of them at random, so that
+ * the arena is fragmented
+ * \return the live blocks
+ */
+static vector<void*> fragment(struct buddy *buddy, unsigned int seed, unsigned int count)
+{
+    vector<void*> live;
+    unsigned int state=seed;
+    for(unsigned int i=0;i<count;i++)
+    {
+        void *p=buddy_malloc(buddy,alignment<<(xorshift(state) % 6));
+        if(p) live.push_back(p);
+    }
+    for(size_t i=0;i<live.size();)
+    {
+        if(xorshift(state) % 3==0)
+        {
+            buddy_dealloc(buddy,live[i]);
+            live[i]=live.back();
+            live.pop_back();
+        } else i++;
+    }
+    return live;
+}
+
+static void appendMap(const char *data, size_t length, void *context)
+{
+    static_cast<string*>(context)->append(data,length);
+}
+
+/**
+ * \return the allocation map of the buddy in text format
+ */
+static string mapOf(struct buddy *buddy)
+{
+    string result;
+    buddy_map_export(buddy,BUDDY_MAP_TEXT,appendMap,&result);
+    return result;
+}
+
+/**
+ * \return true if the buddy has no live allocation
+ */
+static bool isEmpty(struct buddy *buddy)
+{
+    struct buddy_stats stats;
+    buddy_stats(buddy,&stats);
+    return stats.allocated_blocks==0 && stats.free_bytes==stats.total_bytes;
+}
+
+/**
+ * \return true if deallocating the live blocks leaves the buddy empty
+ */
+static bool releaseAll(struct buddy *buddy, vector<void*>& live)
+{
+    for(void *p : live) buddy_dealloc(buddy,p);
+    live.clear();
+    return isEmpty(buddy);
+}
+
+/**
+ * \return the number of live allocations of the buddy
+ */
+static size_t liveBlocks(struct buddy *buddy)
+{
+    struct buddy_stats stats;
+    buddy_stats(buddy,&stats);
+    return stats.allocated_blocks;
+}
+
+/**
+ * Check every outcome of buddy_realloc_report, and that a failed call
+ * leaves the block where it was
+ */
+static void checkRealloc(unsigned char *arena)
+{
+    vector<size_t> metadata=metadataFor(arenaSize);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,arenaSize,alignment);
+    enum buddy_realloc_outcome outcome;
+
+    //NULL degrades into malloc
+    unsigned char *p=static_cast<unsigned char*>(buddy_realloc_report(buddy,nullptr,4*alignment,&outcome));
+    check(p!=nullptr && outcome==BUDDY_REALLOC_MOVED,"realloc of NULL is not a malloc");
+
+    //Same size, shrink and grow back into the free buddies stay in place
+    check(buddy_realloc_report(buddy,p,4*alignment,&outcome)==p && outcome==BUDDY_REALLOC_IN_PLACE,
+          "realloc to the same size moved");
+    check(buddy_realloc_report(buddy,p,alignment,&outcome)==p && outcome==BUDDY_REALLOC_IN_PLACE,
+          "shrinking realloc moved");
+    struct buddy_stats stats;
+    buddy_stats(buddy,&stats);
+    check(stats.total_bytes-stats.free_bytes==alignment,"shrinking realloc did not free the right-hand halves");
+    check(buddy_realloc_report(buddy,p,4*alignment,&outcome)==p && outcome==BUDDY_REALLOC_IN_PLACE,
+          "growing realloc into free buddies moved");
+
+    //Growing into a used buddy moves the block and frees the old one
+    unsigned char *blocker=static_cast<unsigned char*>(buddy_malloc(buddy,4*alignment));
+    check(blocker==p+4*alignment,"blocker not allocated next to the block");
+    unsigned char *moved=static_cast<unsigned char*>(buddy_realloc_report(buddy,p,8*alignment,&outcome));
+    check(moved!=nullptr && moved!=p && outcome==BUDDY_REALLOC_MOVED,"growing realloc into a used buddy did not move");
+    check(liveBlocks(buddy)==2,"moved realloc did not free the old block");
+
+    //Failures leave the block and the rest of the buddy unchanged
+    string before=mapOf(buddy);
+    check(buddy_realloc_report(buddy,moved,arenaSize+1,&outcome)==nullptr && outcome==BUDDY_REALLOC_FAILED,
+          "realloc larger than the arena did not fail");
+    check(mapOf(buddy)==before,"failed realloc larger than the arena changed the buddy");
+    vector<void*> filler;
+    for(void *f;(f=buddy_malloc(buddy,alignment))!=nullptr;) filler.push_back(f);
+    before=mapOf(buddy);
+    check(buddy_realloc_report(buddy,blocker,8*alignment,&outcome)==nullptr && outcome==BUDDY_REALLOC_FAILED,
+          "realloc in a full buddy did not fail");
+    check(mapOf(buddy)==before,"failed realloc in a full buddy changed the buddy");
+    buddy_dealloc(buddy,blocker);
+    check(buddy_malloc(buddy,4*alignment)==blocker,"failed realloc did not keep the block in place");
+    for(void *f : filler) buddy_dealloc(buddy,f);
+
+    //Zero size degrades into free
+    check(buddy_realloc_report(buddy,moved,0,&outcome)==nullptr && outcome==BUDDY_REALLOC_FREED,
+          "realloc to zero did not free");
+    check(liveBlocks(buddy)==1,"realloc to zero did not free the block");
+    check(buddy_realloc_report(buddy,blocker,alignment,nullptr)==blocker,"realloc without an outcome failed");
+}
+
+///Size of the arena of the defragmentation check, a power of two
+static const size_t defragArenaSize=256*1024;
+///Size of the block the defragmentation check makes room for
+static const size_t defragSize=16*1024;
+
+/**
+ * Blocks buddy_defrag_plan may not move, see checkDefrag
+ */
+static int defragMovable(void *block, void *context)
+{
+    const vector<void*> *pinned=static_cast<const vector<void*>*>(context);
+    return find(pinned->begin(),pinned->end(),block)==pinned->end();
+}
+
+/**
+ * Fragment an arena so that no block of defragSize is free, with a known
+ * number of blocks in each region of defragSize, and check that the plan
+ * moves the fewest blocks, never a pinned one, that apply is all or nothing
+ * and that afterwards a block of defragSize can be allocated
+ */
+static void checkDefrag(unsigned char *arena)
+{
+    vector<size_t> metadata=metadataFor(defragArenaSize);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,defragArenaSize,alignment);
+    const size_t regions=defragArenaSize/defragSize, perRegion=defragSize/alignment;
+    vector<void*> blocks;
+    for(void *p;(p=buddy_malloc(buddy,alignment))!=nullptr;) blocks.push_back(p);
+    check(blocks.size()==regions*perRegion,"arena not filled with the smallest blocks");
+
+    //Region r keeps 2+(7r mod 13) blocks, spread over the region
+    vector<size_t> kept(regions);
+    vector<void*> live;
+    unsigned int state=0x2545f491;
+    sort(blocks.begin(),blocks.end());
+    for(size_t r=0;r<regions;r++)
+    {
+        kept[r]=2+(7*r) % 13;
+        vector<void*> region(blocks.begin()+r*perRegion,blocks.begin()+(r+1)*perRegion);
+        for(size_t i=region.size()-1;i>0;i--) swap(region[i],region[xorshift(state) % (i+1)]);
+        for(size_t i=0;i<region.size();i++)
+        {
+            if(i<kept[r]) live.push_back(region[i]);
+            else buddy_dealloc(buddy,region[i]);
+        }
+    }
+    check(buddy_malloc(buddy,defragSize)==nullptr,"arena not fragmented");
+
+    //Pin one block of each region with the fewest blocks, the plan has to
+    //empty the best region among the others
+    size_t fewest=*min_element(kept.begin(),kept.end());
+    vector<void*> pinned;
+    for(void *p : live)
+    {
+        size_t r=(static_cast<unsigned char*>(p)-arena)/defragSize;
+        bool first=find_if(pinned.begin(),pinned.end(),[&](void *q) {
+            return static_cast<size_t>((static_cast<unsigned char*>(q)-arena)/defragSize)==r; })==pinned.end();
+        if(kept[r]==fewest && first) pinned.push_back(p);
+    }
+    size_t expected=SIZE_MAX;
+    for(size_t r=0;r<regions;r++) if(kept[r]!=fewest) expected=min(expected,kept[r]);
+
+    struct buddy_move moves[32];
+    check(buddy_defrag_plan(buddy,defragSize,moves,32,nullptr,nullptr)==fewest,
+          "plan without pinned blocks does not move the fewest blocks");
+    check(buddy_defrag_plan(buddy,defragSize,moves,expected-1,defragMovable,&pinned)==SIZE_MAX,
+          "plan found with fewer moves than the minimum");
+    string before=mapOf(buddy);
+    size_t count=buddy_defrag_plan(buddy,defragSize,moves,32,defragMovable,&pinned);
+    check(count==expected,"plan does not move the fewest blocks");
+    check(mapOf(buddy)==before,"planning changed the buddy");
+    if(count!=expected) return;
+    size_t region=(static_cast<unsigned char*>(moves[0].from)-arena)/defragSize;
+    for(size_t i=0;i<count;i++)
+    {
+        check(defragMovable(moves[i].from,&pinned),"plan moves a pinned block");
+        check(static_cast<size_t>((static_cast<unsigned char*>(moves[i].from)-arena)/defragSize)==region,
+              "plan moves blocks from more than one region");
+        check(static_cast<size_t>((static_cast<unsigned char*>(moves[i].to)-arena)/defragSize)!=region,
+              "plan moves a block within the region it empties");
+        check(moves[i].size==alignment,"plan has the wrong block size");
+    }
+
+    //A destination allocated after planning makes apply fail without changes
+    vector<void*> filler;
+    for(void *p;(p=buddy_malloc(buddy,alignment))!=nullptr;) filler.push_back(p);
+    before=mapOf(buddy);
+    check(buddy_defrag_apply(buddy,moves,count)==0,"apply with a used destination succeeded");
+    check(mapOf(buddy)==before,"failed apply changed the buddy");
+    for(void *p : filler) buddy_dealloc(buddy,p);
+    filler.clear();
+
+    //So does a source freed after planning, it is then allocated again
+    void *source=moves[count-1].from;
+    buddy_dealloc(buddy,source);
+    before=mapOf(buddy);
+    check(buddy_defrag_apply(buddy,moves,count)==0,"apply with a freed source succeeded");
+    check(mapOf(buddy)==before,"failed apply changed the buddy");
+    for(void *p;(p=buddy_malloc(buddy,alignment))!=nullptr && p!=source;) filler.push_back(p);
+    for(void *p : filler) buddy_dealloc(buddy,p);
+
+    //Applied to the buddy it was planned for, the region becomes free
+    size_t allocated=liveBlocks(buddy);
+    check(buddy_defrag_apply(buddy,moves,count)==count,"apply failed");
+    check(liveBlocks(buddy)==allocated,"apply changed the number of blocks");
+    unsigned char *freed=static_cast<unsigned char*>(buddy_malloc(buddy,defragSize));
+    check(freed==arena+region*defragSize,"block not available in the region emptied by apply");
+    for(size_t i=0;i<count;i++)
+    {
+        //The moved blocks are allocated at their destination
+        buddy_dealloc(buddy,moves[i].to);
+        check(liveBlocks(buddy)==allocated-i,"moved block not allocated at its destination");
+    }
+}
+
+/**
+ * \return the used runs of the allocation map of the buddy, which unlike the
+ * whole map do not depend on the size of the arena
+ */
+static string usedMap(struct buddy *buddy)
+{
+    string map=mapOf(buddy), result;
+    for(size_t begin=0,end;begin<map.size();begin=end+1)
+    {
+        end=map.find('\n',begin);
+        if(end==string::npos) end=map.size();
+        if(map.compare(end-4,4,"used")==0) result.append(map,begin,end-begin+1);
+    }
+    return result;
+}
+
+/**
+ * Fill the buddy with blocks of the given size, then free all of them but the
+ * one at the highest address
+ * \return the block left allocated, at the end of the arena
+ */
+static void *tailBlock(struct buddy *buddy, size_t size)
+{
+    vector<void*> blocks;
+    for(void *p;(p=buddy_malloc(buddy,size))!=nullptr;) blocks.push_back(p);
+    if(blocks.empty()) return nullptr;
+    sort(blocks.begin(),blocks.end());
+    for(size_t i=0;i+1<blocks.size();i++) buddy_dealloc(buddy,blocks[i]);
+    return blocks.back();
+}
+
+/**
+ * \return true if the live blocks are allocations of the buddy, deallocating
+ * each of them frees exactly one block
+ */
+static bool releaseEach(struct buddy *buddy, vector<void*>& live)
+{
+    bool ok=true;
+    for(void *p : live)
+    {
+        size_t allocated=liveBlocks(buddy);
+        buddy_dealloc(buddy,p);
+        ok=ok && liveBlocks(buddy)==allocated-1;
+    }
+    live.clear();
+    return ok && isEmpty(buddy);
+}
+
+///Sizes the resize check goes through, the first two within a power of two
+static const size_t resizeSmall=96*1024, resizeLarge=120*1024, resizeHuge=200*1024;
+
+/**
+ * Resize a standard and an embedded buddy with live allocations, growing and
+ * shrinking, and check that the allocations are kept, that the new space can
+ * be used and that a shrink dropping an allocation fails without changes
+ */
+static void checkResize(unsigned char *arena)
+{
+    //The metadata has room for the largest size
+    vector<size_t> metadata=metadataFor(resizeHuge);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,resizeSmall,alignment);
+    vector<void*> live=fragment(buddy,0x2545f491,300);
+    string used=usedMap(buddy);
+    struct buddy_stats stats;
+
+    check(buddy_resize(buddy,resizeLarge)==buddy,"standard buddy not grown within its power of two");
+    check(usedMap(buddy)==used,"growing changed the live allocations");
+    buddy_stats(buddy,&stats);
+    check(stats.total_bytes==resizeLarge,"grown buddy has the wrong size");
+    void *tail=tailBlock(buddy,alignment);
+    check(tail==arena+resizeLarge-alignment,"grown space cannot be allocated");
+
+    //The tail block, partially or wholly past the new end, blocks a shrink
+    string before=mapOf(buddy);
+    check(buddy_resize(buddy,resizeSmall)==nullptr,"shrink over an allocation succeeded");
+    check(buddy_resize(buddy,resizeLarge-alignment/2)==nullptr,"shrink within an allocation succeeded");
+    check(mapOf(buddy)==before,"failed shrink changed the buddy");
+    buddy_dealloc(buddy,tail);
+
+#ifdef BUDDY_BLOCKED_LAYOUT
+    before=mapOf(buddy);
+    check(buddy_resize(buddy,resizeHuge)==nullptr,"blocked layout grown to another power of two");
+    check(mapOf(buddy)==before,"failed grow changed the buddy");
+#else //BUDDY_BLOCKED_LAYOUT
+    check(buddy_resize(buddy,resizeHuge)==buddy,"standard buddy not grown to the next power of two");
+    check(usedMap(buddy)==used,"growing to the next power of two changed the live allocations");
+    tail=tailBlock(buddy,alignment);
+    check(tail==arena+resizeHuge-alignment,"grown space in the next power of two cannot be allocated");
+    buddy_dealloc(buddy,tail);
+#endif //BUDDY_BLOCKED_LAYOUT
+
+    check(buddy_resize(buddy,resizeSmall)==buddy,"standard buddy not shrunk");
+    check(usedMap(buddy)==used,"shrinking changed the live allocations");
+    buddy_stats(buddy,&stats);
+    check(stats.total_bytes==resizeSmall,"shrunk buddy has the wrong size");
+    check(releaseEach(buddy,live),"live allocations lost by resizing");
+
+    //An embedded buddy moves its metadata to the new end, the memory it used
+    //before is then scribbled over to make sure it is no longer read
+    struct buddy *embedded=buddy_embed_alignment(arena,resizeSmall,alignment);
+    check(embedded!=nullptr,"embedded buddy not created");
+    if(embedded==nullptr) return;
+    live=fragment(embedded,0x9e3779b9,300);
+    used=usedMap(embedded);
+    unsigned char *old=reinterpret_cast<unsigned char*>(embedded);
+    size_t oldSize=buddy_sizeof_alignment(resizeSmall,alignment);
+    embedded=buddy_resize(embedded,resizeLarge);
+    check(embedded!=nullptr,"embedded buddy not grown");
+    if(embedded==nullptr) return;
+    unsigned char *moved=reinterpret_cast<unsigned char*>(embedded);
+    buddy_stats(embedded,&stats);
+    check(moved>old && moved>=arena+stats.total_bytes
+          && moved+buddy_sizeof_alignment(stats.total_bytes,alignment)<=arena+resizeLarge,
+          "grown embedded buddy metadata not at the end of the arena");
+    check(buddy_arena(embedded)==arena,"grown embedded buddy bound to the wrong arena");
+    memset(old,0xa5,oldSize);
+    check(usedMap(embedded)==used,"growing changed the live embedded allocations");
+
+    tail=tailBlock(embedded,alignment);
+    check(tail==arena+stats.total_bytes-alignment,"grown embedded space cannot be allocated");
+    before=mapOf(embedded);
+    check(buddy_resize(embedded,resizeSmall)==nullptr,"embedded shrink over an allocation succeeded");
+    check(mapOf(embedded)==before,"failed embedded shrink changed the buddy");
+    buddy_dealloc(embedded,tail);
+
+    old=moved;
+    oldSize=buddy_sizeof_alignment(stats.total_bytes,alignment);
+    embedded=buddy_resize(embedded,resizeSmall);
+    check(embedded!=nullptr,"embedded buddy not shrunk");
+    if(embedded==nullptr) return;
+    moved=reinterpret_cast<unsigned char*>(embedded);
+    buddy_stats(embedded,&stats);
+    check(moved<old && moved>=arena+stats.total_bytes
+          && moved+buddy_sizeof_alignment(stats.total_bytes,alignment)<=arena+resizeSmall,
+          "shrunk embedded buddy metadata not at the end of the arena");
+    //Only the part of the old metadata past the new one is unused
+    if(old>=moved+buddy_sizeof_alignment(stats.total_bytes,alignment)) memset(old,0x5a,oldSize);
+    check(usedMap(embedded)==used,"shrinking changed the live embedded allocations");
+    check(releaseEach(embedded,live),"live embedded allocations lost by resizing");
+}
+
+/**
+ * A run of buddy_map_export
+ */
+struct Run
+{
+    size_t offset;
+    size_t size;
+    bool used;
+    bool operator==(const Run& other) const
+    {
+        return offset==other.offset && size==other.size && used==other.used;
+    }
+};
+
+/**
+ * \return the runs of a map in text format, empty if a line is malformed
+ */
+static vector<Run> textRuns(const string& map)
+{
+    vector<Run> result;
+    for(size_t begin=0,end;begin<map.size();begin=end+1)
+    {
+        end=map.find('\n',begin);
+        if(end==string::npos) return vector<Run>();
+        Run run;
+        char state[8];
+        if(sscanf(map.c_str()+begin,"%zu %zu %7s",&run.offset,&run.size,state)!=3) return vector<Run>();
+        run.used=strcmp(state,"used")==0;
+        if(!run.used && strcmp(state,"free")!=0) return vector<Run>();
+        result.push_back(run);
+    }
+    return result;
+}
+
+/**
+ * \return the runs of a map in json format, empty if it is malformed or the
+ * header does not match the given size and alignment
+ */
+static vector<Run> jsonRuns(const string& map, size_t memorySize)
+{
+    vector<Run> result;
+    char header[128];
+    snprintf(header,sizeof(header),"{\"memory_size\":%zu,\"alignment\":%zu,\"runs\":[",memorySize,alignment);
+    if(map.compare(0,strlen(header),header)!=0 || map.compare(map.size()-3,3,"]}\n")!=0) return result;
+    for(size_t at=strlen(header);at<map.size()-3;)
+    {
+        Run run;
+        char state[8];
+        int length=0;
+        if(sscanf(map.c_str()+at,"{\"offset\":%zu,\"size\":%zu,\"state\":\"%4[a-z]\"}%n",
+                  &run.offset,&run.size,state,&length)!=3 || length==0) return vector<Run>();
+        run.used=strcmp(state,"used")==0;
+        if(!run.used && strcmp(state,"free")!=0) return vector<Run>();
+        result.push_back(run);
+        at+=length;
+        if(map[at]==',') at++;
+    }
+    return result;
+}
+
+/**
+ * \return the runs expected for a shadow model with one flag per block of
+ * alignment bytes, adjacent runs of the same state merged
+ */
+static vector<Run> shadowRuns(const vector<bool>& used)
+{
+    vector<Run> result;
+    for(size_t i=0;i<used.size();i++)
+    {
+        if(!result.empty() && result.back().used==used[i]) result.back().size+=alignment;
+        else result.push_back({i*alignment,alignment,used[i]});
+    }
+    return result;
+}
+
+/**
+ * Export the map of a buddy in both formats and check it against the shadow
+ * model: the runs cover the arena in address order, the formats agree and
+ * the returned count matches
+ */
+static void checkMapAgainst(struct buddy *buddy, const vector<bool>& used, const char *what)
+{
+    string text, json;
+    size_t textCount=buddy_map_export(buddy,BUDDY_MAP_TEXT,appendMap,&text);
+    size_t jsonCount=buddy_map_export(buddy,BUDDY_MAP_JSON,appendMap,&json);
+    vector<Run> expected=shadowRuns(used);
+    vector<Run> runs=textRuns(text);
+    if(runs!=expected || textCount!=runs.size() || jsonCount!=runs.size() || jsonRuns(json,arenaSize)!=runs)
+    {
+        printf("FAILED: map export of %s, %zu runs expected, %zu text %zu json\n",
+               what,expected.size(),textCount,jsonCount);
+        errors++;
+    }
+}
+
+/**
+ * Allocate and free blocks of random sizes, also not powers of two, keeping a
+ * shadow model of the used bytes, and check buddy_map_export against it
+ */
+static void checkMapExport(unsigned char *arena)
+{
+    vector<size_t> metadata=metadataFor(arenaSize);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,arenaSize,alignment);
+    vector<bool> used(arenaSize/alignment,false);
+    checkMapAgainst(buddy,used,"an empty buddy");
+
+    //The shadow marks the whole block, rounded up to a power of two
+    struct Block { void *ptr; size_t size; };
+    vector<Block> live;
+    auto mark=[&](const Block& block, bool state) {
+        size_t first=(static_cast<unsigned char*>(block.ptr)-arena)/alignment;
+        fill(used.begin()+first,used.begin()+first+block.size/alignment,state);
+    };
+    unsigned int state=0x2545f491;
+    for(int round=0;round<4;round++)
+    {
+        for(int i=0;i<3000;i++)
+        {
+            size_t requested=1+xorshift(state) % (alignment<<7);
+            void *p=buddy_malloc(buddy,requested);
+            if(p==nullptr) continue;
+            size_t size=alignment;
+            while(size<requested) size*=2;
+            live.push_back({p,size});
+            mark(live.back(),true);
+        }
+        for(size_t i=0;i<live.size();)
+        {
+            if(xorshift(state) % 2==0)
+            {
+                buddy_dealloc(buddy,live[i].ptr);
+                mark(live[i],false);
+                live[i]=live.back();
+                live.pop_back();
+            } else i++;
+        }
+        checkMapAgainst(buddy,used,"a fragmented buddy");
+    }
+
+    //Filling the buddy leaves a single used run
+    vector<void*> filler;
+    for(void *p;(p=buddy_malloc(buddy,alignment))!=nullptr;)
+    {
+        filler.push_back(p);
+        mark({p,alignment},true);
+    }
+    check(find(used.begin(),used.end(),false)==used.end(),"full buddy has free blocks");
+    checkMapAgainst(buddy,used,"a full buddy");
+    for(void *p : filler) buddy_dealloc(buddy,p);
+}
+
+/**
+ * \return true if two buddies have the same allocation map, statistics and
+ * free block counts
+ */
+static bool sameState(struct buddy *a, struct buddy *b)
+{
+    struct buddy_stats sa, sb;
+    buddy_stats(a,&sa);
+    buddy_stats(b,&sb);
+    if(sa.total_bytes!=sb.total_bytes || sa.free_bytes!=sb.free_bytes
+       || sa.largest_free_block!=sb.largest_free_block || sa.allocated_blocks!=sb.allocated_blocks
+       || sa.fragmentation!=sb.fragmentation
+       || !equal(begin(sa.allocated_blocks_per_order),end(sa.allocated_blocks_per_order),
+                 begin(sb.allocated_blocks_per_order))) return false;
+    for(size_t order=0;(alignment<<order)<=sa.total_bytes;order++)
+        if(buddy_free_blocks(a,order)!=buddy_free_blocks(b,order)) return false;
+    return mapOf(a)==mapOf(b);
+}
+
+/**
+ * Run the same random sequence of mallocs, deallocs, reallocs and policy
+ * changes on two buddies and check they return the same offsets and end up in
+ * the same state, every few hundred operations
+ */
+static void checkSameBehavior(struct buddy *a, struct buddy *b, const char *what)
+{
+    unsigned char *mainA=buddy_arena(a), *mainB=buddy_arena(b);
+    vector<size_t> live; //Offsets, the same for both buddies
+    unsigned int state=0x9e3779b9;
+    bool same=sameState(a,b);
+    for(int i=0;i<20000 && same;i++)
+    {
+        unsigned int op=xorshift(state) % 16;
+        size_t size=1+xorshift(state) % (alignment<<(xorshift(state) % 8));
+        if(op<8 || live.empty())
+        {
+            unsigned char *p=static_cast<unsigned char*>(buddy_malloc(a,size));
+            unsigned char *q=static_cast<unsigned char*>(buddy_malloc(b,size));
+            same=(p==nullptr)==(q==nullptr) && (p==nullptr || p-mainA==q-mainB);
+            if(p && same) live.push_back(p-mainA);
+        } else if(op<13) {
+            size_t j=xorshift(state) % live.size();
+            buddy_dealloc(a,mainA+live[j]);
+            buddy_dealloc(b,mainB+live[j]);
+            live[j]=live.back();
+            live.pop_back();
+        } else if(op<15) {
+            size_t j=xorshift(state) % live.size();
+            enum buddy_realloc_outcome oa, ob;
+            unsigned char *p=static_cast<unsigned char*>(buddy_realloc_report(a,mainA+live[j],size,&oa));
+            unsigned char *q=static_cast<unsigned char*>(buddy_realloc_report(b,mainB+live[j],size,&ob));
+            same=oa==ob && (p==nullptr)==(q==nullptr) && (p==nullptr || p-mainA==q-mainB);
+            if(p && same) live[j]=p-mainA;
+        } else {
+            enum buddy_policy policy=static_cast<enum buddy_policy>(xorshift(state) % 4);
+            buddy_set_policy(a,policy,alignment<<4);
+            buddy_set_policy(b,policy,alignment<<4);
+        }
+        if(same && i % 500==0) same=sameState(a,b);
+    }
+    if(same) same=sameState(a,b);
+    if(!same)
+    {
+        printf("FAILED: lazy and eager %s behave differently\n",what);
+        errors++;
+    }
+}
+
+/**
+ * Check that buddies initialized lazily on zeroed memory behave the same as
+ * buddies initialized eagerly on memory full of garbage
+ */
+static void checkLazy(unsigned char *arena)
+{
+    //Both standard buddies share the arena, they only hand out offsets into it
+    vector<size_t> eagerMetadata=metadataFor(arenaSize);
+    memset(eagerMetadata.data(),0xa5,eagerMetadata.size()*sizeof(size_t));
+    struct buddy *eager=buddy_init_alignment(reinterpret_cast<unsigned char*>(eagerMetadata.data()),
+                                             arena,arenaSize,alignment);
+    size_t metadataSize=buddy_sizeof_alignment(arenaSize,alignment);
+    void *zeroed=mmap(nullptr,metadataSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    check(zeroed!=MAP_FAILED,"zeroed metadata not mapped");
+    if(zeroed==MAP_FAILED) return;
+    struct buddy *lazy=buddy_init_lazy(static_cast<unsigned char*>(zeroed),arena,arenaSize,alignment);
+    check(eager!=nullptr && lazy!=nullptr,"standard buddies not created");
+    if(eager && lazy) checkSameBehavior(eager,lazy,"standard buddies");
+    munmap(zeroed,metadataSize);
+
+    //Embedded buddies keep the metadata in their own arena
+    memset(arena,0xa5,arenaSize);
+    eager=buddy_embed_alignment(arena,arenaSize,alignment);
+    zeroed=mmap(nullptr,arenaSize,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    check(zeroed!=MAP_FAILED,"zeroed arena not mapped");
+    if(zeroed==MAP_FAILED) return;
+    lazy=buddy_embed_lazy(static_cast<unsigned char*>(zeroed),arenaSize,alignment);
+    check(eager!=nullptr && lazy!=nullptr,"embedded buddies not created");
+    if(eager && lazy) checkSameBehavior(eager,lazy,"embedded buddies");
+    munmap(zeroed,arenaSize);
+}
+
+/**
+ * \return the contents of a file, empty if it cannot be read
+ */
+static vector<size_t> readFile(const char *path, size_t& size)
+{
+    vector<size_t> result;
+    size=0;
+    FILE *f=fopen(path,"rb");
+    if(f==nullptr) return result;
+    fseek(f,0,SEEK_END);
+    size=ftell(f);
+    fseek(f,0,SEEK_SET);
+    result.resize(size/sizeof(size_t)+1);
+    if(fread(result.data(),1,size,f)!=size) size=0;
+    fclose(f);
+    return result;
+}
+
+/**
+ * Save, verify and load snapshots in memory and through files, including
+ * corrupt and truncated ones
+ */
+static void checkSnapshots(unsigned char *arena)
+{
+    vector<size_t> metadata=metadataFor(arenaSize);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,arenaSize,alignment);
+    vector<void*> live=fragment(buddy,0x2545f491,2000);
+    string map=mapOf(buddy);
+
+    //In memory, the copy has the same state and can be used in place
+    size_t size=buddy_snapshot_size(buddy);
+    vector<size_t> snapshot(size/sizeof(size_t)+1);
+    unsigned char *bytes=reinterpret_cast<unsigned char*>(snapshot.data());
+    check(buddy_snapshot_save(buddy,bytes,size-1)==0,"snapshot saved to a short buffer");
+    check(buddy_snapshot_save(buddy,bytes,size)==size,"snapshot not saved");
+    check(buddy_snapshot_verify(bytes,size)==size,"saved snapshot does not verify");
+    check(buddy_snapshot_verify(bytes,size-1)==0,"truncated snapshot verifies");
+    check(buddy_snapshot_load(bytes,size-1,arena)==nullptr,"truncated snapshot loaded");
+    vector<size_t> copy=snapshot;
+    unsigned char *copyBytes=reinterpret_cast<unsigned char*>(copy.data());
+    struct buddy *loaded=buddy_snapshot_load(copyBytes,size,arena);
+    check(loaded!=nullptr,"snapshot not loaded");
+    if(loaded)
+    {
+        check(mapOf(loaded)==map,"loaded snapshot has a different allocation map");
+        vector<void*> copyLive=live;
+        check(releaseAll(loaded,copyLive),"loaded snapshot does not free its blocks");
+        //Sealing the used copy makes it verifiable again, with its new state
+        check(buddy_snapshot_verify(copyBytes,size)==0,"used snapshot still verifies before sync");
+        check(buddy_snapshot_sync(copyBytes,size)==size,"snapshot not synced");
+        check(buddy_snapshot_verify(copyBytes,size)==size,"synced snapshot does not verify");
+        loaded=buddy_snapshot_load(copyBytes,size,arena);
+        check(loaded && isEmpty(loaded),"synced snapshot lost its state");
+    }
+
+    //Corruption of the metadata is found by verify, of the header also by load
+    copy=snapshot;
+    copyBytes[size/2]^=0x10;
+    check(buddy_snapshot_verify(copyBytes,size)==0,"corrupt metadata verifies");
+    copy=snapshot;
+    copyBytes[0]^=0x10;
+    check(buddy_snapshot_load(copyBytes,size,arena)==nullptr,"snapshot with a corrupt magic loaded");
+    copy=snapshot;
+    copyBytes[sizeof(uint32_t)*4]^=0x10; //metadata_size
+    check(buddy_snapshot_load(copyBytes,size,arena)==nullptr,"snapshot with a corrupt header loaded");
+
+    //An embedded buddy is loaded as a standard one
+    vector<size_t> embedArena(arenaSize/sizeof(size_t));
+    unsigned char *embedMain=reinterpret_cast<unsigned char*>(embedArena.data());
+    struct buddy *embedded=buddy_embed_alignment(embedMain,arenaSize,alignment);
+    check(embedded!=nullptr,"embedded buddy not created");
+    if(embedded)
+    {
+        vector<void*> embedLive=fragment(embedded,0x9e3779b9,500);
+        string embedMap=mapOf(embedded);
+        size_t embedSize=buddy_snapshot_size(embedded);
+        vector<size_t> embedSnapshot(embedSize/sizeof(size_t)+1);
+        unsigned char *embedBytes=reinterpret_cast<unsigned char*>(embedSnapshot.data());
+        buddy_snapshot_save(embedded,embedBytes,embedSize);
+        struct buddy *embedLoaded=buddy_snapshot_load(embedBytes,embedSize,embedMain);
+        check(embedLoaded && mapOf(embedLoaded)==embedMap,"embedded snapshot has a different allocation map");
+        check(embedLoaded && buddy_arena(embedLoaded)==embedMain,"embedded snapshot bound to the wrong arena");
+        check(buddy_snapshot_sync(embedBytes,embedSize)==embedSize,"embedded snapshot not synced");
+        //The binding is restored as saved, so an unused snapshot is unchanged
+        vector<size_t> resaved(embedSize/sizeof(size_t)+1);
+        buddy_snapshot_save(embedded,reinterpret_cast<unsigned char*>(resaved.data()),embedSize);
+        check(memcmp(resaved.data(),embedBytes,embedSize)==0,"sync did not restore the embedded binding");
+    }
+
+    //Files, a private mapping leaves the file untouched, a shared one keeps
+    //the state and stays verifiable
+    char path[]="/tmp/buddy_snapshot_XXXXXX";
+    int fd=mkstemp(path);
+    check(fd>=0,"temporary file not created");
+    if(fd<0) return;
+    close(fd);
+    check(buddy_snapshot_write_file(buddy,path)==size,"snapshot file not written");
+    struct buddy_snapshot_mapping mapping;
+    for(int shared=0;shared<2;shared++)
+    {
+        struct buddy *mapped=buddy_snapshot_map_file(path,arena,shared,&mapping);
+        check(mapped && mapOf(mapped)==map,"mapped snapshot has a different allocation map");
+        vector<void*> mappedLive=live;
+        check(mapped && releaseAll(mapped,mappedLive),"mapped snapshot does not free its blocks");
+        buddy_snapshot_unmap_file(&mapping);
+        size_t fileSize;
+        vector<size_t> file=readFile(path,fileSize);
+        const unsigned char *fileBytes=reinterpret_cast<const unsigned char*>(file.data());
+        check(fileSize==size && buddy_snapshot_verify(fileBytes,fileSize)==size,
+              "snapshot file does not verify after unmapping");
+        mapped=buddy_snapshot_map_file(path,arena,0,&mapping);
+        check(mapped && (mapOf(mapped)==map)==(shared==0),"snapshot file has the wrong state");
+        buddy_snapshot_unmap_file(&mapping);
+    }
+    check(buddy_snapshot_map_file("/nonexistent/buddy",arena,0,&mapping)==nullptr,"missing file mapped");
+    unlink(path);
+}
+
+int main()
+{
+    vector<size_t> arenaMemory(arenaSize/sizeof(size_t)+1);
+    unsigned char *arena=reinterpret_cast<unsigned char*>(arenaMemory.data());
+    checkRealloc(arena);
+    checkDefrag(arena);
+    checkResize(arena);
+    checkMapExport(arena);
+    checkLazy(arena);
+    checkSnapshots(arena);
+    printf("%u failed checks\n",errors);
+    return errors ? 1 : 0;
+}
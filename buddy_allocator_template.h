@@ -0,0 +1,368 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <climits>
+
+namespace buddy_detail {
+
+/**
+ * \return the position of the highest set bit, counting from one, or zero
+ */
+constexpr size_t highestBit(size_t value)
+{
+    return value ? 1+highestBit(value>>1) : 0;
+}
+
+/**
+ * \return the smallest power of two not less than value
+ */
+constexpr size_t ceilPow2(size_t value)
+{
+    return value<=1 ? 1 : static_cast<size_t>(1)<<highestBit(value-1);
+}
+
+/**
+ * Closed form of size_for_order() in buddy_allocator.cpp
+ * \param order order of the tree
+ * \param depth depth of a row of nodes, the root is at depth one
+ * \return number of bitset bits used by the nodes above depth
+ */
+constexpr size_t bitsBeforeDepth(size_t order, size_t depth)
+{
+    return (order-depth+3)*(static_cast<size_t>(1)<<(depth-1))-order-2;
+}
+
+} //namespace buddy_detail
+
+/**
+ * Buddy allocator for an arena whose size and alignment are known at compile
+ * time. It uses the same tree as the allocator in buddy_allocator.h, but the
+ * tree order, the bitset offset of each depth and the metadata size are
+ * constants, so the metadata is a member array and an instance can be
+ * statically allocated. The C API remains the allocator for arenas sized at
+ * runtime.
+ * \param ArenaSize size of the arena in bytes, trimmed down to a multiple of
+ * Alignment
+ * \param Alignment size of the smallest block, must be a power of two
+ */
+template<size_t ArenaSize, size_t Alignment>
+class BuddyAllocator
+{
+public:
+    static_assert(Alignment>0 && (Alignment & (Alignment-1))==0,
+        "Alignment must be a power of two");
+    static_assert(ArenaSize>=Alignment, "Arena smaller than alignment");
+
+    ///Size of the arena that can be allocated
+    static constexpr size_t memorySize=ArenaSize-ArenaSize % Alignment;
+    ///Number of levels of the tree
+    static constexpr size_t order=
+        buddy_detail::highestBit(buddy_detail::ceilPow2(memorySize/Alignment));
+    ///Size of the node status bitset, including one word of padding
+    static constexpr size_t metadataSize=
+        (buddy_detail::bitsBeforeDepth(order,order+1)+2*sizeof(size_t)*CHAR_BIT-1)
+        /(sizeof(size_t)*CHAR_BIT)*sizeof(size_t);
+
+    /**
+     * Constructor
+     * \param arena start of the arena, never accessed by the allocator
+     */
+    explicit BuddyAllocator(unsigned char *arena) : arena(arena)
+    {
+        memset(bits,0,sizeof(bits));
+        maskVirtualSlots();
+    }
+
+    /**
+     * \param size size in bytes
+     * \return a block of at least size bytes, or NULL if out of memory
+     */
+    void *malloc(size_t size)
+    {
+        if(size==0) size=1;
+        if(size>memorySize) return NULL;
+        Pos pos=findFree(depthForSize(size));
+        if(!valid(pos)) return NULL;
+        mark(pos);
+        return addressFor(pos);
+    }
+
+    /**
+     * \param ptr block to deallocate, pointers not returned by malloc() are
+     * ignored
+     */
+    void dealloc(void *ptr)
+    {
+        if(ptr==NULL) return;
+        Pos pos=positionFor(static_cast<unsigned char*>(ptr));
+        if(valid(pos)) release(pos);
+    }
+
+    /**
+     * Same semantics as buddy_realloc(), blocks are resized in place when
+     * possible and data is not copied
+     * \param ptr block to reallocate, NULL to allocate a new one
+     * \param size new size in bytes, zero to deallocate the block
+     * \return the reallocated block, or NULL if out of memory, in which case
+     * the block is preserved
+     */
+    void *realloc(void *ptr, size_t size)
+    {
+        if(ptr==NULL) return malloc(size);
+        if(size==0)
+        {
+            dealloc(ptr);
+            return NULL;
+        }
+        if(size>memorySize) return NULL;
+        Pos origin=positionFor(static_cast<unsigned char*>(ptr));
+        if(!valid(origin)) return NULL;
+        size_t targetDepth=depthForSize(size);
+        if(resizeInPlace(origin,targetDepth)) return ptr;
+        release(origin);
+        Pos pos=findFree(targetDepth);
+        if(!valid(pos))
+        {
+            mark(origin); //Out of memory, restore the block
+            return NULL;
+        }
+        mark(pos);
+        return addressFor(pos);
+    }
+
+private:
+    BuddyAllocator(const BuddyAllocator&);
+    BuddyAllocator& operator= (const BuddyAllocator&);
+
+    static constexpr size_t wordBits=sizeof(size_t)*CHAR_BIT;
+    static constexpr size_t effectiveSize=Alignment<<(order-1);
+
+    /**
+     * Position of a node, the root has index and depth one, the children of
+     * index n have index 2n and 2n+1
+     */
+    struct Pos
+    {
+        size_t index;
+        size_t depth;
+    };
+
+    static Pos root() { return Pos{1,1}; }
+    static Pos invalid() { return Pos{0,0}; }
+    static Pos parent(Pos p) { return Pos{p.index/2,p.depth-1}; }
+    static Pos leftChild(Pos p) { return Pos{p.index*2,p.depth+1}; }
+    static Pos sibling(Pos p) { return Pos{p.index^1,p.depth}; }
+    static bool valid(Pos p) { return p.index && p.index<(static_cast<size_t>(1)<<order); }
+    static size_t rowStart(size_t depth) { return static_cast<size_t>(1)<<(depth-1); }
+
+    /**
+     * \return number of bits of a node at depth, which is also its status
+     * when it is allocated
+     */
+    static size_t width(size_t depth) { return order-depth+1; }
+
+    /**
+     * \return position of the first status bit of a node
+     */
+    static size_t location(Pos p)
+    {
+        return buddy_detail::bitsBeforeDepth(order,p.depth)+width(p.depth)*(p.index-rowStart(p.depth));
+    }
+
+    /**
+     * \return the status of a node, zero if free, width(depth) if allocated
+     */
+    size_t status(Pos p) const
+    {
+        size_t loc=location(p);
+        size_t word=loc/wordBits, shift=loc % wordBits;
+        size_t value=bits[word]>>shift;
+        if(shift) value|=bits[word+1]<<(wordBits-shift);
+        //Status is unary, count the trailing ones
+        value=~value;
+        size_t ones=value ? __builtin_ctzll(value) : wordBits;
+        size_t w=width(p.depth);
+        return ones<w ? ones : w;
+    }
+
+    /**
+     * Set the status of a node
+     */
+    void write(Pos p, size_t value)
+    {
+        size_t loc=location(p), w=width(p.depth);
+        size_t word=loc/wordBits, shift=loc % wordBits;
+        size_t mask=w>=wordBits ? ~static_cast<size_t>(0) : (static_cast<size_t>(1)<<w)-1;
+        size_t ones=value>=wordBits ? ~static_cast<size_t>(0) : (static_cast<size_t>(1)<<value)-1;
+        bits[word]=(bits[word] & ~(mask<<shift)) | (ones<<shift);
+        if(shift && shift+w>wordBits)
+        {
+            bits[word+1]=(bits[word+1] & ~(mask>>(wordBits-shift))) | (ones>>(wordBits-shift));
+        }
+    }
+
+    /**
+     * Recompute the status of the ancestors of a node after it changed
+     */
+    void updateParentChain(Pos p, size_t current)
+    {
+        while(p.index!=1)
+        {
+            size_t sib=status(sibling(p));
+            p=parent(p);
+            size_t target=(current || sib)*((current<=sib ? current : sib)+1);
+            if(target==status(p)) return;
+            write(p,target);
+            current=target;
+        }
+    }
+
+    void mark(Pos p)
+    {
+        write(p,width(p.depth));
+        updateParentChain(p,width(p.depth));
+    }
+
+    void release(Pos p)
+    {
+        if(status(p)!=width(p.depth)) return; //Partially used
+        write(p,0);
+        updateParentChain(p,0);
+    }
+
+    /**
+     * \return the free position at targetDepth chosen by buddy_tree_find_free()
+     */
+    Pos findFree(size_t targetDepth) const
+    {
+        Pos current=root();
+        size_t targetStatus=targetDepth-1;
+        if(status(current)>targetStatus) return invalid();
+        while(current.depth!=targetDepth)
+        {
+            targetStatus--;
+            Pos left=leftChild(current);
+            Pos right=sibling(left);
+            size_t leftStatus=status(left);
+            size_t rightStatus=status(right);
+            if(leftStatus>targetStatus) current=right;
+            else if(rightStatus>targetStatus) current=left;
+            else if(rightStatus && leftStatus<rightStatus) current=right;
+            else current=left; //Prefer the busier or the left branch
+        }
+        return current;
+    }
+
+    /**
+     * Move the mark of an allocated node to the ancestor or leftmost
+     * descendant at targetDepth, which start at the same address
+     * \return false if the node cannot grow in place
+     */
+    bool resizeInPlace(Pos p, size_t targetDepth)
+    {
+        Pos target=p;
+        if(targetDepth>p.depth)
+        {
+            while(target.depth!=targetDepth) target=leftChild(target);
+        } else {
+            while(target.depth!=targetDepth)
+            {
+                if((target.index & 1) || status(sibling(target))) return false;
+                target=parent(target);
+            }
+        }
+        if(target.index!=p.index)
+        {
+            release(p);
+            mark(target);
+        }
+        return true;
+    }
+
+    static size_t depthForSize(size_t size)
+    {
+        if(size<Alignment) size=Alignment;
+        size_t depth=1;
+        for(size_t s=effectiveSize;(s/size)>>1;s>>=1) depth++;
+        return depth;
+    }
+
+    unsigned char *addressFor(Pos p) const
+    {
+        return arena+(effectiveSize>>(p.depth-1))*(p.index-rowStart(p.depth));
+    }
+
+    /**
+     * \return the allocated node starting at addr, or an invalid one
+     */
+    Pos positionFor(unsigned char *addr) const
+    {
+        if(addr<arena || addr>=arena+memorySize) return invalid();
+        size_t offset=addr-arena;
+        if(offset % Alignment) return invalid();
+        Pos p=Pos{rowStart(order)+offset/Alignment,order};
+        while(status(p)==0)
+        {
+            p=parent(p);
+            if(!valid(p)) return invalid();
+        }
+        return addressFor(p)==addr ? p : invalid();
+    }
+
+    /**
+     * Mark as allocated the space between memorySize and the next power of two
+     */
+    void maskVirtualSlots()
+    {
+        size_t delta=effectiveSize-memorySize;
+        Pos p=sibling(leftChild(root()));
+        while(delta)
+        {
+            size_t size=effectiveSize>>(p.depth-1);
+            if(delta==size)
+            {
+                mark(p);
+                break;
+            }
+            if(delta<=size/2)
+            {
+                p=sibling(leftChild(p));
+            } else {
+                mark(sibling(leftChild(p)));
+                delta-=size/2;
+                p=leftChild(p);
+            }
+        }
+    }
+
+    unsigned char *arena; ///< Start of the arena
+    size_t bits[metadataSize/sizeof(size_t)]; ///< Node status, plus one word of padding
+};
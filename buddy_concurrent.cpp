@@ -0,0 +1,543 @@
+#include "buddy_concurrent.h"
+#include <atomic>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifndef BUDDY_PRINTF
+#define BUDDY_PRINTF printf
+#endif
+
+/*
+ * A lock-free binary buddy memory allocator
+ *
+ * Tree positions are numbered as in buddy_allocator.cpp, the root is 1 and
+ * the children of n are 2n and 2n+1. Each position has a 32 bit status word:
+ * the two upper bits tell whether the position is being allocated (reserved)
+ * or is allocated (busy), the remaining bits count the allocations done or in
+ * progress below the position.
+ *
+ * An allocation reserves a position with a compare-and-swap from zero, then
+ * walks up the parent chain incrementing the counters with compare-and-swap,
+ * and backs off if it meets a reserved or busy ancestor. A position can only
+ * be reserved while nothing below it is counted, and an ancestor that has been
+ * counted can no longer be reserved, so two overlapping allocations always
+ * meet on the status word of the upper one and at most one of them succeeds.
+ *
+ * Each position also has a summary byte, one more than the order of the
+ * largest free block below it (zero if there is none), so an allocation
+ * descends the tree to a free block as the sequential allocator does. The
+ * summaries are only a guide: every thread that changes a status word
+ * recomputes the summaries on the path to the root, with compare-and-swap,
+ * until each one matches its children. A stale summary sends an allocation
+ * to a block that fails to reserve, the allocation then refreshes the
+ * summaries on its path and from the position it met reserved or busy, and
+ * descends again, so it never waits for a preempted thread to finish.
+ */
+
+struct buddy_concurrent {
+    size_t memory_size;
+    size_t alignment;
+    unsigned char *main;
+    size_t order;
+    std::atomic<size_t> hint; /* last position allocated, followed on ties */
+};
+
+static const uint32_t STATUS_RESERVED = 1u << 31;
+static const uint32_t STATUS_BUSY = 1u << 30;
+static const uint32_t STATUS_FLAGS = STATUS_RESERVED | STATUS_BUSY;
+
+static size_t highest_bit_position(size_t value);
+static inline size_t ceiling_power_of_two(size_t value);
+static inline size_t two_to_the_power_of(size_t order);
+static inline std::atomic<uint32_t> *buddy_concurrent_status(struct buddy_concurrent *buddy);
+static inline std::atomic<uint8_t> *buddy_concurrent_summary(struct buddy_concurrent *buddy);
+static uint8_t buddy_concurrent_summary_for(struct buddy_concurrent *buddy, size_t index, size_t depth);
+static void buddy_concurrent_update(struct buddy_concurrent *buddy, size_t index);
+static size_t buddy_concurrent_order_for_memory(size_t memory_size, size_t alignment);
+static size_t depth_for_size(struct buddy_concurrent *buddy, size_t requested_size);
+static inline size_t size_for_depth(struct buddy_concurrent *buddy, size_t depth);
+static size_t position_for_address(struct buddy_concurrent *buddy, const unsigned char *addr);
+static unsigned char *address_for_position(struct buddy_concurrent *buddy, size_t index);
+static size_t buddy_concurrent_try(struct buddy_concurrent *buddy, size_t index);
+static void buddy_concurrent_release(struct buddy_concurrent *buddy, size_t index);
+static void buddy_concurrent_mark_virtual_slots(struct buddy_concurrent *buddy);
+static inline size_t integer_square_root(size_t op);
+
+size_t buddy_concurrent_sizeof(size_t memory_size, size_t alignment) {
+    if (ceiling_power_of_two(alignment) != alignment) {
+        return 0; /* invalid */
+    }
+    if (memory_size < alignment) {
+        return 0; /* invalid */
+    }
+    return sizeof(struct buddy_concurrent) + two_to_the_power_of(
+        buddy_concurrent_order_for_memory(memory_size, alignment))
+        * (sizeof(std::atomic<uint32_t>) + sizeof(std::atomic<uint8_t>));
+}
+
+struct buddy_concurrent *buddy_concurrent_init(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment) {
+    struct buddy_concurrent *buddy;
+    std::atomic<uint32_t> *status;
+    std::atomic<uint8_t> *summary;
+    size_t positions, depth;
+
+    if (at == NULL || main == NULL || at == main) {
+        return NULL;
+    }
+    if (((uintptr_t) at) % alignof(struct buddy_concurrent) != 0) {
+        return NULL;
+    }
+    /* Trim down memory to alignment */
+    if (alignment && (memory_size % alignment)) {
+        memory_size -= (memory_size % alignment);
+    }
+    if (buddy_concurrent_sizeof(memory_size, alignment) == 0) {
+        return NULL;
+    }
+
+    buddy = (struct buddy_concurrent *) at;
+    buddy->memory_size = memory_size;
+    buddy->alignment = alignment;
+    buddy->main = main;
+    buddy->order = buddy_concurrent_order_for_memory(memory_size, alignment);
+    new (&buddy->hint) std::atomic<size_t>(0);
+
+    status = buddy_concurrent_status(buddy);
+    summary = buddy_concurrent_summary(buddy);
+    positions = two_to_the_power_of(buddy->order);
+    new (&status[0]) std::atomic<uint32_t>(0);
+    new (&summary[0]) std::atomic<uint8_t>(0);
+    for (size_t i = 1; i < positions; i++) {
+        depth = highest_bit_position(i);
+        new (&status[i]) std::atomic<uint32_t>(0);
+        new (&summary[i]) std::atomic<uint8_t>((uint8_t) (buddy->order - depth + 1u));
+    }
+    buddy_concurrent_mark_virtual_slots(buddy);
+    return buddy;
+}
+
+struct buddy_concurrent *buddy_concurrent_embed(unsigned char *main, size_t memory_size, size_t alignment) {
+    size_t arena_size, buddy_size, offset;
+
+    if (main == NULL) {
+        return NULL;
+    }
+    /* Shrink the arena until the arena and the metadata after it fit */
+    arena_size = memory_size;
+    for (;;) {
+        buddy_size = buddy_concurrent_sizeof(arena_size, alignment);
+        if ((buddy_size == 0) || (buddy_size >= memory_size)) {
+            return NULL;
+        }
+        offset = memory_size - buddy_size;
+        offset -= offset % alignof(struct buddy_concurrent);
+        if (arena_size <= offset) {
+            break;
+        }
+        if (offset < alignment) {
+            return NULL;
+        }
+        arena_size = offset;
+    }
+    return buddy_concurrent_init(main + offset, main, arena_size, alignment);
+}
+
+void *buddy_concurrent_malloc(struct buddy_concurrent *buddy, size_t requested_size) {
+    std::atomic<uint8_t> *summary;
+    size_t depth, current, index, left, hint, hint_depth, conflict;
+    uint8_t wanted, left_summary, right_summary;
+    bool go_right;
+
+    if (buddy == NULL) {
+        return NULL;
+    }
+    if (requested_size == 0) {
+        requested_size = 1;
+    }
+    if (requested_size > buddy->memory_size) {
+        return NULL;
+    }
+
+    summary = buddy_concurrent_summary(buddy);
+    depth = depth_for_size(buddy, requested_size);
+    wanted = (uint8_t) (buddy->order - depth + 1u);
+
+    /*
+     * Descend to a free block of the target depth, choosing the busier child
+     * when both fit and the one towards the last allocation on ties. A
+     * reservation that is about to back off may make a racing allocation see
+     * the tree as full when it is nearly so.
+     */
+    while (summary[1].load() >= wanted) {
+        hint = buddy->hint.load(std::memory_order_relaxed);
+        hint_depth = highest_bit_position(hint);
+        index = 1;
+        for (current = 1; current < depth; current++) {
+            left = 2 * index;
+            left_summary = summary[left].load();
+            right_summary = summary[left + 1u].load();
+            if (left_summary < wanted) {
+                go_right = right_summary >= wanted;
+            } else if (right_summary < wanted) {
+                go_right = false;
+            } else if (left_summary != right_summary) {
+                go_right = right_summary < left_summary;
+            } else {
+                go_right = (hint_depth > current) && ((hint >> (hint_depth - current - 1u)) == left + 1u);
+            }
+            if (go_right) {
+                index = left + 1u;
+            } else if (left_summary >= wanted) {
+                index = left;
+            } else {
+                break; /* stale summary */
+            }
+        }
+        conflict = current == depth ? buddy_concurrent_try(buddy, index) : 0;
+        if ((current == depth) && (conflict == 0)) {
+            buddy_concurrent_update(buddy, index);
+            buddy->hint.store(index, std::memory_order_relaxed);
+            return address_for_position(buddy, index);
+        }
+        /*
+         * Refresh the summaries that led here before descending again. The
+         * walk from index stops at the first summary that is already right,
+         * so an ancestor reserved or busy is refreshed explicitly, otherwise a
+         * thread preempted while holding it would send every allocation down
+         * the same path until it runs again.
+         */
+        buddy_concurrent_update(buddy, index);
+        if (conflict && (conflict != index)) {
+            buddy_concurrent_update(buddy, conflict);
+        }
+    }
+    return NULL;
+}
+
+void buddy_concurrent_dealloc(struct buddy_concurrent *buddy, void *ptr) {
+    size_t index;
+
+    if (buddy == NULL || ptr == NULL) {
+        return;
+    }
+    index = position_for_address(buddy, (const unsigned char *) ptr);
+    if (index == 0) {
+        return;
+    }
+    buddy_concurrent_release(buddy, index);
+}
+
+void *buddy_concurrent_realloc(struct buddy_concurrent *buddy, void *ptr, size_t requested_size) {
+    size_t index;
+    void *destination;
+
+    if (ptr == NULL) {
+        return buddy_concurrent_malloc(buddy, requested_size);
+    }
+    if (requested_size == 0) {
+        buddy_concurrent_dealloc(buddy, ptr);
+        return NULL;
+    }
+    if (requested_size > buddy->memory_size) {
+        return NULL;
+    }
+    index = position_for_address(buddy, (const unsigned char *) ptr);
+    if (index == 0) {
+        return NULL;
+    }
+    if (highest_bit_position(index) == depth_for_size(buddy, requested_size)) {
+        return ptr; /* Same block size */
+    }
+    /* Allocate first, so that the old block is kept on failure */
+    destination = buddy_concurrent_malloc(buddy, requested_size);
+    if (destination == NULL) {
+        return NULL;
+    }
+    buddy_concurrent_release(buddy, index);
+    return destination;
+}
+
+void buddy_concurrent_debug(struct buddy_concurrent *buddy) {
+    std::atomic<uint32_t> *status = buddy_concurrent_status(buddy);
+    size_t positions = two_to_the_power_of(buddy->order);
+
+    BUDDY_PRINTF("lock-free buddy allocator at: %p arena at: %p\n", (void *)buddy, (void *)buddy->main);
+    BUDDY_PRINTF("memory size: %zu\n", buddy->memory_size);
+    BUDDY_PRINTF("allocated blocks follow:\n");
+    for (size_t i = 1; i < positions; i++) {
+        if ((status[i].load(std::memory_order_relaxed) & STATUS_BUSY)
+                && (address_for_position(buddy, i) < buddy->main + buddy->memory_size)) {
+            BUDDY_PRINTF("size: %zu, address: %p\n",
+                size_for_depth(buddy, highest_bit_position(i)), (void *)address_for_position(buddy, i));
+        }
+    }
+}
+
+void buddy_concurrent_stats(struct buddy_concurrent *buddy, struct buddy_stats *stats) {
+    const unsigned char fractional_bits = 8;
+    const unsigned char fractional_mask = 255;
+    std::atomic<uint32_t> *status = buddy_concurrent_status(buddy);
+    size_t positions = two_to_the_power_of(buddy->order);
+    size_t quality = 0, total_free_size = 0, quality_percent;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->total_bytes = buddy->memory_size;
+    stats->free_bytes = buddy->memory_size;
+    for (size_t i = 1; i < positions; i++) {
+        uint32_t value = status[i].load(std::memory_order_relaxed);
+        size_t depth = highest_bit_position(i);
+        if (value & STATUS_BUSY) {
+            if (address_for_position(buddy, i) >= buddy->main + buddy->memory_size) {
+                continue; /* virtual slot */
+            }
+            stats->free_bytes -= size_for_depth(buddy, depth);
+            stats->allocated_blocks++;
+            stats->allocated_blocks_per_order[buddy->order - depth]++;
+        } else if (value == 0) {
+            /* A free block is maximal if its parent has something allocated below it */
+            uint32_t parent = i == 1 ? 1u : status[i / 2].load(std::memory_order_relaxed);
+            if ((parent & STATUS_FLAGS) || (parent == 0)) {
+                continue;
+            }
+            size_t virtual_size = two_to_the_power_of(buddy->order - depth);
+            quality += virtual_size * virtual_size;
+            total_free_size += virtual_size;
+            if (size_for_depth(buddy, depth) > stats->largest_free_block) {
+                stats->largest_free_block = size_for_depth(buddy, depth);
+            }
+        }
+    }
+
+    /* Same metric as the sequential allocator */
+    if ((status[1].load(std::memory_order_relaxed) == 0) || (total_free_size == 0)) {
+        return;
+    }
+    quality_percent = (integer_square_root(quality) << fractional_bits) / total_free_size;
+    quality_percent *= quality_percent;
+    quality_percent >>= fractional_bits;
+    stats->fragmentation = fractional_mask - (quality_percent & fractional_mask);
+}
+
+static inline std::atomic<uint32_t> *buddy_concurrent_status(struct buddy_concurrent *buddy) {
+    return reinterpret_cast<std::atomic<uint32_t> *>(buddy + 1);
+}
+
+static inline std::atomic<uint8_t> *buddy_concurrent_summary(struct buddy_concurrent *buddy) {
+    return reinterpret_cast<std::atomic<uint8_t> *>(buddy_concurrent_status(buddy) + two_to_the_power_of(buddy->order));
+}
+
+static size_t buddy_concurrent_order_for_memory(size_t memory_size, size_t alignment) {
+    size_t blocks = memory_size / alignment;
+    return highest_bit_position(ceiling_power_of_two(blocks));
+}
+
+static size_t depth_for_size(struct buddy_concurrent *buddy, size_t requested_size) {
+    size_t depth, block_size;
+    if (requested_size < buddy->alignment) {
+        requested_size = buddy->alignment;
+    }
+    depth = buddy->order;
+    block_size = buddy->alignment;
+    while (block_size < requested_size) {
+        depth--;
+        block_size <<= 1u;
+    }
+    return depth;
+}
+
+static inline size_t size_for_depth(struct buddy_concurrent *buddy, size_t depth) {
+    return buddy->alignment << (buddy->order - depth);
+}
+
+static unsigned char *address_for_position(struct buddy_concurrent *buddy, size_t index) {
+    size_t depth = highest_bit_position(index);
+    size_t local_index = index & ~two_to_the_power_of(depth - 1u);
+    return buddy->main + local_index * size_for_depth(buddy, depth);
+}
+
+/* Returns the busy position tracking the address, zero if there is none */
+static size_t position_for_address(struct buddy_concurrent *buddy, const unsigned char *addr) {
+    std::atomic<uint32_t> *status = buddy_concurrent_status(buddy);
+    size_t offset, index;
+
+    if ((addr < buddy->main) || (addr >= buddy->main + buddy->memory_size)) {
+        return 0;
+    }
+    offset = (size_t) (addr - buddy->main);
+    if (offset % buddy->alignment) {
+        return 0; /* invalid alignment */
+    }
+    /* Walk up from the leaf, positions being reserved are not ours */
+    index = two_to_the_power_of(buddy->order - 1u) + offset / buddy->alignment;
+    while (index && ! (status[index].load(std::memory_order_acquire) & STATUS_BUSY)) {
+        index /= 2;
+    }
+    if ((index == 0) || (address_for_position(buddy, index) != addr)) {
+        return 0;
+    }
+    return index;
+}
+
+/* Returns zero if the position was allocated, otherwise the position that prevented it */
+static size_t buddy_concurrent_try(struct buddy_concurrent *buddy, size_t index) {
+    std::atomic<uint32_t> *status = buddy_concurrent_status(buddy);
+    uint32_t expected = 0;
+    size_t parent, conflict = 0;
+
+    if (! status[index].compare_exchange_strong(expected, STATUS_RESERVED, std::memory_order_acq_rel)) {
+        return index;
+    }
+    for (parent = index / 2; parent; parent /= 2) {
+        uint32_t value = status[parent].load(std::memory_order_relaxed);
+        do {
+            if (value & STATUS_FLAGS) {
+                break;
+            }
+        } while (! status[parent].compare_exchange_weak(value, value + 1u, std::memory_order_acq_rel));
+        if (value & STATUS_FLAGS) {
+            conflict = parent;
+            break;
+        }
+    }
+    if (conflict) {
+        /* Back off, undoing the counters incremented so far */
+        for (parent = index / 2; parent != conflict; parent /= 2) {
+            status[parent].fetch_sub(1u, std::memory_order_release);
+        }
+        status[index].store(0, std::memory_order_release);
+        return conflict;
+    }
+    status[index].store(STATUS_BUSY, std::memory_order_release);
+    return 0;
+}
+
+/*
+ * Recomputes the summaries from the specified position towards the root. Each
+ * summary is written with compare-and-swap and then checked again against its
+ * inputs, so a thread that wrote a value computed from stale inputs corrects
+ * it. The walk stops at the first summary that is already right: a thread
+ * that writes a summary always goes on to its parent, and a counter change
+ * above can only matter if it went to or from zero, which also changed every
+ * summary below it. Once the status words stop changing every summary is exact.
+ */
+static void buddy_concurrent_update(struct buddy_concurrent *buddy, size_t index) {
+    std::atomic<uint8_t> *summary = buddy_concurrent_summary(buddy);
+    size_t depth = highest_bit_position(index);
+    uint8_t current, computed;
+    bool written = true;
+
+    /* Order the status change of the caller before reading the summaries */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (; index && written; index /= 2, depth--) {
+        current = summary[index].load();
+        written = false;
+        for (;;) {
+            computed = buddy_concurrent_summary_for(buddy, index, depth);
+            if (computed == current) {
+                break;
+            }
+            if (summary[index].compare_exchange_weak(current, computed)) {
+                current = computed;
+                written = true;
+            }
+        }
+    }
+}
+
+/* Returns the summary of a position computed from its status and its children */
+static uint8_t buddy_concurrent_summary_for(struct buddy_concurrent *buddy, size_t index, size_t depth) {
+    std::atomic<uint8_t> *summary = buddy_concurrent_summary(buddy);
+    uint32_t value = buddy_concurrent_status(buddy)[index].load();
+    uint8_t left, right;
+
+    if (value & STATUS_FLAGS) {
+        return 0;
+    }
+    if (value == 0) {
+        return (uint8_t) (buddy->order - depth + 1u); /* nothing counted below, the block is free */
+    }
+    left = summary[2 * index].load();
+    right = summary[2 * index + 1u].load();
+    return left > right ? left : right;
+}
+
+static void buddy_concurrent_release(struct buddy_concurrent *buddy, size_t index) {
+    std::atomic<uint32_t> *status = buddy_concurrent_status(buddy);
+
+    /*
+     * Clear the position before the counters, so that a larger block can
+     * never be allocated while this one still looks busy
+     */
+    status[index].store(0, std::memory_order_release);
+    for (size_t parent = index / 2; parent; parent /= 2) {
+        status[parent].fetch_sub(1u, std::memory_order_release);
+    }
+    buddy_concurrent_update(buddy, index);
+}
+
+static void buddy_concurrent_mark_virtual_slots(struct buddy_concurrent *buddy) {
+    size_t delta, index, current_size;
+
+    /* Mask the virtual space if memory is not a power of two */
+    delta = size_for_depth(buddy, 1) - buddy->memory_size;
+    index = 3; /* right child of the root */
+    while (delta) {
+        current_size = size_for_depth(buddy, highest_bit_position(index));
+        if (delta == current_size) {
+            buddy_concurrent_try(buddy, index);
+            buddy_concurrent_update(buddy, index);
+            break;
+        }
+        if (delta <= (current_size / 2)) {
+            index = 2 * index + 1u; /* re-run for right child */
+        } else {
+            buddy_concurrent_try(buddy, 2 * index + 1u); /* mark right child */
+            buddy_concurrent_update(buddy, 2 * index + 1u);
+            delta -= current_size / 2;
+            index = 2 * index; /* re-run for left child */
+        }
+    }
+}
+
+/* Returns the highest set bit position for the given value. Returns zero for zero. */
+static size_t highest_bit_position(size_t value) {
+    if (value == 0) {
+        return 0;
+    }
+#if SIZE_MAX > 0xFFFFFFFFu
+    return sizeof(unsigned long long) * CHAR_BIT - (size_t) __builtin_clzll(value);
+#else
+    return sizeof(unsigned int) * CHAR_BIT - (size_t) __builtin_clz(value);
+#endif
+}
+
+static inline size_t ceiling_power_of_two(size_t value) {
+    value += !value; /* branchless x -> { 1 for 0, x for x } */
+    return two_to_the_power_of(highest_bit_position(value + value - 1)-1);
+}
+
+static inline size_t two_to_the_power_of(size_t order) {
+    return ((size_t)1) << order;
+}
+
+static inline size_t integer_square_root(size_t op) {
+    /* by Martin Guy, 1985 - http://medialab.freaknet.org/martin/src/sqrt/ */
+    size_t result = 0;
+    size_t cursor = (SIZE_MAX - (SIZE_MAX >> 1)) >> 1; /* second-to-top bit set */
+    while (cursor > op) {
+        cursor >>= 2;
+    }
+    /* "cursor" starts at the highest power of four <= than the argument. */
+    while (cursor != 0) {
+        if (op >= result + cursor) {
+            op -= result + cursor;
+            result += 2 * cursor;
+        }
+        result >>= 1;
+        cursor >>= 2;
+    }
+    return result;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include "buddy_allocator.h"
+
+struct buddy_concurrent;
+
+/*
+ * Returns the size of a lock-free buddy required to manage a block of the
+ * specified size using the specified alignment
+ */
+size_t buddy_concurrent_sizeof(size_t memory_size, size_t alignment);
+
+/* Initializes a lock-free binary buddy memory allocator at the specified location */
+struct buddy_concurrent *buddy_concurrent_init(unsigned char *at, unsigned char *main, size_t memory_size, size_t alignment);
+
+/*
+ * Initializes a lock-free binary buddy memory allocator embedded in the specified arena.
+ * The arena's capacity is reduced to account for the allocator metadata.
+ */
+struct buddy_concurrent *buddy_concurrent_embed(unsigned char *main, size_t memory_size, size_t alignment);
+
+/* Use the specified buddy to allocate memory. Safe to call from multiple threads. */
+void *buddy_concurrent_malloc(struct buddy_concurrent *buddy, size_t requested_size);
+
+/* Use the specified buddy to deallocate memory. Safe to call from multiple threads. */
+void buddy_concurrent_dealloc(struct buddy_concurrent *buddy, void *ptr);
+
+/*
+ * Use the specified buddy to reallocate a memory block. Safe to call from
+ * multiple threads. As with buddy_realloc, data is not copied and the old
+ * block is preserved if the new allocation cannot be satisfied.
+ */
+void *buddy_concurrent_realloc(struct buddy_concurrent *buddy, void *ptr, size_t requested_size);
+
+/*
+ * Fills stats with the state of the specified buddy, same fields as
+ * buddy_stats. The tree is scanned without locking, the result is only exact
+ * if it does not race with allocations.
+ */
+void buddy_concurrent_stats(struct buddy_concurrent *buddy, struct buddy_stats *stats);
+
+/* Prints the allocated blocks, must not race with allocations */
+void buddy_concurrent_debug(struct buddy_concurrent *buddy);
@@ -0,0 +1,264 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Stress test and scaling benchmark for the lock-free buddy allocator.
+ * Each thread churns its own set of live blocks, tagging the first and last
+ * word of every block it owns and checking the tags before freeing it, so an
+ * overlapping allocation is detected. The same workload is then run against
+ * buddy_malloc/buddy_dealloc guarded by a single mutex, for comparison.
+ * Before that, a check simulates a thread preempted while it holds the
+ * reservation of half the arena: an allocation has to succeed in the other
+ * half without waiting for it.
+ *
+ * g++ -O2 -pthread -o cbench buddy_concurrent_bench.cpp buddy_concurrent.cpp buddy_allocator.cpp
+ * ./cbench [max threads]
+ */
+
+#include "buddy_concurrent.h"
+#include "buddy_allocator.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+///Arena shared by all threads
+static const size_t arenaSize=64*1024*1024;
+///Minimum block size
+static const size_t alignment=1024;
+///Number of blocks each thread keeps live
+static const unsigned int liveBlocks=256;
+///Number of free+malloc pairs done by each thread
+static const unsigned int churnOps=200000;
+
+/**
+ * Small deterministic generator, one per thread
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * A live block and the tag written in its first and last word
+ */
+struct Block
+{
+    size_t *ptr;
+    size_t size;
+    size_t tag;
+};
+
+/**
+ * Common interface to the two allocators under test
+ */
+class Allocator
+{
+public:
+    virtual void *allocate(size_t size)=0;
+    virtual void deallocate(void *ptr)=0;
+    virtual ~Allocator() {}
+};
+
+class LockFreeAllocator : public Allocator
+{
+public:
+    LockFreeAllocator(unsigned char *arena)
+        : metadata(buddy_concurrent_sizeof(arenaSize,alignment)/sizeof(size_t)+1)
+    {
+        buddy=buddy_concurrent_init(reinterpret_cast<unsigned char*>(metadata.data()),
+                                    arena,arenaSize,alignment);
+    }
+    void *allocate(size_t size) { return buddy_concurrent_malloc(buddy,size); }
+    void deallocate(void *ptr) { buddy_concurrent_dealloc(buddy,ptr); }
+private:
+    vector<size_t> metadata;
+    struct buddy_concurrent *buddy;
+};
+
+class MutexAllocator : public Allocator
+{
+public:
+    MutexAllocator(unsigned char *arena)
+        : metadata(buddy_sizeof_alignment(arenaSize,alignment)/sizeof(size_t)+1)
+    {
+        buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                   arena,arenaSize,alignment);
+    }
+    void *allocate(size_t size)
+    {
+        lock_guard<mutex> l(m);
+        return buddy_malloc(buddy,size);
+    }
+    void deallocate(void *ptr)
+    {
+        lock_guard<mutex> l(m);
+        buddy_dealloc(buddy,ptr);
+    }
+private:
+    vector<size_t> metadata;
+    struct buddy *buddy;
+    mutex m;
+};
+
+static atomic<unsigned int> corrupted(0);
+static atomic<unsigned int> failed(0);
+
+static void tagBlock(Block& b, size_t tag)
+{
+    b.tag=tag;
+    b.ptr[0]=tag;
+    b.ptr[b.size/sizeof(size_t)-1]=tag;
+}
+
+static void checkBlock(const Block& b)
+{
+    if(b.ptr[0]!=b.tag || b.ptr[b.size/sizeof(size_t)-1]!=b.tag) corrupted++;
+}
+
+static void worker(Allocator *allocator, unsigned int id)
+{
+    vector<Block> live(liveBlocks);
+    unsigned int state=0x2545f491+id*7919;
+    size_t tag=static_cast<size_t>(id)<<32;
+    for(auto& b : live)
+    {
+        b.size=alignment<<(xorshift(state) % 5);
+        b.ptr=static_cast<size_t*>(allocator->allocate(b.size));
+        if(b.ptr) tagBlock(b,++tag); else failed++;
+    }
+    for(unsigned int i=0;i<churnOps;i++)
+    {
+        Block& b=live[xorshift(state) % liveBlocks];
+        if(b.ptr)
+        {
+            checkBlock(b);
+            allocator->deallocate(b.ptr);
+        }
+        b.size=alignment<<(xorshift(state) % 5);
+        b.ptr=static_cast<size_t*>(allocator->allocate(b.size));
+        if(b.ptr) tagBlock(b,++tag); else failed++;
+    }
+    for(auto& b : live)
+    {
+        if(b.ptr==nullptr) continue;
+        checkBlock(b);
+        allocator->deallocate(b.ptr);
+    }
+}
+
+/**
+ * \return throughput in malloc/free pairs per second
+ */
+static double run(Allocator *allocator, unsigned int threads)
+{
+    vector<thread> workers;
+    auto start=chrono::steady_clock::now();
+    for(unsigned int i=0;i<threads;i++) workers.emplace_back(worker,allocator,i);
+    for(auto& t : workers) t.join();
+    auto end=chrono::steady_clock::now();
+    return threads*static_cast<double>(churnOps)/chrono::duration<double>(end-start).count();
+}
+
+/**
+ * Reserve the left half of a fresh arena as a preempted allocation would,
+ * leaving its summary stale, and allocate a small block. The status words
+ * follow the allocator header, an array of 32 bit words indexed by tree
+ * position, see buddy_concurrent.cpp.
+ * \return true if the allocation succeeded in the right half within 5s
+ */
+static bool preemptedAncestor()
+{
+    const size_t size=64*1024, minBlock=64;
+    static unsigned char arena[size];
+    //Two positions of five bytes each for a single block, the rest is the header
+    size_t header=buddy_concurrent_sizeof(minBlock,minBlock)-2*(sizeof(uint32_t)+sizeof(uint8_t));
+    vector<size_t> metadata(buddy_concurrent_sizeof(size,minBlock)/sizeof(size_t)+1);
+    unsigned char *at=reinterpret_cast<unsigned char*>(metadata.data());
+    struct buddy_concurrent *buddy=buddy_concurrent_init(at,arena,size,minBlock);
+    if(buddy==nullptr) return false;
+    atomic<uint32_t> *status=reinterpret_cast<atomic<uint32_t>*>(at+header);
+    status[2].store(1u<<31); //Reserved, left child of the root
+
+    static atomic<void*> result(nullptr);
+    static atomic<bool> done(false);
+    thread t([buddy] { result=buddy_concurrent_malloc(buddy,minBlock); done=true; });
+    auto deadline=chrono::steady_clock::now()+chrono::seconds(5);
+    while(done==false && chrono::steady_clock::now()<deadline) this_thread::yield();
+    if(done==false)
+    {
+        //The thread spins on the metadata, it cannot be joined
+        printf("preempted ancestor: allocation did not return within 5s\n");
+        fflush(stdout);
+        _Exit(1);
+    }
+    t.join();
+    unsigned char *p=static_cast<unsigned char*>(result.load());
+    return p>=arena+size/2 && p<arena+size;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int maxThreads=argc>1 ? atoi(argv[1]) : thread::hardware_concurrency();
+    if(maxThreads==0) maxThreads=1;
+    unsigned char *arena=static_cast<unsigned char*>(malloc(arenaSize));
+    if(arena==nullptr) return 1;
+
+    if(preemptedAncestor()==false)
+    {
+        printf("preempted ancestor: no block allocated in the free half\n");
+        corrupted++;
+    }
+    printf("threads lockfree_ops_per_s mutex_ops_per_s\n");
+    vector<unsigned int> threadCounts;
+    for(unsigned int threads=1;threads<maxThreads;threads*=2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+    for(unsigned int threads : threadCounts)
+    {
+        LockFreeAllocator lockFree(arena);
+        double lockFreeOps=run(&lockFree,threads);
+        //Once every thread has freed its blocks, the whole arena must be free
+        void *all=lockFree.allocate(arenaSize);
+        if(all==nullptr) corrupted++;
+
+        MutexAllocator locked(arena);
+        double lockedOps=run(&locked,threads);
+        printf("%u %.0f %.0f\n",threads,lockFreeOps,lockedOps);
+    }
+    printf("corrupted %u, failed %u\n",corrupted.load(),failed.load());
+    free(arena);
+    return corrupted.load() ? 1 : 0;
+}
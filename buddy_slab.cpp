@@ -0,0 +1,347 @@
+#include "buddy_slab.h"
+#include <cstdint>
+#include <cstring>
+
+/*
+ * A size class slab allocator on top of the buddy allocator
+ *
+ * A slab is a block of slab_size bytes taken from the buddy, starting with a
+ * header followed by objects of a single size class. Blocks are aligned to
+ * their size relative to the start of the arena, so the header of the slab
+ * owning an object is found by masking its offset in the arena.
+ *
+ * The header has one bit per object, set if the object is free, and a summary
+ * word with one bit per bitmap word, set if the word has a free object, so a
+ * free object is found with two ctz. The slabs of a class that have free
+ * objects are kept in a doubly linked list, full slabs are in no list.
+ */
+
+/* Smallest size class, also the alignment of every object */
+#define BUDDY_SLAB_MIN_SIZE 16
+/* Objects of a slab are limited to what a 64 bit summary word can index */
+#define BUDDY_SLAB_MAX_OBJECTS 4096
+#define BUDDY_SLAB_MAX_WORDS (BUDDY_SLAB_MAX_OBJECTS / 64)
+/* Enough for 1.5x spaced classes up to objects of 2^31 bytes */
+#define BUDDY_SLAB_CLASSES 56
+/* A class needs at least this many objects per slab */
+#define BUDDY_SLAB_MIN_OBJECTS 8
+
+struct buddy_slab_page {
+    struct buddy_slab *owner;      /* slab allocator of the slab, NULL once given back */
+    struct buddy_slab_page *next;  /* next slab with free objects of the same class */
+    struct buddy_slab_page *prev;  /* previous slab with free objects of the same class */
+    uint32_t size_class;
+    uint32_t used;                 /* allocated objects */
+    uint64_t summary;              /* bit i set if free word i is not zero */
+    /* followed by the free bitmap, one bit per object */
+};
+
+struct buddy_slab_class {
+    struct buddy_slab_page *partial; /* slabs with free objects, allocations use the first one */
+    size_t object_size;
+    size_t objects;                  /* objects in a slab */
+    size_t offset;                   /* offset of the first object from the start of the slab */
+};
+
+struct buddy_slab {
+    struct buddy *buddy;
+    unsigned char *main;
+    size_t memory_size;
+    size_t slab_size;
+    size_t classes;
+    size_t count;
+    struct buddy_slab_class size_classes[BUDDY_SLAB_CLASSES];
+};
+
+static size_t size_for_class(size_t size_class);
+static size_t class_for_size(size_t requested_size);
+static size_t buddy_slab_classes(struct buddy_slab_class *classes, size_t slab_size);
+static inline uint64_t *buddy_slab_page_free(struct buddy_slab_page *page);
+static struct buddy_slab_page *buddy_slab_page_new(struct buddy_slab *slab, size_t size_class);
+static void buddy_slab_page_link(struct buddy_slab_class *cls, struct buddy_slab_page *page);
+static void buddy_slab_page_unlink(struct buddy_slab_class *cls, struct buddy_slab_page *page);
+static void buddy_slab_page_release(struct buddy_slab *slab, struct buddy_slab_page *page);
+
+size_t buddy_slab_sizeof(size_t slab_size) {
+    struct buddy_slab_class classes[BUDDY_SLAB_CLASSES];
+
+    if ((slab_size == 0) || (slab_size & (slab_size - 1))) {
+        return 0; /* invalid */
+    }
+    if (buddy_slab_classes(classes, slab_size) == 0) {
+        return 0; /* too small for the smallest class */
+    }
+    return sizeof(struct buddy_slab);
+}
+
+struct buddy_slab *buddy_slab_init(unsigned char *at, struct buddy *buddy, size_t slab_size) {
+    struct buddy_slab *slab;
+    struct buddy_stats stats;
+
+    if ((at == NULL) || (buddy == NULL)) {
+        return NULL;
+    }
+    if (((uintptr_t) at) % alignof(struct buddy_slab) != 0) {
+        return NULL;
+    }
+    if (buddy_slab_sizeof(slab_size) == 0) {
+        return NULL;
+    }
+    if (slab_size < buddy_alignment(buddy)) {
+        return NULL; /* every slab would take a whole block */
+    }
+    buddy_stats(buddy, &stats);
+
+    slab = (struct buddy_slab *) at;
+    memset(slab, 0, sizeof(*slab));
+    slab->buddy = buddy;
+    slab->main = buddy_arena(buddy);
+    slab->memory_size = stats.total_bytes;
+    slab->slab_size = slab_size;
+    slab->classes = buddy_slab_classes(slab->size_classes, slab_size);
+    return slab;
+}
+
+size_t buddy_slab_max_size(struct buddy_slab *slab) {
+    if ((slab == NULL) || (slab->classes == 0)) {
+        return 0;
+    }
+    return slab->size_classes[slab->classes - 1].object_size;
+}
+
+void *buddy_slab_malloc(struct buddy_slab *slab, size_t requested_size) {
+    struct buddy_slab_class *cls;
+    struct buddy_slab_page *page;
+    uint64_t *free;
+    size_t size_class, word, bit;
+
+    if (slab == NULL) {
+        return NULL;
+    }
+    size_class = class_for_size(requested_size);
+    if (size_class >= slab->classes) {
+        return NULL;
+    }
+    cls = &slab->size_classes[size_class];
+    page = cls->partial;
+    if (page == NULL) {
+        page = buddy_slab_page_new(slab, size_class);
+        if (page == NULL) {
+            return NULL;
+        }
+    }
+
+    free = buddy_slab_page_free(page);
+    word = (size_t) __builtin_ctzll(page->summary);
+    bit = (size_t) __builtin_ctzll(free[word]);
+    free[word] &= free[word] - 1;
+    if (free[word] == 0) {
+        page->summary &= ~((uint64_t) 1 << word);
+    }
+    page->used++;
+    if (page->summary == 0) {
+        buddy_slab_page_unlink(cls, page); /* full */
+    }
+    return (unsigned char *) page + cls->offset + (word * 64 + bit) * cls->object_size;
+}
+
+void buddy_slab_dealloc(struct buddy_slab *slab, void *ptr) {
+    struct buddy_slab_class *cls;
+    struct buddy_slab_page *page;
+    uint64_t *free;
+    size_t offset, index, word;
+    uint64_t mask;
+
+    if ((slab == NULL) || (ptr == NULL)) {
+        return;
+    }
+    if (((unsigned char *) ptr < slab->main) || ((unsigned char *) ptr >= slab->main + slab->memory_size)) {
+        return;
+    }
+    offset = (size_t) ((unsigned char *) ptr - slab->main);
+    page = (struct buddy_slab_page *) (slab->main + (offset & ~(slab->slab_size - 1)));
+    if (page->owner != slab) {
+        return;
+    }
+    cls = &slab->size_classes[page->size_class];
+    offset = (size_t) ((unsigned char *) ptr - (unsigned char *) page);
+    if ((offset < cls->offset) || ((offset - cls->offset) % cls->object_size)) {
+        return;
+    }
+    index = (offset - cls->offset) / cls->object_size;
+    if (index >= cls->objects) {
+        return;
+    }
+    free = buddy_slab_page_free(page);
+    word = index / 64;
+    mask = (uint64_t) 1 << (index % 64);
+    if (free[word] & mask) {
+        return; /* already free */
+    }
+
+    if (page->summary == 0) {
+        buddy_slab_page_link(cls, page); /* was full */
+    }
+    free[word] |= mask;
+    page->summary |= (uint64_t) 1 << word;
+    page->used--;
+    /* Keep an empty slab if it is the only one, so a class at the edge of a slab does not churn the buddy */
+    if ((page->used == 0) && ((cls->partial != page) || (page->next != NULL))) {
+        buddy_slab_page_unlink(cls, page);
+        buddy_slab_page_release(slab, page);
+    }
+}
+
+size_t buddy_slab_trim(struct buddy_slab *slab) {
+    struct buddy_slab_class *cls;
+    struct buddy_slab_page *page, *next;
+    size_t i, released;
+
+    if (slab == NULL) {
+        return 0;
+    }
+    released = 0;
+    for (i = 0; i < slab->classes; i++) {
+        cls = &slab->size_classes[i];
+        for (page = cls->partial; page != NULL; page = next) {
+            next = page->next;
+            if (page->used == 0) {
+                buddy_slab_page_unlink(cls, page);
+                buddy_slab_page_release(slab, page);
+                released++;
+            }
+        }
+    }
+    return released;
+}
+
+size_t buddy_slab_count(struct buddy_slab *slab) {
+    if (slab == NULL) {
+        return 0;
+    }
+    return slab->count;
+}
+
+/*
+ * Classes are spaced by 1.5x above the smallest one:
+ * 16, 32, 48, 64, 96, 128, 192, 256, ...
+ */
+static size_t size_for_class(size_t size_class) {
+    if (size_class == 0) {
+        return BUDDY_SLAB_MIN_SIZE;
+    }
+    if (size_class % 2) {
+        return (size_t) 2 * BUDDY_SLAB_MIN_SIZE << ((size_class - 1) / 2);
+    }
+    return (size_t) 3 * BUDDY_SLAB_MIN_SIZE << ((size_class - 2) / 2);
+}
+
+static size_t class_for_size(size_t requested_size) {
+    size_t units, bits;
+
+    if (requested_size <= BUDDY_SLAB_MIN_SIZE) {
+        return 0;
+    }
+    if (requested_size <= 2 * BUDDY_SLAB_MIN_SIZE) {
+        return 1;
+    }
+    /* 2^bits < units <= 2^(bits+1), in units of the smallest class */
+    units = (requested_size - 1) / BUDDY_SLAB_MIN_SIZE;
+    bits = (size_t) (sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(units));
+    if (units < ((size_t) 3 << (bits - 1))) {
+        return 2 * bits; /* fits 3 * 2^(bits-1) units */
+    }
+    return 2 * bits + 1;
+}
+
+static size_t buddy_slab_classes(struct buddy_slab_class *classes, size_t slab_size) {
+    size_t i, objects, words, offset, object_size;
+
+    for (i = 0; i < BUDDY_SLAB_CLASSES; i++) {
+        object_size = size_for_class(i);
+        if (object_size > slab_size / BUDDY_SLAB_MIN_OBJECTS) {
+            break;
+        }
+        /* The bitmap shrinks the room left for objects, size it for the upper bound */
+        objects = slab_size / object_size;
+        if (objects > BUDDY_SLAB_MAX_OBJECTS) {
+            objects = BUDDY_SLAB_MAX_OBJECTS;
+        }
+        words = (objects + 63) / 64;
+        offset = sizeof(struct buddy_slab_page) + words * sizeof(uint64_t);
+        offset = (offset + BUDDY_SLAB_MIN_SIZE - 1) / BUDDY_SLAB_MIN_SIZE * BUDDY_SLAB_MIN_SIZE;
+        if ((slab_size - offset) / object_size < objects) {
+            objects = (slab_size - offset) / object_size;
+        }
+        if (objects < BUDDY_SLAB_MIN_OBJECTS) {
+            break;
+        }
+        classes[i].partial = NULL;
+        classes[i].object_size = object_size;
+        classes[i].objects = objects;
+        classes[i].offset = offset;
+    }
+    return i;
+}
+
+static inline uint64_t *buddy_slab_page_free(struct buddy_slab_page *page) {
+    return (uint64_t *) (page + 1);
+}
+
+static struct buddy_slab_page *buddy_slab_page_new(struct buddy_slab *slab, size_t size_class) {
+    struct buddy_slab_class *cls;
+    struct buddy_slab_page *page;
+    uint64_t *free;
+    size_t words, i;
+
+    page = (struct buddy_slab_page *) buddy_malloc(slab->buddy, slab->slab_size);
+    if (page == NULL) {
+        return NULL;
+    }
+    cls = &slab->size_classes[size_class];
+    page->owner = slab;
+    page->size_class = (uint32_t) size_class;
+    page->used = 0;
+
+    words = (cls->objects + 63) / 64;
+    free = buddy_slab_page_free(page);
+    for (i = 0; i < words; i++) {
+        free[i] = ~(uint64_t) 0;
+    }
+    if (cls->objects % 64) {
+        free[words - 1] = ((uint64_t) 1 << (cls->objects % 64)) - 1;
+    }
+    page->summary = words == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << words) - 1;
+
+    buddy_slab_page_link(cls, page);
+    slab->count++;
+    return page;
+}
+
+static void buddy_slab_page_link(struct buddy_slab_class *cls, struct buddy_slab_page *page) {
+    page->prev = NULL;
+    page->next = cls->partial;
+    if (cls->partial != NULL) {
+        cls->partial->prev = page;
+    }
+    cls->partial = page;
+}
+
+static void buddy_slab_page_unlink(struct buddy_slab_class *cls, struct buddy_slab_page *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        cls->partial = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+}
+
+static void buddy_slab_page_release(struct buddy_slab *slab, struct buddy_slab_page *page) {
+    page->owner = NULL;
+    buddy_dealloc(slab->buddy, page);
+    slab->count--;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include "buddy_allocator.h"
+
+struct buddy_slab;
+
+/*
+ * Returns the size of a slab allocator using slabs of slab_size bytes, zero if
+ * slab_size is not a power of two or cannot hold at least eight objects of
+ * the smallest size class.
+ */
+size_t buddy_slab_sizeof(size_t slab_size);
+
+/*
+ * Initializes at the specified location a slab allocator for small objects,
+ * that takes blocks of slab_size bytes from the specified buddy and splits
+ * each of them into objects of a single size class. Returns NULL if slab_size
+ * is less than the alignment of the buddy, as every slab would take a whole
+ * block. The buddy has to outlive the slab allocator and must not be resized
+ * while it has slabs.
+ *
+ * The slabs are ordinary blocks of the buddy, so the buddy should be reserved
+ * to the slab allocator. The slab allocator is not used by ProcessPool: its
+ * blocks are given to processes and may be moved by defragment(), so kernel
+ * objects in the pool memory need a buddy over a part of the pool reserved for
+ * them.
+ */
+struct buddy_slab *buddy_slab_init(unsigned char *at, struct buddy *buddy, size_t slab_size);
+
+/* Returns the largest request buddy_slab_malloc can satisfy, larger ones have to go to buddy_malloc */
+size_t buddy_slab_max_size(struct buddy_slab *slab);
+
+/*
+ * Use the specified slab allocator to allocate an object aligned to 16 bytes,
+ * in O(1) unless a new slab has to be taken from the buddy. Returns NULL if
+ * requested_size is larger than buddy_slab_max_size or the buddy is out of
+ * memory.
+ */
+void *buddy_slab_malloc(struct buddy_slab *slab, size_t requested_size);
+
+/*
+ * Use the specified slab allocator to deallocate an object in O(1). A slab
+ * left empty is given back to the buddy, unless it is the only slab of its
+ * size class with free objects. NULL and objects that are already free are
+ * ignored, other pointers must have been returned by buddy_slab_malloc.
+ */
+void buddy_slab_dealloc(struct buddy_slab *slab, void *ptr);
+
+/* Gives the empty slabs still held by the size classes back to the buddy. Returns their number. */
+size_t buddy_slab_trim(struct buddy_slab *slab);
+
+/* Returns the number of slabs taken from the buddy */
+size_t buddy_slab_count(struct buddy_slab *slab);
@@ -0,0 +1,268 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Benchmark of the slab allocator against buddy_malloc for small objects.
+ * The same churn of objects between 16 and 256 bytes is run on a buddy with
+ * the smallest alignment, so that buddy_malloc wastes as little as possible,
+ * and on slabs taken from a buddy with page sized blocks. Every live object
+ * is tagged in its first and last word, and the tags are checked before it
+ * is freed, so overlapping objects are detected. Before timing, a checked pass
+ * verifies that the slab allocator returns aligned objects inside the arena
+ * that do not overlap, and that buddy_slab_trim gives every empty slab back to
+ * the buddy. The program returns 1 if any check fails.
+ *
+ * g++ -O2 -o slabbench buddy_slab_bench.cpp buddy_slab.cpp buddy_allocator.cpp
+ * ./slabbench
+ */
+
+#include "buddy_slab.h"
+#include "buddy_allocator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+///Arena of each allocator
+static const size_t arenaSize=64*1024*1024;
+///Alignment of the buddy serving small objects directly
+static const size_t smallAlignment=16;
+///Alignment of the buddy the slabs are taken from
+static const size_t pageAlignment=4096;
+///Size of a slab
+static const size_t slabSize=4096;
+///Alignment of every object returned by buddy_slab_malloc
+static const size_t objectAlignment=16;
+///Number of objects kept live during the steady state phase
+static const unsigned int liveObjects=65536;
+///Number of free+malloc pairs in each round of the steady state phase
+static const unsigned int churnOps=2000000;
+///The best round is reported, to filter out noise from the host
+static const unsigned int rounds=5;
+
+/**
+ * Small deterministic generator, so that both allocators see the same sequence
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * \return a size between 16 and 256 bytes, biased towards the small ones
+ */
+static size_t randomSize(unsigned int& state)
+{
+    unsigned int r=xorshift(state);
+    size_t base=16<<(r % 5);
+    return base-(r>>8) % (base/16)*8;
+}
+
+/**
+ * A live object and the tag written in its first and last word
+ */
+struct Object
+{
+    size_t *ptr;
+    size_t size;
+};
+
+static unsigned int corrupted=0;
+
+static void tagObject(const Object& o)
+{
+    size_t tag=reinterpret_cast<size_t>(o.ptr)^o.size;
+    o.ptr[0]=tag;
+    o.ptr[o.size/sizeof(size_t)-1]=tag;
+}
+
+static void checkObject(const Object& o)
+{
+    size_t tag=reinterpret_cast<size_t>(o.ptr)^o.size;
+    if(o.ptr[0]!=tag || o.ptr[o.size/sizeof(size_t)-1]!=tag) corrupted++;
+}
+
+/**
+ * Run the churn workload
+ * \param allocate callable taking a size and returning an object
+ * \param deallocate callable taking an object
+ * \param failed incremented for every failed allocation
+ * \param used returns the bytes the allocator took for the live objects
+ * \param bytes set to the result of used after the last round
+ * \param payload set to the size of the live objects after the last round
+ * \return best time in ns per malloc/free pair
+ */
+template<typename Allocate, typename Deallocate, typename Used>
+static double churn(Allocate allocate, Deallocate deallocate, unsigned int& failed, Used used,
+                    size_t& bytes, size_t& payload)
+{
+    vector<Object> live(liveObjects);
+    unsigned int state=0x2545f491;
+    auto fill=[&](Object& o)
+    {
+        o.size=randomSize(state);
+        o.ptr=static_cast<size_t*>(allocate(o.size));
+        if(o.ptr) tagObject(o); else failed++;
+    };
+    for(auto& o : live) fill(o);
+
+    double best=0;
+    for(unsigned int r=0;r<rounds;r++)
+    {
+        auto start=chrono::steady_clock::now();
+        for(unsigned int i=0;i<churnOps;i++)
+        {
+            Object& o=live[xorshift(state) % liveObjects];
+            if(o.ptr)
+            {
+                checkObject(o);
+                deallocate(o.ptr);
+            }
+            fill(o);
+        }
+        auto end=chrono::steady_clock::now();
+        double ns=chrono::duration<double,nano>(end-start).count()/churnOps;
+        if(r==0 || ns<best) best=ns;
+    }
+    bytes=used();
+    payload=0;
+    for(auto& o : live)
+    {
+        if(o.ptr==nullptr) continue;
+        payload+=o.size;
+        checkObject(o);
+        deallocate(o.ptr);
+    }
+    return best;
+}
+
+/**
+ * \return bytes allocated from the buddy
+ */
+static size_t allocatedBytes(struct buddy *buddy)
+{
+    struct buddy_stats stats;
+    buddy_stats(buddy,&stats);
+    return stats.total_bytes-stats.free_bytes;
+}
+
+/**
+ * Allocate objects of random sizes until the slab allocator holds many slabs,
+ * check them, then free them all and trim
+ * \param slab slab allocator, with no live objects
+ * \param pages buddy the slabs are taken from
+ * \param arena start of the arena of the buddy
+ * \return number of failed checks
+ */
+static unsigned int checkedPass(struct buddy_slab *slab, struct buddy *pages, unsigned char *arena)
+{
+    unsigned int errors=0;
+    unsigned int state=0x9e3779b9;
+    vector<Object> live;
+    for(unsigned int i=0;i<liveObjects;i++)
+    {
+        Object o;
+        o.size=randomSize(state);
+        o.ptr=static_cast<size_t*>(buddy_slab_malloc(slab,o.size));
+        if(o.ptr==nullptr) { errors++; continue; }
+        unsigned char *p=reinterpret_cast<unsigned char*>(o.ptr);
+        if(reinterpret_cast<size_t>(p) % objectAlignment) errors++;
+        if(p<arena || p+o.size>arena+arenaSize) errors++;
+        tagObject(o);
+        live.push_back(o);
+    }
+    //Sorted by address, each object has to end before the next one starts,
+    //which also means that no address was returned twice
+    sort(live.begin(),live.end(),[](const Object& a, const Object& b) { return a.ptr<b.ptr; });
+    for(size_t i=1;i<live.size();i++)
+    {
+        unsigned char *end=reinterpret_cast<unsigned char*>(live[i-1].ptr)+live[i-1].size;
+        if(end>reinterpret_cast<unsigned char*>(live[i].ptr)) errors++;
+    }
+    for(auto& o : live)
+    {
+        checkObject(o);
+        buddy_slab_dealloc(slab,o.ptr);
+    }
+    buddy_slab_trim(slab);
+    if(buddy_slab_count(slab)!=0 || allocatedBytes(pages)!=0) errors++;
+    printf("checked pass: %zu objects, %u errors\n",live.size(),errors);
+    return errors;
+}
+
+int main()
+{
+    unsigned char *arena=static_cast<unsigned char*>(malloc(arenaSize));
+    if(arena==nullptr) return 1;
+
+    vector<size_t> metadata(buddy_sizeof_alignment(arenaSize,smallAlignment)/sizeof(size_t)+1);
+    struct buddy *buddy=buddy_init_alignment(reinterpret_cast<unsigned char*>(metadata.data()),
+                                             arena,arenaSize,smallAlignment);
+    unsigned int failed=0;
+    size_t bytes,payload;
+    double best=churn([buddy](size_t size) { return buddy_malloc(buddy,size); },
+                      [buddy](void *ptr) { buddy_dealloc(buddy,ptr); },failed,
+                      [buddy]() { return allocatedBytes(buddy); },bytes,payload);
+    printf("buddy_malloc: %zu KB of metadata, %u malloc/free pairs, best of %u rounds %.1f ns/pair, "
+           "%zu KB for %zu KB of live objects, %u failed\n",
+           metadata.size()*sizeof(size_t)>>10,churnOps,rounds,best,bytes>>10,payload>>10,failed);
+
+    vector<size_t> pageMetadata(buddy_sizeof_alignment(arenaSize,pageAlignment)/sizeof(size_t)+1);
+    struct buddy *pages=buddy_init_alignment(reinterpret_cast<unsigned char*>(pageMetadata.data()),
+                                             arena,arenaSize,pageAlignment);
+    vector<size_t> slabMetadata(buddy_slab_sizeof(slabSize)/sizeof(size_t)+1);
+    struct buddy_slab *slab=buddy_slab_init(reinterpret_cast<unsigned char*>(slabMetadata.data()),
+                                            pages,slabSize);
+    if(slab==nullptr)
+    {
+        fprintf(stderr,"buddy_slab_init failed\n");
+        return 1;
+    }
+    unsigned int errors=checkedPass(slab,pages,arena);
+    failed=0;
+    best=churn([slab](size_t size) { return buddy_slab_malloc(slab,size); },
+               [slab](void *ptr) { buddy_slab_dealloc(slab,ptr); },failed,
+               [pages]() { return allocatedBytes(pages); },bytes,payload);
+    size_t held=buddy_slab_count(slab);
+    size_t trimmed=buddy_slab_trim(slab);
+    printf("buddy_slab:   %zu KB of metadata, %u malloc/free pairs, best of %u rounds %.1f ns/pair, "
+           "%zu KB for %zu KB of live objects, %u failed\n",
+           (pageMetadata.size()+slabMetadata.size())*sizeof(size_t)>>10,churnOps,rounds,best,
+           bytes>>10,payload>>10,failed);
+    printf("buddy_slab:   %zu slabs held after freeing every object, %zu given back by buddy_slab_trim, "
+           "%zu KB still allocated from the buddy\n",held,trimmed,allocatedBytes(pages)>>10);
+    if(buddy_slab_count(slab)!=0 || allocatedBytes(pages)!=0) errors++;
+    if(corrupted) printf("%u corrupted objects\n",corrupted);
+    free(arena);
+    return corrupted || errors ? 1 : 0;
+}
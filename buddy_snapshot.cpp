@@ -0,0 +1,86 @@
+#include "buddy_snapshot.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+size_t buddy_snapshot_write_file(struct buddy *buddy, const char *path) {
+    unsigned char *snapshot;
+    size_t size, written;
+    FILE *f;
+
+    size = buddy_snapshot_size(buddy);
+    if ((size == 0) || (path == NULL)) {
+        return 0;
+    }
+    snapshot = (unsigned char *) malloc(size);
+    if (snapshot == NULL) {
+        return 0;
+    }
+    written = buddy_snapshot_save(buddy, snapshot, size);
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        free(snapshot);
+        return 0;
+    }
+    if (fwrite(snapshot, 1, written, f) != written) {
+        written = 0;
+    }
+    if (fclose(f) != 0) {
+        written = 0;
+    }
+    free(snapshot);
+    return written;
+}
+
+struct buddy *buddy_snapshot_map_file(const char *path, unsigned char *main, int shared,
+        struct buddy_snapshot_mapping *mapping) {
+    struct buddy *buddy;
+    struct stat st;
+    void *address;
+    int fd;
+
+    if ((path == NULL) || (mapping == NULL)) {
+        return NULL;
+    }
+    fd = open(path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+        close(fd);
+        return NULL;
+    }
+    /* A private mapping is copy on write, loading only writes to the first page */
+    address = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return NULL;
+    }
+
+    buddy = buddy_snapshot_load((unsigned char *) address, (size_t) st.st_size, main);
+    if (buddy == NULL) {
+        munmap(address, (size_t) st.st_size);
+        return NULL;
+    }
+    mapping->address = address;
+    mapping->size = (size_t) st.st_size;
+    mapping->shared = shared;
+    return buddy;
+}
+
+void buddy_snapshot_unmap_file(struct buddy_snapshot_mapping *mapping) {
+    if ((mapping == NULL) || (mapping->address == NULL)) {
+        return;
+    }
+    if (mapping->shared) {
+        buddy_snapshot_sync((unsigned char *) mapping->address, mapping->size);
+    }
+    munmap(mapping->address, mapping->size);
+    mapping->address = NULL;
+    mapping->size = 0;
+    mapping->shared = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include "buddy_allocator.h"
+
+/*
+ * Host helpers to keep buddy snapshots in files, see buddy_snapshot_save.
+ * They need POSIX mmap, the allocator itself does not depend on them.
+ */
+
+/* A snapshot file mapped in memory */
+struct buddy_snapshot_mapping {
+    void *address; /* start of the mapping */
+    size_t size;   /* length of the mapping */
+    int shared;    /* nonzero if the changes are written back to the file */
+};
+
+/* Saves a snapshot of the specified buddy to the file at path. Returns the bytes written, zero on failure. */
+size_t buddy_snapshot_write_file(struct buddy *buddy, const char *path);
+
+/*
+ * Maps the snapshot in the file at path and loads it in place for the arena at
+ * main, see buddy_snapshot_load. If shared is nonzero the changes made by the
+ * allocator are written back to the file, otherwise they stay private to the
+ * process. Returns NULL if the file cannot be mapped or is not a valid
+ * snapshot, otherwise mapping is filled for buddy_snapshot_unmap_file.
+ */
+struct buddy *buddy_snapshot_map_file(const char *path, unsigned char *main, int shared,
+    struct buddy_snapshot_mapping *mapping);
+
+/*
+ * Unmaps a snapshot mapped by buddy_snapshot_map_file, the buddy can no longer
+ * be used. A shared mapping is sealed with buddy_snapshot_sync first, so that
+ * the file keeps passing buddy_snapshot_verify with the state the allocator
+ * left in it.
+ */
+void buddy_snapshot_unmap_file(struct buddy_snapshot_mapping *mapping);
@@ -29,8 +29,11 @@
 #include <stdexcept>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
 #ifndef TEST_ALLOC
 #include "interfaces_private/userspace.h"
+#elif defined(__linux__) //TEST_ALLOC
+#include <sched.h>
 #endif //TEST_ALLOC
 
 using namespace std;
@@ -44,9 +47,438 @@ namespace miosix {
 ///in bits. So for example 10 is 1KB.
 static const unsigned int blockBits=10;
 ///This constant is the the size of the minimum allocatable block, in bytes.
-static const unsigned int blockSize=1<<blockBits;
+static const size_t blockSize=static_cast<size_t>(1)<<blockBits;
+
+/**
+ * Bitmap with a hierarchy of summaries on top of it, bit i of a summary is
+ * set if word i of the level below is not zero, and the top level is a single
+ * word. The first set bit is found with one ctz per level instead of scanning
+ * the bitmap, and ranges are set and cleared a whole word at a time.
+ */
+class ProcessPool::SlotBitmap
+{
+public:
+    SlotBitmap() : depth(0) {}
+
+    /**
+     * Allocate the bitmap, all bits are initially clear
+     * \param bits number of bits
+     */
+    void init(size_t bits)
+    {
+        size_t words=(bits+wordBits-1)/wordBits;
+        for(;;)
+        {
+            levels[depth]=new unsigned int[words];
+            memset(levels[depth],0,words*sizeof(unsigned int));
+            depth++;
+            if(words<=1) break;
+            words=(words+wordBits-1)/wordBits;
+        }
+    }
+
+    ~SlotBitmap()
+    {
+        for(unsigned int i=0;i<depth;i++) delete[] levels[i];
+    }
+
+    /**
+     * \param bit bit to test
+     * \return true if the bit is set
+     */
+    bool test(size_t bit) const
+    {
+        return (levels[0][bit/wordBits]>>(bit % wordBits)) & 1;
+    }
+
+    /**
+     * \param first first bit to set
+     * \param count number of bits to set
+     */
+    void setRange(size_t first, size_t count)
+    {
+        while(count)
+        {
+            unsigned int n=min<size_t>(count,wordBits-first % wordBits);
+            write(first/wordBits,levels[0][first/wordBits] | mask(first,n));
+            first+=n;
+            count-=n;
+        }
+    }
+
+    /**
+     * \param first first bit to clear
+     * \param count number of bits to clear
+     */
+    void clearRange(size_t first, size_t count)
+    {
+        while(count)
+        {
+            unsigned int n=min<size_t>(count,wordBits-first % wordBits);
+            write(first/wordBits,levels[0][first/wordBits] & ~mask(first,n));
+            first+=n;
+            count-=n;
+        }
+    }
+
+    /**
+     * \return the index of the first set bit, or notFound if no bit is set
+     */
+    size_t findFirst() const
+    {
+        size_t index=0;
+        for(unsigned int i=depth;i>0;i--)
+        {
+            unsigned int word=levels[i-1][index];
+            if(word==0) return notFound; //Only possible at the top level
+            index=index*wordBits+__builtin_ctz(word);
+        }
+        return index;
+    }
+
+    static const size_t notFound=~static_cast<size_t>(0);
+
+private:
+    SlotBitmap(const SlotBitmap&);
+    SlotBitmap& operator= (const SlotBitmap&);
+
+    /**
+     * \return a mask of n bits starting from bit first of a word, n>0
+     */
+    static unsigned int mask(size_t first, unsigned int n)
+    {
+        unsigned int ones=n==wordBits ? ~0u : (1u<<n)-1;
+        return ones<<(first % wordBits);
+    }
+
+    /**
+     * Write a word of the bitmap, updating the summaries if it became zero
+     * or nonzero
+     */
+    void write(size_t word, unsigned int value)
+    {
+        unsigned int old=levels[0][word];
+        levels[0][word]=value;
+        for(unsigned int i=1;i<depth && (old==0)!=(value==0);i++)
+        {
+            unsigned int bit=1u<<(word % wordBits);
+            word/=wordBits;
+            old=levels[i][word];
+            value=value ? old | bit : old & ~bit;
+            levels[i][word]=value;
+        }
+    }
+
+    static const unsigned int wordBits=sizeof(unsigned int)*8;
+    ///Each level divides the number of bits by wordBits, 32, so size_t
+    ///indices need at most one level per five bits
+    static const unsigned int maxDepth=(sizeof(size_t)*8+4)/5;
+    unsigned int *levels[maxDepth]; ///< levels[0] is the bitmap, then the summaries
+    unsigned int depth;             ///< Number of levels
+};
+#else //BMA
+//Thin wrappers selecting the sequential or the lock-free buddy allocator
+#ifndef BUDDY_CONCURRENT
+typedef struct buddy Buddy;
+static inline size_t buddySizeof(size_t size, size_t alignment) { return buddy_sizeof_alignment(size,alignment); }
+static inline Buddy *buddyInit(unsigned char *at, unsigned char *main, size_t size, size_t alignment) { return buddy_init_alignment(at,main,size,alignment); }
+static inline Buddy *buddyEmbed(unsigned char *main, size_t size, size_t alignment) { return buddy_embed_alignment(main,size,alignment); }
+static inline void *buddyMalloc(Buddy *buddy, size_t size) { return buddy_malloc(buddy,size); }
+static inline void buddyDealloc(Buddy *buddy, void *ptr) { buddy_dealloc(buddy,ptr); }
+static inline void buddyDeallocBatch(Buddy *buddy, void **ptrs, size_t count) { buddy_dealloc_batch(buddy,ptrs,count); }
+static inline void *buddyRealloc(Buddy *buddy, void *ptr, size_t size) { return buddy_realloc(buddy,ptr,size); }
+static inline void buddyStats(Buddy *buddy, struct buddy_stats *stats) { buddy_stats(buddy,stats); }
+static inline void buddyDebug(Buddy *buddy) { buddy_debug(buddy); }
+#else //BUDDY_CONCURRENT
+typedef struct buddy_concurrent Buddy;
+static inline size_t buddySizeof(size_t size, size_t alignment) { return buddy_concurrent_sizeof(size,alignment); }
+static inline Buddy *buddyInit(unsigned char *at, unsigned char *main, size_t size, size_t alignment) { return buddy_concurrent_init(at,main,size,alignment); }
+static inline Buddy *buddyEmbed(unsigned char *main, size_t size, size_t alignment) { return buddy_concurrent_embed(main,size,alignment); }
+static inline void *buddyMalloc(Buddy *buddy, size_t size) { return buddy_concurrent_malloc(buddy,size); }
+static inline void buddyDealloc(Buddy *buddy, void *ptr) { buddy_concurrent_dealloc(buddy,ptr); }
+static inline void buddyDeallocBatch(Buddy *buddy, void **ptrs, size_t count) { for(size_t i=0;i<count;i++) buddy_concurrent_dealloc(buddy,ptrs[i]); }
+static inline void *buddyRealloc(Buddy *buddy, void *ptr, size_t size) { return buddy_concurrent_realloc(buddy,ptr,size); }
+static inline void buddyStats(Buddy *buddy, struct buddy_stats *stats) { buddy_concurrent_stats(buddy,stats); }
+static inline void buddyDebug(Buddy *buddy) { buddy_concurrent_debug(buddy); }
+#endif //BUDDY_CONCURRENT
 #endif //BMA
 
+#ifdef PROCESS_POOL_TRACE
+#ifndef TEST_ALLOC
+typedef miosix::Lock<miosix::FastMutex> TraceLock;
+#else //TEST_ALLOC
+typedef lock_guard<mutex> TraceLock;
+#endif //TEST_ALLOC
+
+/**
+ * Counts the public methods the calling thread is inside, so that only the
+ * outermost one is recorded, and not the calls it makes to other public
+ * methods or the blocks a thread cache gives back to the pool
+ */
+class ProcessPool::TraceScope
+{
+public:
+    TraceScope() { depth++; }
+    ~TraceScope() { depth--; }
+
+    /**
+     * \return true if this is the outermost public method
+     */
+    bool outermost() const { return depth==1; }
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator= (const TraceScope&);
+
+    static thread_local unsigned int depth;
+};
+
+thread_local unsigned int ProcessPool::TraceScope::depth=0;
+#endif //PROCESS_POOL_TRACE
+
+#ifdef PROCESS_POOL_MAGAZINES
+#ifndef TEST_ALLOC
+typedef miosix::Lock<miosix::FastMutex> CacheLock;
+#else //TEST_ALLOC
+typedef lock_guard<mutex> CacheLock;
+#endif //TEST_ALLOC
+
+///Maximum number of blocks held by a magazine, that is for one size class
+static const unsigned int magazineCapacity=8;
+///Maximum number of bytes held by a thread cache, larger blocks are not cached
+static const size_t cacheByteLimit=256*1024;
+///Number of size classes, one per power of two
+static const unsigned int sizeClasses=32;
+
+/**
+ * Cache of the blocks recently deallocated by a thread, grouped by size class.
+ * Each size class has a magazine, a stack of blocks from which allocations of
+ * that class are served without taking any mutex. A full magazine gives half
+ * of its blocks back to the pool at once.
+ *
+ * The magazines are only touched by the thread that claimed the cache with a
+ * compare-and-swap on its state: the owner on every call, which never fails
+ * unless another thread is flushing the cache, or a thread flushing it while
+ * the owner is not using it. A flush that finds the cache in use leaves a
+ * request that the owner services on its next call.
+ */
+class ProcessPool::ThreadCache
+{
+public:
+    /**
+     * Constructor, registers the cache with the pool
+     * \param pool pool to which blocks are given back
+     */
+    ThreadCache(ProcessPool *pool);
+
+    /**
+     * Destructor, unregisters the cache and gives all blocks back to the pool
+     */
+    ~ThreadCache();
+
+    /**
+     * Called by the owner thread
+     * \param sizeClass size class of the requested block
+     * \return a cached block, or NULL if the magazine is empty
+     */
+    unsigned int *get(unsigned int sizeClass);
+
+    /**
+     * Called by the owner thread
+     * \param ptr block to cache
+     * \param sizeClass size class of the block
+     * \return false if the block could not be cached, and must be deallocated
+     */
+    bool put(unsigned int *ptr, unsigned int sizeClass);
+
+    /**
+     * Give all cached blocks back to the pool, or ask the owner to do so if
+     * it is using the cache. Can be called by any thread.
+     */
+    void flush();
+
+    ProcessPool *pool; ///< Pool of the cache, NULL once the pool is destroyed
+    ThreadCache *next; ///< Next cache registered with the pool
+
+    /**
+     * The caches of a thread, one per pool it used, deleted when it exits
+     */
+    class Owned
+    {
+    public:
+        Owned() : first(NULL) {}
+        ~Owned();
+
+        ThreadCache *first; ///< Most recently used cache
+    };
+
+    ThreadCache *nextOwned; ///< Next cache of the same thread
+
+private:
+    ThreadCache(const ThreadCache&);
+    ThreadCache& operator= (const ThreadCache&);
+
+    /**
+     * Claim the cache for the owner thread, servicing a pending flush
+     * \return false if another thread is flushing the cache
+     */
+    bool claim();
+
+    /**
+     * Give the cache back after claim()
+     */
+    void unclaim() { state.store(Idle,memory_order_release); }
+
+    /**
+     * Give all cached blocks back to the pool, the cache is claimed
+     */
+    void drain();
+
+    /**
+     * Give the oldest blocks of a magazine back to the pool
+     * \param sizeClass size class of the magazine
+     * \param count number of blocks
+     */
+    void spill(unsigned int sizeClass, unsigned int count);
+
+    ///Values of state
+    enum { Idle, Owner, Flushing };
+
+    unsigned int *magazines[sizeClasses][magazineCapacity]; ///< Cached blocks
+    unsigned int counts[sizeClasses]; ///< Number of blocks in each magazine
+    size_t bytes;                     ///< Bytes held by all magazines
+    atomic<unsigned char> state;      ///< Which thread is using the magazines
+    atomic<bool> flushRequested;      ///< Set by a flush that found the cache in use
+};
+
+ProcessPool::ThreadCache::ThreadCache(ProcessPool *pool)
+    : pool(pool), nextOwned(NULL), bytes(0), state(Idle), flushRequested(false)
+{
+    memset(counts,0,sizeof(counts));
+    CacheLock l(pool->cacheMutex);
+    next=pool->caches;
+    pool->caches=this;
+}
+
+ProcessPool::ThreadCache::~ThreadCache()
+{
+    if(pool==NULL) return; //The blocks went away with the pool
+    {
+        CacheLock l(pool->cacheMutex);
+        ThreadCache **it=&pool->caches;
+        while(*it!=this) it=&(*it)->next;
+        *it=next;
+    }
+    flush();
+}
+
+unsigned int *ProcessPool::ThreadCache::get(unsigned int sizeClass)
+{
+    if(sizeClass>=sizeClasses || claim()==false) return NULL;
+    unsigned int *result=NULL;
+    if(counts[sizeClass])
+    {
+        bytes-=static_cast<size_t>(1)<<sizeClass;
+        result=magazines[sizeClass][--counts[sizeClass]];
+    }
+    unclaim();
+    return result;
+}
+
+bool ProcessPool::ThreadCache::put(unsigned int *ptr, unsigned int sizeClass)
+{
+    if(sizeClass>=sizeClasses) return false;
+    size_t size=static_cast<size_t>(1)<<sizeClass;
+    if(size>cacheByteLimit || claim()==false) return false;
+    if(counts[sizeClass]==magazineCapacity) spill(sizeClass,magazineCapacity/2);
+    bool result=bytes+size<=cacheByteLimit;
+    if(result)
+    {
+        magazines[sizeClass][counts[sizeClass]++]=ptr;
+        bytes+=size;
+    }
+    unclaim();
+    return result;
+}
+
+void ProcessPool::ThreadCache::flush()
+{
+    unsigned char expected=Idle;
+    if(state.compare_exchange_strong(expected,Flushing,memory_order_acquire))
+    {
+        flushRequested.store(false,memory_order_relaxed);
+        drain();
+        state.store(Idle,memory_order_release);
+    } else flushRequested.store(true,memory_order_relaxed);
+}
+
+bool ProcessPool::ThreadCache::claim()
+{
+    unsigned char expected=Idle;
+    if(state.compare_exchange_strong(expected,Owner,memory_order_acquire)==false)
+        return false;
+    if(flushRequested.load(memory_order_relaxed))
+    {
+        flushRequested.store(false,memory_order_relaxed);
+        drain();
+    }
+    return true;
+}
+
+void ProcessPool::ThreadCache::drain()
+{
+    for(unsigned int i=0;i<sizeClasses;i++) if(counts[i]) spill(i,counts[i]);
+}
+
+void ProcessPool::ThreadCache::spill(unsigned int sizeClass, unsigned int count)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope; //The blocks were recorded when they were cached
+    #endif //PROCESS_POOL_TRACE
+    unsigned int **magazine=magazines[sizeClass];
+    pool->deallocateBatch(magazine,count);
+    //The most recently cached blocks stay, as they are the most likely to be hot
+    for(unsigned int i=count;i<counts[sizeClass];i++) magazine[i-count]=magazine[i];
+    counts[sizeClass]-=count;
+    bytes-=static_cast<size_t>(count)<<sizeClass;
+}
+
+ProcessPool::ThreadCache::Owned::~Owned()
+{
+    while(first)
+    {
+        ThreadCache *cache=first;
+        first=cache->nextOwned;
+        delete cache;
+    }
+}
+
+unsigned int ProcessPool::sizeClass(size_t size)
+{
+    unsigned int result=0;
+    while(result<sizeClasses-1 && (static_cast<size_t>(1)<<result)<size) result++;
+    return (static_cast<size_t>(1)<<result)<size ? sizeClasses : result;
+}
+
+ProcessPool::ThreadCache& ProcessPool::threadCache()
+{
+    static thread_local ThreadCache::Owned owned;
+    ThreadCache *cache=owned.first;
+    if(cache && cache->pool==this) return *cache;
+    //Look for the cache of this pool and move it first, or create it
+    ThreadCache **it=&owned.first;
+    while(*it && (*it)->pool!=this) it=&(*it)->nextOwned;
+    if(*it)
+    {
+        cache=*it;
+        *it=cache->nextOwned;
+    } else cache=new ThreadCache(this);
+    cache->nextOwned=owned.first;
+    owned.first=cache;
+    return *cache;
+}
+#endif //PROCESS_POOL_MAGAZINES
+
 ProcessPool& ProcessPool::instance()
 {
     #ifndef TEST_ALLOC
@@ -55,35 +487,76 @@ ProcessPool& ProcessPool::instance()
     extern unsigned int _process_pool_end asm("_process_pool_end");
     #ifndef BMA
     static ProcessPool pool(&_process_pool_start,
-        reinterpret_cast<unsigned int>(&_process_pool_end)-
-        reinterpret_cast<unsigned int>(&_process_pool_start));
+        reinterpret_cast<uintptr_t>(&_process_pool_end)-
+        reinterpret_cast<uintptr_t>(&_process_pool_start));
     return pool;
     #else //BMA
     extern unsigned int _process_pool_alignment asm("_process_pool_alignment");
     static ProcessPool pool(&_process_pool_start,
-        reinterpret_cast<unsigned int>(&_process_pool_end)-
-        reinterpret_cast<unsigned int>(&_process_pool_start), 
-        _process_pool_alignment);
+        reinterpret_cast<uintptr_t>(&_process_pool_end)-
+        reinterpret_cast<uintptr_t>(&_process_pool_start), 
+        _process_pool_alignment, false);
     return pool;
     #endif //BMA
     #else //TEST_ALLOC
 
     #ifndef BMA
-    static ProcessPool pool(reinterpret_cast<unsigned int*>(0x20008000),96*1024);
+    static ProcessPool pool(reinterpret_cast<unsigned int*>(TEST_ALLOC_POOL_BASE),
+        TEST_ALLOC_POOL_SIZE);
     return pool;
     #else //BMA
-    static ProcessPool pool(reinterpret_cast<unsigned int*>(0x20008000),1024,128, false);
+    static ProcessPool pool(reinterpret_cast<unsigned int*>(TEST_ALLOC_POOL_BASE),
+        TEST_ALLOC_POOL_SIZE, TEST_ALLOC_POOL_ALIGNMENT, false);
     return pool;
     #endif //BMA
 
     #endif //TEST_ALLOC
 }
     
-pair<unsigned int *, unsigned int> ProcessPool::allocate(unsigned int size)
+pair<unsigned int *, size_t> ProcessPool::allocate(size_t size)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost())
+    {
+        try {
+            pair<unsigned int *, size_t> result=allocateUntraced(size);
+            trace(TraceAllocate,size,NULL,result.first);
+            return result;
+        } catch(bad_alloc&) {
+            trace(TraceAllocate,size,NULL,NULL);
+            throw;
+        }
+    }
+    #endif //PROCESS_POOL_TRACE
+    return allocateUntraced(size);
+}
+
+pair<unsigned int *, size_t> ProcessPool::allocateUntraced(size_t size)
+{
+    size=roundSize(size);
+
+    #ifdef PROCESS_POOL_MAGAZINES
+    unsigned int *cached=threadCache().get(sizeClass(size));
+    if(cached) return make_pair(cached,size);
+    try {
+        return allocateFromPool(size);
+    } catch(bad_alloc&) {
+        //Blocks held in the thread caches may be enough to satisfy the request
+        flushCaches();
+    }
+    #endif //PROCESS_POOL_MAGAZINES
+    return allocateFromPool(size);
+}
+
+size_t ProcessPool::roundSize(size_t size)
 {
     #ifndef TEST_ALLOC
-    miosix::Lock<miosix::FastMutex> l(mutex);
+    #ifndef BMA
     size=MPUConfiguration::roundSizeForMPU(max(size,blockSize));
+    #else //BMA
+    size=MPUConfiguration::roundSizeForMPU(max(size,alignment));
+    #endif //BMA
     #else //TEST_ALLOC
     #ifndef BMA
     //Size adjustment not supported during test_alloc due to missing mpu header
@@ -91,95 +564,471 @@ pair<unsigned int *, unsigned int> ProcessPool::allocate(unsigned int size)
             throw runtime_error("ProcessPool::allocate unsupported size");
     #endif //BMA
     #endif //TEST_ALLOC
+    return size;
+}
+
+pair<unsigned int *, size_t> ProcessPool::allocateFromPool(size_t size)
+{
+    #ifndef BMA
+    #ifndef TEST_ALLOC
+    miosix::Lock<miosix::FastMutex> l(mutex);
+    #endif //TEST_ALLOC
+    return allocateUnlocked(size);
+    #else //BMA
+    //Try the home shard first, then steal from the others
+    unsigned int home=homeShard();
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
+    {
+        Shard& shard=shards[(home+i) % PROCESS_POOL_SHARDS];
+        if(size>shard.maxBlock) continue;
+        #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+        miosix::Lock<miosix::FastMutex> l(shard.mutex);
+        #endif //TEST_ALLOC, BUDDY_CONCURRENT
+        void *result=buddyMalloc(shard.buddy,size);
+        if(result) return make_pair(reinterpret_cast<unsigned int*>(result),size);
+    }
+    throw bad_alloc();
+    #endif //BMA
+}
+
+#ifdef BMA
+unsigned int ProcessPool::homeShard()
+{
+    if(PROCESS_POOL_SHARDS==1) return 0;
+    #if defined(TEST_ALLOC) && defined(__linux__)
+    //On the host threads running on the same core share their home shard
+    int cpu=sched_getcpu();
+    if(cpu>=0) return cpu % PROCESS_POOL_SHARDS;
+    #endif //TEST_ALLOC, __linux__
+    //Otherwise home shards are given to threads round robin on first use
+    static atomic<unsigned int> nextShard(0);
+    static thread_local unsigned int home=nextShard++ % PROCESS_POOL_SHARDS;
+    return home;
+}
+
+ProcessPool::Shard *ProcessPool::shardOf(unsigned int *ptr)
+{
+    size_t offset=reinterpret_cast<uintptr_t>(ptr)-reinterpret_cast<uintptr_t>(poolBase);
+    if(ptr<poolBase || offset>=poolSize) return NULL;
+    return &shards[min<size_t>(offset/shardSize,PROCESS_POOL_SHARDS-1u)];
+}
+#endif //BMA
 
+#ifndef BMA
+pair<unsigned int *, size_t> ProcessPool::allocateUnlocked(size_t size)
+{
     if(size>poolSize) throw bad_alloc();
     
+    //Slots are aligned to their size in the address space, so the first free
+    //slot is the lowest address where the block satisfies the MPU constraints
+    unsigned int order=0;
+    while((blockSize<<order)<size) order++;
+    if(order>=slotOrders) throw bad_alloc();
+    size_t slot=slots[order].findFirst();
+    if(slot==SlotBitmap::notFound) throw bad_alloc();
+    markUsed(slot<<order,order);
+    size_t firstBit=(slot<<order)-slotOrigin;
+    blockOrders[firstBit]=order+1;
+    unsigned int *result=poolBase+firstBit*blockSize/sizeof(unsigned int);
+    return make_pair(result,size);
+}
+
+void ProcessPool::markUsed(size_t first, unsigned int order)
+{
+    for(unsigned int k=0;k<=order;k++) slots[k].clearRange(first>>k,static_cast<size_t>(1)<<(order-k));
+    //The larger slots containing the run are no longer free
+    for(unsigned int k=order+1;k<slotOrders;k++)
+    {
+        if(slots[k].test(first>>k)==false) break;
+        slots[k].clearRange(first>>k,1);
+    }
+}
+
+void ProcessPool::markFree(size_t first, unsigned int order)
+{
+    for(unsigned int k=0;k<=order;k++) slots[k].setRange(first>>k,static_cast<size_t>(1)<<(order-k));
+    //A larger slot is free when both its halves are
+    for(unsigned int k=order+1;k<slotOrders;k++)
+    {
+        if(slots[k-1].test((first>>(k-1))^1)==false) break;
+        slots[k].setRange(first>>k,1);
+    }
+}
+#endif //BMA
+
+void ProcessPool::deallocate(unsigned int *ptr)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost()) trace(TraceDeallocate,0,ptr,NULL);
+    #endif //PROCESS_POOL_TRACE
     #ifndef BMA
-    unsigned int offset=0;
-    if(reinterpret_cast<unsigned int>(poolBase) % size)
-        offset=size-(reinterpret_cast<unsigned int>(poolBase) % size);
-    unsigned int startBit=offset/blockSize;
-    unsigned int sizeBit=size/blockSize;
+    #ifndef TEST_ALLOC
+    miosix::Lock<miosix::FastMutex> l(mutex);
+    #endif //TEST_ALLOC
+    deallocateUnlocked(ptr);
+    #else //BMA
+    Shard *shard=shardOf(ptr);
+    if(shard==NULL) return; //Like buddy_dealloc, ignore pointers not in the pool
+    #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+    miosix::Lock<miosix::FastMutex> l(shard->mutex);
+    #endif //TEST_ALLOC, BUDDY_CONCURRENT
+    buddyDealloc(shard->buddy,ptr);
+    #endif //BMA
+}
 
-    for(unsigned int i=startBit;i<=poolSize/blockSize;i+=sizeBit)
+void ProcessPool::allocateBatch(size_t *sizes, unsigned int **blocks, unsigned int count)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost())
     {
-        bool notEmpty=false;
-        for(unsigned int j=0;j<sizeBit;j++)
-        {
-            if(testBit(i+j)==0) continue;
-            notEmpty=true;
-            break;
+        try {
+            allocateBatchUntraced(sizes,blocks,count);
+        } catch(bad_alloc&) {
+            traceBatch(TraceAllocate,sizes,NULL,NULL,count);
+            throw;
+        }
+        traceBatch(TraceAllocate,sizes,NULL,blocks,count);
+        return;
+    }
+    #endif //PROCESS_POOL_TRACE
+    allocateBatchUntraced(sizes,blocks,count);
+}
+
+void ProcessPool::allocateBatchUntraced(size_t *sizes, unsigned int **blocks, unsigned int count)
+{
+    for(unsigned int i=0;i<count;i++) sizes[i]=roundSize(sizes[i]);
+
+    #ifndef BMA
+    {
+        #ifndef TEST_ALLOC
+        miosix::Lock<miosix::FastMutex> l(mutex);
+        #endif //TEST_ALLOC
+        unsigned int i=0;
+        try {
+            for(;i<count;i++) blocks[i]=allocateUnlocked(sizes[i]).first;
+            return;
+        } catch(bad_alloc&) {
+            for(unsigned int j=0;j<i;j++) deallocateUnlocked(blocks[j]);
         }
-        if(notEmpty) continue;
-        
-        for(unsigned int j=0;j<sizeBit;j++) setBit(i+j);
-        unsigned int *result=poolBase+i*blockSize/sizeof(unsigned int);
-        allocatedBlocks[result]=size;
-        return make_pair(result,size);
     }
     #else //BMA
-    unsigned int *result = reinterpret_cast<unsigned int*>(buddy_malloc(buddy, (size_t)size));
-    return make_pair(result, size);
+    //Try to fit the whole batch in a shard, starting from the home one
+    unsigned int home=homeShard();
+    for(unsigned int s=0;s<PROCESS_POOL_SHARDS;s++)
+    {
+        Shard& shard=shards[(home+s) % PROCESS_POOL_SHARDS];
+        #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+        miosix::Lock<miosix::FastMutex> l(shard.mutex);
+        #endif //TEST_ALLOC, BUDDY_CONCURRENT
+        unsigned int i=0;
+        for(;i<count;i++)
+        {
+            if(sizes[i]>shard.maxBlock) break;
+            blocks[i]=reinterpret_cast<unsigned int*>(buddyMalloc(shard.buddy,sizes[i]));
+            if(blocks[i]==NULL) break;
+        }
+        if(i==count) return;
+        buddyDeallocBatch(shard.buddy,reinterpret_cast<void**>(blocks),i);
+    }
     #endif //BMA
-    throw bad_alloc();
+
+    //Fall back to allocating blocks one by one, possibly from different
+    //shards or from the thread caches
+    for(unsigned int i=0;i<count;i++)
+    {
+        try {
+            blocks[i]=allocate(sizes[i]).first;
+        } catch(bad_alloc&) {
+            deallocateBatch(blocks,i);
+            throw;
+        }
+    }
 }
 
-void ProcessPool::deallocate(unsigned int *ptr)
+void ProcessPool::deallocateBatch(unsigned int **blocks, unsigned int count)
 {
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost()) traceBatch(TraceDeallocate,NULL,blocks,NULL,count);
+    #endif //PROCESS_POOL_TRACE
     #ifndef BMA
     #ifndef TEST_ALLOC
     miosix::Lock<miosix::FastMutex> l(mutex);
     #endif //TEST_ALLOC
-    map<unsigned int*, unsigned int>::iterator it= allocatedBlocks.find(ptr);
-    if(it==allocatedBlocks.end())
-    #ifndef TEST_ALLOC
-        errorHandler(UNEXPECTED);
-    #else //TEST_ALLOC
-        throw runtime_error("ProcessPool::deallocate corrupted pointer");
-    #endif //TEST_ALLOC
-    unsigned int size =(it->second)/blockSize;
-    unsigned int firstBit=(reinterpret_cast<unsigned int>(ptr)-
-                           reinterpret_cast<unsigned int>(poolBase))/blockSize;
-    for(unsigned int i=firstBit;i<firstBit+size;i++) clearBit(i);
-    allocatedBlocks.erase(it);
+    for(unsigned int i=0;i<count;i++) deallocateUnlocked(blocks[i]);
     #else //BMA
-    buddy_dealloc(buddy, (void *)ptr);
+    //Once sorted, the blocks of each shard are contiguous
+    sort(blocks,blocks+count);
+    for(unsigned int i=0;i<count;)
+    {
+        Shard *shard=shardOf(blocks[i]);
+        if(shard==NULL) { i++; continue; }
+        unsigned int j=i+1;
+        while(j<count && shardOf(blocks[j])==shard) j++;
+        #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+        miosix::Lock<miosix::FastMutex> l(shard->mutex);
+        #endif //TEST_ALLOC, BUDDY_CONCURRENT
+        buddyDeallocBatch(shard->buddy,reinterpret_cast<void**>(blocks+i),j-i);
+        i=j;
+    }
     #endif //BMA
 }
 
-#ifdef BMA
-unsigned int* ProcessPool::reallocate(unsigned int *ptr, unsigned int newSize)
+#ifdef PROCESS_POOL_MAGAZINES
+void ProcessPool::deallocate(unsigned int *ptr, size_t size)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost()) trace(TraceDeallocate,0,ptr,NULL);
+    #endif //PROCESS_POOL_TRACE
+    if(threadCache().put(ptr,sizeClass(size))==false) deallocate(ptr);
+}
+
+void ProcessPool::flushThreadCache()
+{
+    threadCache().flush();
+}
+
+void ProcessPool::flushCaches()
 {
-    return reinterpret_cast<unsigned int*>(buddy_realloc(buddy, (void *)ptr, (size_t)newSize));
+    CacheLock l(cacheMutex);
+    for(ThreadCache *cache=caches;cache;cache=cache->next) cache->flush();
 }
+#endif //PROCESS_POOL_MAGAZINES
+
+#ifndef BMA
+void ProcessPool::deallocateUnlocked(unsigned int *ptr)
+{
+    size_t offset=reinterpret_cast<uintptr_t>(ptr)-reinterpret_cast<uintptr_t>(poolBase);
+    size_t firstBit=offset/blockSize;
+    if(ptr<poolBase || offset>=poolSize || offset % blockSize || blockOrders[firstBit]==0)
+    {
+        #ifndef TEST_ALLOC
+        errorHandler(UNEXPECTED);
+        return;
+        #else //TEST_ALLOC
+        throw runtime_error("ProcessPool::deallocate corrupted pointer");
+        #endif //TEST_ALLOC
+    }
+    markFree(firstBit+slotOrigin,blockOrders[firstBit]-1);
+    blockOrders[firstBit]=0;
+}
+#else //BMA
+unsigned int* ProcessPool::reallocate(unsigned int *ptr, size_t newSize)
+{
+    #ifdef PROCESS_POOL_TRACE
+    TraceScope scope;
+    if(scope.outermost())
+    {
+        unsigned int *result=reallocateUntraced(ptr,newSize);
+        trace(TraceReallocate,newSize,ptr,result);
+        return result;
+    }
+    #endif //PROCESS_POOL_TRACE
+    return reallocateUntraced(ptr,newSize);
+}
+
+unsigned int* ProcessPool::reallocateUntraced(unsigned int *ptr, size_t newSize)
+{
+    Shard *shard=ptr ? shardOf(ptr) : &shards[homeShard()];
+    if(shard==NULL) return NULL;
+    if(newSize<=shard->maxBlock)
+    {
+        #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+        miosix::Lock<miosix::FastMutex> l(shard->mutex);
+        #endif //TEST_ALLOC, BUDDY_CONCURRENT
+        void *result=buddyRealloc(shard->buddy,ptr,newSize);
+        if(result || newSize==0) return reinterpret_cast<unsigned int*>(result);
+    }
+    //The owning shard is full or cannot align the block, move it to another one
+    for(unsigned int i=1;i<PROCESS_POOL_SHARDS;i++)
+    {
+        Shard& other=shards[(shard-shards+i) % PROCESS_POOL_SHARDS];
+        if(newSize>other.maxBlock) continue;
+        void *result;
+        {
+            #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+            miosix::Lock<miosix::FastMutex> l(other.mutex);
+            #endif //TEST_ALLOC, BUDDY_CONCURRENT
+            result=buddyMalloc(other.buddy,newSize);
+        }
+        if(result==NULL) continue;
+        if(ptr) deallocate(ptr);
+        return reinterpret_cast<unsigned int*>(result);
+    }
+    return NULL;
+}
+
+struct buddy_stats ProcessPool::stats()
+{
+    struct buddy_stats result;
+    memset(&result,0,sizeof(result));
+    unsigned long long weightedFragmentation=0;
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
+    {
+        struct buddy_stats s;
+        {
+            #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+            miosix::Lock<miosix::FastMutex> l(shards[i].mutex);
+            #endif //TEST_ALLOC, BUDDY_CONCURRENT
+            buddyStats(shards[i].buddy,&s);
+        }
+        result.total_bytes+=s.total_bytes;
+        result.free_bytes+=s.free_bytes;
+        result.allocated_blocks+=s.allocated_blocks;
+        for(unsigned int j=0;j<sizeof(s.allocated_blocks_per_order)/sizeof(size_t);j++)
+            result.allocated_blocks_per_order[j]+=s.allocated_blocks_per_order[j];
+        s.largest_free_block=min(s.largest_free_block,shards[i].maxBlock);
+        if(s.largest_free_block>result.largest_free_block)
+            result.largest_free_block=s.largest_free_block;
+        weightedFragmentation+=static_cast<unsigned long long>(s.fragmentation)*s.free_bytes;
+    }
+    //Each shard is a separate arena, weight its fragmentation by its free space
+    if(result.free_bytes)
+        result.fragmentation=weightedFragmentation/result.free_bytes;
+    return result;
+}
+
+#ifndef BUDDY_CONCURRENT
+void ProcessPool::setPolicy(enum buddy_policy policy, size_t threshold)
+{
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
+    {
+        #ifndef TEST_ALLOC
+        miosix::Lock<miosix::FastMutex> l(shards[i].mutex);
+        #endif //TEST_ALLOC
+        buddy_set_policy(shards[i].buddy,policy,threshold);
+    }
+}
+
+///Largest number of blocks relocated by defragment()
+static const unsigned int defragMaxMoves=16;
+
+/**
+ * Callbacks of defragment(), to adapt movable to buddy_defrag_plan()
+ */
+struct DefragCallbacks
+{
+    bool (*movable)(unsigned int *block, void *context);
+    void *context;
+};
+
+static int defragMovable(void *block, void *context)
+{
+    DefragCallbacks *callbacks=static_cast<DefragCallbacks*>(context);
+    return callbacks->movable(reinterpret_cast<unsigned int*>(block),callbacks->context);
+}
+
+bool ProcessPool::defragment(size_t size,
+                             bool (*movable)(unsigned int *block, void *context),
+                             void (*relocate)(unsigned int *from, unsigned int *to,
+                                              size_t size, void *context),
+                             void *context)
+{
+    size=roundSize(size);
+    #ifdef PROCESS_POOL_MAGAZINES
+    //Cached blocks are free for the pool, do not relocate them
+    flushCaches();
+    #endif //PROCESS_POOL_MAGAZINES
+    DefragCallbacks callbacks={movable,context};
+    unsigned int home=homeShard();
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
+    {
+        Shard& shard=shards[(home+i) % PROCESS_POOL_SHARDS];
+        if(size>shard.maxBlock) continue;
+        #ifndef TEST_ALLOC
+        miosix::Lock<miosix::FastMutex> l(shard.mutex);
+        #endif //TEST_ALLOC
+        struct buddy_move moves[defragMaxMoves];
+        size_t count=buddy_defrag_plan(shard.buddy,size,moves,defragMaxMoves,
+                                       movable ? defragMovable : NULL,&callbacks);
+        if(count==SIZE_MAX) continue;
+        for(size_t j=0;j<count;j++)
+            relocate(reinterpret_cast<unsigned int*>(moves[j].from),
+                     reinterpret_cast<unsigned int*>(moves[j].to),moves[j].size,context);
+        buddy_defrag_apply(shard.buddy,moves,count);
+        return true;
+    }
+    return false;
+}
+#endif //BUDDY_CONCURRENT
 #endif //BMA
 
 #ifndef BMA
-ProcessPool::ProcessPool(unsigned int *poolBase, unsigned int poolSize)
+ProcessPool::ProcessPool(unsigned int *poolBase, size_t poolSize)
     : poolBase(poolBase), poolSize(poolSize)
 {
-    int numBytes=poolSize/blockSize/8;
-    bitmap=new unsigned int[numBytes/sizeof(unsigned int)];
-    memset(bitmap,0,numBytes);
+    #ifdef PROCESS_POOL_MAGAZINES
+    caches=NULL;
+    #endif //PROCESS_POOL_MAGAZINES
+    #ifdef PROCESS_POOL_TRACE
+    traceSink=NULL;
+    traceContext=NULL;
+    traceCount=0;
+    #endif //PROCESS_POOL_TRACE
+    size_t blocks=poolSize/blockSize;
+    blockOrders=new unsigned char[blocks];
+    memset(blockOrders,0,blocks);
+    //The slots start at an address aligned to the largest block that fits
+    //in the pool, blocks before poolBase and after its end are never free
+    slotOrders=1;
+    while(blocks>>slotOrders) slotOrders++;
+    size_t largest=static_cast<size_t>(1)<<(slotOrders-1);
+    slotOrigin=reinterpret_cast<uintptr_t>(poolBase)/blockSize % largest;
+    size_t span=(slotOrigin+blocks+largest-1)/largest*largest;
+    slots=new SlotBitmap[slotOrders];
+    for(unsigned int k=0;k<slotOrders;k++) slots[k].init(span>>k);
+    //Free the pool as the largest aligned runs that fit in it
+    for(size_t first=slotOrigin;first<slotOrigin+blocks;)
+    {
+        unsigned int order=0;
+        while(order+1<slotOrders && first % (static_cast<size_t>(2)<<order)==0 &&
+              first+(static_cast<size_t>(2)<<order)<=slotOrigin+blocks) order++;
+        markFree(first,order);
+        first+=static_cast<size_t>(1)<<order;
+    }
 }
 #else //BMA
-ProcessPool::ProcessPool(unsigned int *poolBase, unsigned int poolSize, unsigned int alignment, bool embedded)
+ProcessPool::ProcessPool(unsigned int *poolBase, size_t poolSize, size_t alignment, bool embedded)
     : poolBase(poolBase), poolSize(poolSize), alignment(alignment), embedded(embedded)
 {
-    //Separate metadata and arena for buddy allocator
-    if(!embedded)
+    #ifdef PROCESS_POOL_MAGAZINES
+    caches=NULL;
+    #endif //PROCESS_POOL_MAGAZINES
+    #ifdef PROCESS_POOL_TRACE
+    traceSink=NULL;
+    traceContext=NULL;
+    traceCount=0;
+    #endif //PROCESS_POOL_TRACE
+    //Shards are a power of two in size, so if poolBase is aligned to it
+    //every shard starts aligned to the largest block it can hold
+    size_t largest=alignment;
+    while(largest*2<=poolSize/PROCESS_POOL_SHARDS) largest*=2;
+    shardSize=largest<=poolSize/PROCESS_POOL_SHARDS ? largest : 0;
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
     {
-        buddy_metadata =(unsigned int *)malloc(buddy_sizeof_alignment((size_t)poolSize, (size_t)alignment));
-        buddy = buddy_init_alignment((unsigned char *)buddy_metadata, (unsigned char *)poolBase, (size_t)poolSize, (size_t)alignment);
-        if(buddy == NULL)
+        Shard& shard=shards[i];
+        shard.base=poolBase+i*(shardSize/sizeof(unsigned int));
+        shard.size=i<PROCESS_POOL_SHARDS-1 ? shardSize : poolSize-i*shardSize;
+        //A buddy aligns blocks relative to the start of its arena, larger
+        //blocks than the alignment of the start would break the MPU contract
+        uintptr_t start=reinterpret_cast<uintptr_t>(shard.base);
+        shard.maxBlock=alignment;
+        while(shard.maxBlock*2<=shard.size && start % (shard.maxBlock*2)==0) shard.maxBlock*=2;
+        shard.buddy_metadata=NULL;
+        //Separate metadata and arena for buddy allocator
+        if(!embedded)
         {
-            free(buddy_metadata);
-            throw 1;
+            shard.buddy_metadata=(unsigned int *)malloc(buddySizeof(shard.size, alignment));
+            shard.buddy=buddyInit((unsigned char *)shard.buddy_metadata, (unsigned char *)shard.base, shard.size, alignment);
+        }else{ //Embedded buddy allocator
+            shard.buddy=buddyEmbed((unsigned char *)shard.base, shard.size, alignment);
         }
-    }else{ //Embedded buddy allocator
-        buddy = buddy_embed_alignment((unsigned char *)poolBase, (size_t)poolSize, (size_t)alignment);
-        if(buddy == NULL)
+        if(shard.buddy == NULL)
         {
+            for(unsigned int j=0;j<=i;j++) free(shards[j].buddy_metadata);
             throw 1;
         }
     }
@@ -188,55 +1037,130 @@ ProcessPool::ProcessPool(unsigned int *poolBase, unsigned int poolSize, unsigned
 
 ProcessPool::~ProcessPool()
 {
+    #ifdef PROCESS_POOL_MAGAZINES
+    {
+        //The caches are deleted by their threads, detach them from the pool
+        CacheLock l(cacheMutex);
+        for(ThreadCache *cache=caches;cache;cache=cache->next) cache->pool=NULL;
+    }
+    #endif //PROCESS_POOL_MAGAZINES
     #ifndef BMA
-    delete[] bitmap;
+    delete[] slots;
+    delete[] blockOrders;
     #else //BMA
     if(!embedded){
-        free(buddy_metadata);
+        for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++) free(shards[i].buddy_metadata);
     }
     #endif //BMA
 }
 
+#ifdef PROCESS_POOL_TRACE
+void ProcessPool::startTrace(TraceSink sink, void *context)
+{
+    TraceLock l(traceMutex);
+    if(traceSink) flushTrace();
+    TraceHeader header;
+    memcpy(header.magic,"PPTR",sizeof(header.magic));
+    header.version=TraceVersion;
+    header.poolSize=poolSize;
+    #ifndef BMA
+    header.alignment=blockSize;
+    #else //BMA
+    header.alignment=alignment;
+    #endif //BMA
+    traceSink=sink;
+    traceContext=context;
+    traceCount=0;
+    if(traceSink) traceSink(&header,sizeof(header),traceContext);
+}
+
+void ProcessPool::stopTrace()
+{
+    TraceLock l(traceMutex);
+    if(traceSink==NULL) return;
+    flushTrace();
+    traceSink=NULL;
+}
+
+void ProcessPool::trace(unsigned char op, size_t size, unsigned int *block,
+                        unsigned int *result)
+{
+    traceBatch(op,&size,&block,&result,1);
+}
+
+void ProcessPool::traceBatch(unsigned char op, const size_t *sizes,
+                             unsigned int * const *blocks, unsigned int * const *results,
+                             unsigned int count)
+{
+    TraceLock l(traceMutex);
+    if(traceSink==NULL) return;
+    auto offset=[this](unsigned int *ptr) -> uint64_t
+    {
+        if(ptr==NULL) return TraceNone;
+        return static_cast<uint64_t>(ptr-poolBase)*sizeof(unsigned int);
+    };
+    for(unsigned int i=0;i<count;i++)
+    {
+        TraceRecord& record=traceBuffer[traceCount];
+        record.op=op;
+        record.flags=i+1<count ? TraceBatch : 0;
+        memset(record.reserved,0,sizeof(record.reserved));
+        record.size=sizes ? sizes[i] : 0;
+        record.block=offset(blocks ? blocks[i] : NULL);
+        record.result=offset(results ? results[i] : NULL);
+        if(++traceCount==traceBufferSize) flushTrace();
+    }
+}
+
+void ProcessPool::flushTrace()
+{
+    if(traceCount) traceSink(traceBuffer,traceCount*sizeof(TraceRecord),traceContext);
+    traceCount=0;
+}
+#endif //PROCESS_POOL_TRACE
+
 #ifdef TEST_ALLOC
 void ProcessPool::printAllocatedBlocks()
 {
     #ifdef BMA
-    buddy_debug(buddy);
+    for(unsigned int i=0;i<PROCESS_POOL_SHARDS;i++)
+    {
+        if(PROCESS_POOL_SHARDS>1) cout<<"Shard "<<i<<" @ "<<shards[i].base<<endl;
+        buddyDebug(shards[i].buddy);
+    }
     
     #else //BMA
     using namespace std;
-    map<unsigned int*, unsigned int>::iterator it;
     cout<<endl;
-    for(it=allocatedBlocks.begin();it!=allocatedBlocks.end();it++)
-        cout <<"block of size " << it->second
-                << " allocated @ " << it->first<<endl;
+    for(size_t i=0;i<poolSize/blockSize;i++)
+    {
+        if(blockOrders[i]==0) continue;
+        cout <<"block of size " << (blockSize<<(blockOrders[i]-1))
+                << " allocated @ " << poolBase+i*blockSize/sizeof(unsigned int)<<endl;
+    }
     
     cout<<"Bitmap:"<<endl;
-    const int SHIFT = 8 * sizeof(unsigned int);
-    const unsigned int MASK = 1 << (SHIFT-1);
-    int bitarray[32];
-    for(int i=0; i<(poolSize/blockSize)/(sizeof(unsigned int)*8);i++)
-    {   
-        int value=bitmap[i];
-        for ( int j = 0; j < SHIFT; j++ ) 
-        {
-            bitarray[31-j]= ( value & MASK ? 1 : 0 );
-            value <<= 1;
-        }
-        for(int j=0;j<32;j++)
-            cout<<bitarray[j];
-        cout << endl;
-    }  
+    for(size_t i=0;i<poolSize/blockSize;i++)
+    {
+        cout<<(slots[0].test(slotOrigin+i) ? 0 : 1);
+        if(i % 32==31) cout<<endl;
+    }
+    if((poolSize/blockSize) % 32) cout<<endl;
     #endif //BMA
 }
 #endif //Test_alloc
 } //namespace miosix
 
-#ifdef TEST_ALLOC
+#if defined(TEST_ALLOC) && !defined(TEST_ALLOC_NO_MAIN)
 
 
 
-//g++ -m32 -o pp -DTEST_ALLOC -DWITH_PROCESSES -DBMA process_pool.cpp buddy_allocator.cpp && ./pp
+//g++ -o pp -DTEST_ALLOC -DWITH_PROCESSES -DBMA process_pool.cpp buddy_allocator.cpp && ./pp
+//Add -m32 to test the pool as built for a 32 bit target
+//Add -DBUDDY_CONCURRENT and buddy_concurrent.cpp to test the lock-free allocator
+//Add -DPROCESS_POOL_SHARDS=2 to split the pool in two shards
+//Add -DTEST_ALLOC_NO_MAIN to link the pool with another program, such as
+//process_pool_bench.cpp
 int main()
 {
     using namespace miosix;
@@ -244,7 +1168,7 @@ int main()
     while(1)
     {
         cout<<"a <size(exponent)> |d <addr> |r <addr> <size(exponent)>"<<endl;
-        unsigned int param;
+        uintptr_t param;
         char op;
         string line;
         getline(cin,line);
@@ -255,7 +1179,7 @@ int main()
             case 'a':
                 ss>>dec>>param;
                 try {
-                    pool.allocate(1<<param);
+                    pool.allocate(static_cast<size_t>(1)<<param);
                 } catch(exception& e) {
                     cout<<typeid(e).name();
                 }
@@ -270,8 +1194,10 @@ int main()
                 }
                 pool.printAllocatedBlocks();
                 break;
+            #ifdef BMA
             case 'r':
-                unsigned int addr, size;
+                uintptr_t addr;
+                size_t size;
                 ss>>hex>>addr>>dec>>size;
                 try {
                     pool.reallocate(reinterpret_cast<unsigned int*>(addr), size);
@@ -280,12 +1206,13 @@ int main()
                 }
                 pool.printAllocatedBlocks();
                 break;
+            #endif //BMA
             default:
                 cout<<"Incorrect option"<<endl;
                 break;
         }
     }
 }
-#endif //TEST_ALLOC
+#endif //TEST_ALLOC, TEST_ALLOC_NO_MAIN
 
 #endif //WITH_PROCESSES
@@ -27,8 +27,9 @@
 
 #pragma once
 
-#include <map>
 #include <utility>
+#include <cstddef>
+#include <cstdint>
 
 #ifndef TEST_ALLOC
 #include <miosix.h>
@@ -36,12 +37,43 @@
 #include <iostream>
 #include <typeinfo>
 #include <sstream>
+#if defined(PROCESS_POOL_TRACE) || defined(PROCESS_POOL_MAGAZINES)
+#include <mutex>
+#endif //PROCESS_POOL_TRACE, PROCESS_POOL_MAGAZINES
 #endif //TEST_ALLOC
 
 #ifdef BMA
+#ifndef BUDDY_CONCURRENT
 #include "buddy_allocator.h" 
+#else //BUDDY_CONCURRENT
+#include "buddy_concurrent.h"
+#endif //BUDDY_CONCURRENT
+#ifndef PROCESS_POOL_SHARDS
+///Number of independent buddy arenas the pool is split into
+#define PROCESS_POOL_SHARDS 1
+#endif //PROCESS_POOL_SHARDS
 #endif
 
+#ifdef TEST_ALLOC
+///Address of the pool when testing on the host, it is never dereferenced.
+///It is aligned so that the BMA shards can hand out blocks up to their size
+#ifndef TEST_ALLOC_POOL_BASE
+#define TEST_ALLOC_POOL_BASE 0x20000000
+#endif //TEST_ALLOC_POOL_BASE
+///Size of the pool when testing on the host, in bytes
+#ifndef TEST_ALLOC_POOL_SIZE
+#ifndef BMA
+#define TEST_ALLOC_POOL_SIZE (96*1024)
+#else //BMA
+#define TEST_ALLOC_POOL_SIZE 1024
+#endif //BMA
+#endif //TEST_ALLOC_POOL_SIZE
+///Alignment of the pool blocks when testing on the host
+#ifndef TEST_ALLOC_POOL_ALIGNMENT
+#define TEST_ALLOC_POOL_ALIGNMENT 128
+#endif //TEST_ALLOC_POOL_ALIGNMENT
+#endif //TEST_ALLOC
+
 #ifdef WITH_PROCESSES
 
 namespace miosix {
@@ -49,6 +81,23 @@ namespace miosix {
 /**
  * This class allows to handle a memory area reserved for the allocation of
  * processes' images. This memory area is called process pool.
+ * When compiled with BMA and BUDDY_CONCURRENT the pool uses the lock-free
+ * buddy allocator, and allocate, deallocate and reallocate do not take the
+ * pool mutex.
+ * When compiled with BMA and PROCESS_POOL_SHARDS=N the pool is split into N
+ * shards, each one an independent buddy allocator with its own metadata and
+ * mutex. The shards are the largest power of two that fits N times in the
+ * pool, the last one also takes the remainder. Every thread allocates from
+ * its home shard, and steals from the other shards only when the home shard
+ * is out of memory.
+ * With BMA a buddy aligns blocks relative to the start of its shard, so a
+ * shard only hands out blocks up to the alignment of its start address, and
+ * poolBase should be aligned to the size of the shards, or of the pool when
+ * it is not sharded, for the largest blocks to be available.
+ * When compiled with PROCESS_POOL_TRACE the pool can record the operations
+ * done through its public methods, see startTrace().
+ * Sizes and block indices are size_t, so on a 64 bit host the pool can be
+ * larger than 4GB with both backends, see process_pool_large.cpp.
  */
 class ProcessPool
 {
@@ -70,7 +119,7 @@ public:
      * the returned pointer is aligned on a 16KB boundary.
      * \throws bad_alloc if out of memory
      */
-    std::pair<unsigned int *, unsigned int> allocate(unsigned int size);
+    std::pair<unsigned int *, size_t> allocate(size_t size);
     
     /**
      * Deallocate a memory block.
@@ -79,6 +128,51 @@ public:
      */
     void deallocate(unsigned int *ptr);
 
+    /**
+     * Allocate several memory blocks, taking the pool mutex once for all of
+     * them instead of once per block.
+     * \param sizes on input the requested size of each block, in bytes, on
+     * output the actual allocated size, as returned by allocate()
+     * \param blocks the pointers to the allocated memory are stored here
+     * \param count number of blocks
+     * \throws bad_alloc if out of memory, in which case no block is allocated
+     */
+    void allocateBatch(size_t *sizes, unsigned int **blocks, unsigned int count);
+
+    /**
+     * Deallocate several memory blocks, taking the pool mutex once for all of
+     * them instead of once per block.
+     * \param blocks pointers to deallocate, the array is reordered
+     * \param count number of pointers
+     */
+    void deallocateBatch(unsigned int **blocks, unsigned int count);
+
+    #ifdef PROCESS_POOL_MAGAZINES
+    /**
+     * Deallocate a memory block, keeping it in a cache of the calling thread
+     * so that a later allocation of the same size by the same thread reuses
+     * it without taking any mutex. The cache holds a bounded number of
+     * blocks per size and a bounded number of bytes, and gives blocks back
+     * to the pool in batches when it fills up.
+     * \param ptr pointer to deallocate.
+     * \param size size of the block, as returned by allocate()
+     */
+    void deallocate(unsigned int *ptr, size_t size);
+
+    /**
+     * Give the blocks cached by the calling thread back to the pool
+     */
+    void flushThreadCache();
+
+    /**
+     * Give the blocks cached by all threads back to the pool. Call it when
+     * the pool is under memory pressure. allocate() also calls it before
+     * failing. A thread that is using its cache at the same time gives its
+     * blocks back on its next allocation or deallocation instead.
+     */
+    void flushCaches();
+    #endif //PROCESS_POOL_MAGAZINES
+
     
     #ifdef BMA
     /*
@@ -90,7 +184,49 @@ public:
      * Unlike the C realloc, this reallocator does not copy data from the
      * previous block to the new one (unnecessary in this use case).
     */
-    unsigned int *reallocate(unsigned int *ptr, unsigned int requested_size);
+    unsigned int *reallocate(unsigned int *ptr, size_t requested_size);
+
+    /**
+     * Report the state of the pool, for example to check whether a process
+     * image fits before allocating it. With PROCESS_POOL_SHARDS>1 the fields
+     * are summed over the shards, largest_free_block is the largest block of
+     * any shard and fragmentation is the average of the shards weighted by
+     * their free space. Blocks cached with PROCESS_POOL_MAGAZINES count as
+     * allocated until flushCaches() is called.
+     * \return the statistics of the pool
+     */
+    struct buddy_stats stats();
+
+    #ifndef BUDDY_CONCURRENT
+    /**
+     * Select how the blocks are placed in the pool, see buddy_set_policy().
+     * \param policy placement policy of every shard
+     * \param threshold with BUDDY_POLICY_TWO_ENDED, blocks of at least this
+     * size in bytes are allocated from the high end of their shard
+     */
+    void setPolicy(enum buddy_policy policy, size_t threshold);
+
+    /**
+     * Make room for a block when the pool has enough free space, but no free
+     * block large enough, by relocating blocks such as the images of the
+     * suspended processes. The fewest moves are planned with
+     * buddy_defrag_plan(), relocate is called for each of them and then the
+     * pool is updated, all with the pool locked.
+     * \param size size in bytes of the block that has to fit
+     * \param movable returns true if block can be relocated, may be called
+     * more than once for the same block. NULL if every block can be relocated
+     * \param relocate copies size bytes from the old to the new address of a
+     * block and updates its owner
+     * \param context passed to the callbacks
+     * \return true if a block of size bytes can now be allocated, false if no
+     * relocation could make room for it
+     */
+    bool defragment(size_t size,
+                    bool (*movable)(unsigned int *block, void *context),
+                    void (*relocate)(unsigned int *from, unsigned int *to,
+                                     size_t size, void *context),
+                    void *context);
+    #endif //BUDDY_CONCURRENT
     #endif 
     
     #ifdef TEST_ALLOC
@@ -99,6 +235,74 @@ public:
      */
     void printAllocatedBlocks();
     #endif //TEST_ALLOC
+
+    ///Operations in a trace, see startTrace()
+    enum TraceOp
+    {
+        TraceAllocate=1,   ///< allocate(), or a block of allocateBatch()
+        TraceDeallocate=2, ///< deallocate(), or a block of deallocateBatch()
+        TraceReallocate=3  ///< reallocate()
+    };
+
+    ///Record flag, set if the next record belongs to the same batch
+    static const unsigned char TraceBatch=1;
+    ///Offset used in records for a NULL pointer or a failed allocation
+    static const uint64_t TraceNone=~static_cast<uint64_t>(0);
+    ///Current version of the trace format, version 2 widened sizes and
+    ///offsets to 64 bits
+    static const unsigned int TraceVersion=2;
+
+    /**
+     * A trace starts with this header, followed by the records. Fields are
+     * naturally aligned, so the layout is the same on 32 and 64 bit targets.
+     */
+    struct TraceHeader
+    {
+        char magic[4];          ///< "PPTR"
+        unsigned int version;   ///< TraceVersion
+        uint64_t poolSize;      ///< Size of the traced pool, in bytes
+        uint64_t alignment;     ///< Minimum block size of the traced pool
+    };
+
+    /**
+     * One operation. Blocks are given as byte offsets from the start of the
+     * pool, so that a trace can be replayed on a pool at another address.
+     */
+    struct TraceRecord
+    {
+        unsigned char op;    ///< One of TraceOp
+        unsigned char flags; ///< TraceBatch or zero
+        unsigned char reserved[6];
+        uint64_t size;       ///< Requested size, zero for deallocations
+        uint64_t block;      ///< Block passed to the operation, or TraceNone
+        uint64_t result;     ///< Block returned by the operation, or TraceNone
+    };
+
+    /**
+     * Receives the trace, one buffer of records at a time
+     * \param data the trace bytes
+     * \param size number of bytes
+     * \param context the pointer passed to startTrace()
+     */
+    typedef void (*TraceSink)(const void *data, size_t size, void *context);
+
+    #ifdef PROCESS_POOL_TRACE
+    /**
+     * Start recording the operations done through the public methods. The
+     * records are buffered, and the buffer is passed to the sink when full
+     * while holding the trace mutex, so a slow sink slows the pool down.
+     * Operations done by concurrent threads are recorded in the order they
+     * complete, with deallocations recorded before the block is given back.
+     * \param sink called with the header, then with the records
+     * \param context passed to the sink
+     */
+    void startTrace(TraceSink sink, void *context);
+
+    /**
+     * Pass the buffered records to the sink and stop recording
+     */
+    void stopTrace();
+    #endif //PROCESS_POOL_TRACE
     
 private:
     ProcessPool(const ProcessPool&);
@@ -110,7 +314,7 @@ private:
      * \param poolBase address of the start of the process pool.
      * \param poolSize size of the process pool. Must be a multiple of blockSize
      */
-    ProcessPool(unsigned int *poolBase, unsigned int poolSize);
+    ProcessPool(unsigned int *poolBase, size_t poolSize);
     #else //BMA
     /**
      * Constructor.
@@ -120,60 +324,206 @@ private:
      * \param embedded if true the buddy allocator is embedded in the pool, if false
      * the buddy allocator is separate from the pool and uses poolBase as its
      */
-    ProcessPool(unsigned int *poolBase, unsigned int poolSize, unsigned int alignment, bool embedded);
+    ProcessPool(unsigned int *poolBase, size_t poolSize, size_t alignment, bool embedded);
     #endif //BMA
     /**
-     * Destructor
+     * Destructor. With PROCESS_POOL_MAGAZINES the caches of the threads that
+     * used the pool are detached from it, and freed when their thread exits,
+     * so it must not run while one of those threads is exiting.
      */
     ~ProcessPool();
-    
+
+    /**
+     * \param size requested size in bytes
+     * \return the size actually allocated for the request
+     */
+    size_t roundSize(size_t size);
+
+    /**
+     * Allocate memory inside the process pool, taking the pool mutex.
+     * \param size size in bytes, already rounded
+     * \return a pair with the pointer to the allocated memory and its size
+     * \throws bad_alloc if out of memory
+     */
+    std::pair<unsigned int *, size_t> allocateFromPool(size_t size);
+
+    /**
+     * Implementation of allocate(), without recording it
+     */
+    std::pair<unsigned int *, size_t> allocateUntraced(size_t size);
+
+    /**
+     * Implementation of allocateBatch(), without recording it
+     */
+    void allocateBatchUntraced(size_t *sizes, unsigned int **blocks, unsigned int count);
+
+    #ifdef BMA
+    /**
+     * Implementation of reallocate(), without recording it
+     */
+    unsigned int *reallocateUntraced(unsigned int *ptr, size_t newSize);
+    #endif //BMA
+
+    #ifdef PROCESS_POOL_TRACE
+    class TraceScope;
+
+    /**
+     * Append a record to the trace, if tracing
+     * \param op one of TraceOp
+     * \param size requested size
+     * \param block block passed to the operation, or NULL
+     * \param result block returned by the operation, or NULL
+     */
+    void trace(unsigned char op, size_t size, unsigned int *block,
+               unsigned int *result);
+
+    /**
+     * Append the records of a batch to the trace, if tracing. The records
+     * are not interleaved with those of other threads.
+     * \param op one of TraceOp
+     * \param sizes requested sizes, or NULL if all zero
+     * \param blocks blocks passed to the operation, or NULL if none
+     * \param results blocks returned by the operation, or NULL if none
+     * \param count number of records
+     */
+    void traceBatch(unsigned char op, const size_t *sizes,
+                    unsigned int * const *blocks, unsigned int * const *results,
+                    unsigned int count);
+
+    /**
+     * Pass the buffered records to the sink, the caller holds traceMutex
+     */
+    void flushTrace();
+    #endif //PROCESS_POOL_TRACE
+
     #ifndef BMA
     /**
-     * \param bit bit to test, from 0 to poolSize/blockSize
-     * \return true if the bit is set
+     * Allocate memory inside the process pool, the caller holds the mutex.
+     * \param size size in bytes, already rounded
+     * \return a pair with the pointer to the allocated memory and its size
+     * \throws bad_alloc if out of memory
      */
-    bool testBit(unsigned int bit)
-    {
-        return (bitmap[bit/(sizeof(unsigned int)*8)] &
-            1<<(bit % (sizeof(unsigned int)*8))) ? true : false;
-    }
-    
+    std::pair<unsigned int *, size_t> allocateUnlocked(size_t size);
+
     /**
-     * \param bit bit to set, from 0 to poolSize/blockSize
+     * Deallocate a memory block, the caller holds the mutex.
+     * \param ptr pointer to deallocate.
      */
-    void setBit(unsigned int bit)
-    {
-        bitmap[(bit/(sizeof(unsigned int)*8))] |= 
-            1<<(bit % (sizeof(unsigned int)*8));
-    }
-    
+    void deallocateUnlocked(unsigned int *ptr);
+    #else //BMA
+    struct Shard;
+
     /**
-     * \param bit bit to clear, from 0 to poolSize/blockSize
+     * \return the index of the shard the calling thread allocates from first
      */
-    void clearBit(unsigned int bit)
-    {
-        bitmap[bit/(sizeof(unsigned int)*8)] &= 
-            ~(1<<(bit % (sizeof(unsigned int)*8)));
-    }
+    unsigned int homeShard();
+
+    /**
+     * \param ptr pointer inside the pool
+     * \return the shard owning ptr, or NULL if ptr is outside the pool
+     */
+    Shard *shardOf(unsigned int *ptr);
+    #endif //BMA
+
+    #ifdef PROCESS_POOL_MAGAZINES
+    class ThreadCache;
+
+    /**
+     * \return the cache of the calling thread for this pool, created on
+     * first use
+     */
+    ThreadCache& threadCache();
+
+    /**
+     * \param size size of a block in bytes
+     * \return the index of the smallest power of two not less than size
+     */
+    static unsigned int sizeClass(size_t size);
+    #endif //PROCESS_POOL_MAGAZINES
     
-    unsigned int *bitmap;   ///< Pointer to the status of the allocator
-    ///Lists all allocated blocks, allows to retrieve their sizes
-    std::map<unsigned int*,unsigned int> allocatedBlocks;
+    #ifndef BMA
+    class SlotBitmap;
+
+    /**
+     * Mark a size aligned run of blocks as allocated
+     * \param first first block of the run, counted from the first slot
+     * \param order log2 of the number of blocks of the run
+     */
+    void markUsed(size_t first, unsigned int order);
+
+    /**
+     * Mark a size aligned run of blocks as free, merging it with its free
+     * buddies in the slots of the higher orders
+     * \param first first block of the run, counted from the first slot
+     * \param order log2 of the number of blocks of the run
+     */
+    void markFree(size_t first, unsigned int order);
+
+    ///slots[k] has one bit per size aligned run of 1<<k blocks, set if the
+    ///whole run is free
+    SlotBitmap *slots;
+    unsigned int slotOrders; ///< Number of entries of slots
+    size_t slotOrigin;       ///< Blocks between the first slot and poolBase
+    ///One entry per block of the pool, for the first block of an allocation
+    ///one plus the log2 of its size in blocks, zero for the other blocks
+    unsigned char *blockOrders;
     #else //BMA
-    unsigned int *buddy_metadata; ///< Pointer to the buddy allocator metadata
-    struct buddy *buddy; ///< Pointer to the buddy allocator instance
-    unsigned int alignment; ///< Alignment of the blocks in the pool, must be a power of two
+    /**
+     * A slice of the pool managed by its own buddy allocator
+     */
+    struct Shard
+    {
+        unsigned int *base;           ///< Start of the shard
+        size_t size;                  ///< Size of the shard, in bytes
+        size_t maxBlock;              ///< Largest block aligned to its size the shard can hand out
+        unsigned int *buddy_metadata; ///< Pointer to the buddy allocator metadata
+        #ifndef BUDDY_CONCURRENT
+        struct buddy *buddy; ///< Pointer to the buddy allocator instance
+        #else //BUDDY_CONCURRENT
+        struct buddy_concurrent *buddy; ///< Pointer to the lock-free buddy allocator instance
+        #endif //BUDDY_CONCURRENT
+        #if !defined(TEST_ALLOC) && !defined(BUDDY_CONCURRENT)
+        miosix::FastMutex mutex; ///< Mutex to guard concurrent access to the shard
+        #endif //TEST_ALLOC, BUDDY_CONCURRENT
+    };
+
+    Shard shards[PROCESS_POOL_SHARDS];
+    size_t shardSize; ///< Size of all shards but the last, which takes the remainder, a power of two
+    size_t alignment; ///< Alignment of the blocks in the pool, must be a power of two
     bool embedded; ///< If true the buddy allocator is embedded in the pool, if false
                    ///< the buddy allocator is separate from the pool and uses poolBase as its arena
     #endif //BMA
 
 
     unsigned int *poolBase; ///< Base address of the entire pool
-    unsigned int poolSize;  ///< Size of the pool, in bytes
+    size_t poolSize;        ///< Size of the pool, in bytes
     
-    #ifndef TEST_ALLOC
+    #if !defined(TEST_ALLOC) && !defined(BMA)
     miosix::FastMutex mutex; ///< Mutex to guard concurrent access
+    #endif //TEST_ALLOC, BMA
+
+    #ifdef PROCESS_POOL_MAGAZINES
+    ThreadCache *caches; ///< Caches of all threads
+    #ifndef TEST_ALLOC
+    miosix::FastMutex cacheMutex; ///< Mutex to guard the list of caches
+    #else //TEST_ALLOC
+    std::mutex cacheMutex; ///< Mutex to guard the list of caches, the benchmarks are multithreaded
+    #endif //TEST_ALLOC
+    #endif //PROCESS_POOL_MAGAZINES
+
+    #ifdef PROCESS_POOL_TRACE
+    ///Number of records buffered before passing them to the sink
+    static const unsigned int traceBufferSize=64;
+    TraceSink traceSink;  ///< Sink of the trace, NULL if not tracing
+    void *traceContext;   ///< Passed to the sink
+    TraceRecord traceBuffer[traceBufferSize]; ///< Records not yet passed to the sink
+    unsigned int traceCount; ///< Number of records in traceBuffer
+    #ifndef TEST_ALLOC
+    miosix::FastMutex traceMutex; ///< Mutex to guard the trace
+    #else //TEST_ALLOC
+    std::mutex traceMutex; ///< Mutex to guard the trace, the benchmarks are multithreaded
     #endif //TEST_ALLOC
+    #endif //PROCESS_POOL_TRACE
 };
 
 } //namespace miosix
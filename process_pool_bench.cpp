@@ -0,0 +1,550 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Benchmark for the process pool, run against the backend selected at build
+ * time. Each workload prints one JSON object per line on stdout, so results
+ * of different builds and versions can be collected and compared by scripts:
+ *
+ * {"backend":"bma","shards":1,"locking":"mutex","workload":"churn",
+ *  "threads":1,"ops":400000,"failed":0,"ops_per_sec":...,"p50_ns":...,
+ *  "p99_ns":...,"max_ns":...,"fragmentation":...,"largest_free":...}
+ *
+ * Latencies are per allocate or deallocate call. fragmentation is measured
+ * at the end of the timed phase on the free address ranges of the pool, with
+ * the same metric as buddy_stats, scaled from 0 (a single free range) to 1,
+ * so that the backends are comparable. largest_free is the largest free
+ * range, in bytes.
+ *
+ * The pool built with TEST_ALLOC has no mutex, so unless BUDDY_CONCURRENT is
+ * defined the calls of all threads are serialized by a mutex in the benchmark
+ * and the latency includes waiting for it.
+ *
+ * g++ -O2 -pthread -o ppbench_bitmap -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=4194304 \
+ *     process_pool_bench.cpp process_pool.cpp
+ * g++ -O2 -pthread -o ppbench_bma -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=4194304 -DBMA \
+ *     -DTEST_ALLOC_POOL_ALIGNMENT=1024 process_pool_bench.cpp \
+ *     process_pool.cpp buddy_allocator.cpp buddy_concurrent.cpp
+ * ./ppbench_bitmap [max threads] > bitmap.jsonl
+ * ./ppbench_bma [max threads] > bma.jsonl
+ *
+ * Add -DBUDDY_CONCURRENT, -DPROCESS_POOL_SHARDS=N or -DPROCESS_POOL_MAGAZINES
+ * to the BMA build to measure the other pool configurations. Add
+ * -DPROCESS_POOL_TRACE and a file name after the thread count to record a
+ * trace of the workloads for process_pool_replay.cpp. The near-full workload
+ * stresses the search for a free slot, build with a larger
+ * TEST_ALLOC_POOL_SIZE to see how it scales with the pool size. The pool is
+ * never dereferenced, so on a 64 bit host it can be larger than 4GB, for
+ * example -DTEST_ALLOC_POOL_SIZE=8589934592 for 2^33 bytes. Add -m32 to
+ * measure the pool as built for a 32 bit target.
+ */
+
+#include "process_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace miosix;
+
+static const char backend[]=
+#ifndef BMA
+    "bitmap"
+#elif defined(BUDDY_CONCURRENT) //BMA
+    "bma-concurrent"
+#else //BMA
+    "bma"
+#endif //BMA
+#ifdef PROCESS_POOL_MAGAZINES
+    "+magazines"
+#endif //PROCESS_POOL_MAGAZINES
+    ;
+
+#ifdef BMA
+static const unsigned int shards=PROCESS_POOL_SHARDS;
+#else //BMA
+static const unsigned int shards=1;
+#endif //BMA
+
+///Smallest block, the bitmap backend only supports powers of two from 1KB
+static const unsigned int minBlock=1024;
+///Number of blocks kept live by the churn workload, split among the threads
+static const unsigned int churnLive=512;
+///Number of free+allocate pairs of the churn workload, split among the threads
+static const unsigned int churnOps=200000;
+///Number of fill+teardown cycles of the ramp workload
+static const unsigned int rampCycles=20;
+///Number of operations of the mixed workload, split among the threads
+static const unsigned int mixedOps=200000;
+///The near-full workload frees one in nearFullSlack blocks of the full pool
+static const unsigned int nearFullSlack=20;
+///Number of free+allocate pairs of the near-full workload
+static const unsigned int nearFullOps=200000;
+
+#ifndef BUDDY_CONCURRENT
+static const char locking[]="mutex";
+static mutex poolMutex; ///< Serializes the calls, see the comment at the top
+#else //BUDDY_CONCURRENT
+static const char locking[]="lock-free";
+#endif //BUDDY_CONCURRENT
+
+/**
+ * Small deterministic generator, one per thread
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * A live block
+ */
+struct Block
+{
+    unsigned int *ptr;
+    size_t size;
+};
+
+/**
+ * Latencies and failures measured by one thread
+ */
+struct Samples
+{
+    vector<unsigned int> ns;
+    unsigned long failed=0;
+};
+
+/**
+ * Allocate a block, timing the call
+ * \return the block, or NULL if the pool is out of memory
+ */
+static unsigned int *timedAllocate(size_t size, Samples& samples)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    unsigned int *result=NULL;
+    auto start=chrono::steady_clock::now();
+    {
+        #ifndef BUDDY_CONCURRENT
+        lock_guard<mutex> l(poolMutex);
+        #endif //BUDDY_CONCURRENT
+        try {
+            result=pool.allocate(size).first;
+        } catch(bad_alloc&) {}
+    }
+    auto end=chrono::steady_clock::now();
+    samples.ns.push_back(chrono::duration_cast<chrono::nanoseconds>(end-start).count());
+    if(result==NULL) samples.failed++;
+    return result;
+}
+
+/**
+ * Deallocate a block, timing the call
+ */
+static void timedDeallocate(const Block& block, Samples& samples)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    auto start=chrono::steady_clock::now();
+    {
+        #ifndef BUDDY_CONCURRENT
+        lock_guard<mutex> l(poolMutex);
+        #endif //BUDDY_CONCURRENT
+        #ifdef PROCESS_POOL_MAGAZINES
+        pool.deallocate(block.ptr,block.size);
+        #else //PROCESS_POOL_MAGAZINES
+        pool.deallocate(block.ptr);
+        #endif //PROCESS_POOL_MAGAZINES
+    }
+    auto end=chrono::steady_clock::now();
+    samples.ns.push_back(chrono::duration_cast<chrono::nanoseconds>(end-start).count());
+}
+
+/**
+ * Deallocate blocks without timing them, at the end of a workload
+ */
+static void release(vector<Block>& blocks)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    #ifndef BUDDY_CONCURRENT
+    lock_guard<mutex> l(poolMutex);
+    #endif //BUDDY_CONCURRENT
+    for(auto& b : blocks) if(b.ptr) pool.deallocate(b.ptr);
+    blocks.clear();
+}
+
+/**
+ * \return a power of two size between minBlock and minBlock<<(classes-1)
+ */
+static size_t uniformSize(unsigned int& state, unsigned int classes)
+{
+    return minBlock<<(xorshift(state) % classes);
+}
+
+/**
+ * \return a size skewed towards small blocks, as most process images are
+ * small but a few are much larger
+ */
+static size_t skewedSize(unsigned int& state)
+{
+    unsigned int r=xorshift(state) % 100;
+    if(r<70) return minBlock<<(r % 2);         //1..2KB
+    if(r<95) return minBlock<<(2+r % 3);       //4..16KB
+    return minBlock<<(5+r % 3);                //32..128KB
+}
+
+/**
+ * Free address ranges of the pool given the live blocks
+ */
+struct FreeSpace
+{
+    double fragmentation;
+    size_t largest;
+};
+
+static FreeSpace freeSpace(vector<Block> blocks)
+{
+    uintptr_t base=TEST_ALLOC_POOL_BASE, end=base+TEST_ALLOC_POOL_SIZE;
+    double quality=0, total=0;
+    FreeSpace result={0,0};
+    blocks.erase(remove_if(blocks.begin(),blocks.end(),
+        [](const Block& b) { return b.ptr==NULL; }),blocks.end());
+    sort(blocks.begin(),blocks.end(),
+        [](const Block& a, const Block& b) { return a.ptr<b.ptr; });
+    auto addRange=[&](uintptr_t from, uintptr_t to)
+    {
+        if(to<=from) return;
+        double size=to-from;
+        quality+=size*size;
+        total+=size;
+        result.largest=max<size_t>(result.largest,to-from);
+    };
+    uintptr_t cursor=base;
+    for(auto& b : blocks)
+    {
+        uintptr_t start=reinterpret_cast<uintptr_t>(b.ptr);
+        addRange(cursor,start);
+        cursor=max(cursor,start+b.size);
+    }
+    addRange(cursor,end);
+    if(total>0)
+    {
+        double q=sqrt(quality)/total;
+        result.fragmentation=1-q*q;
+    }
+    return result;
+}
+
+#ifdef PROCESS_POOL_TRACE
+/**
+ * Trace sink writing to a file
+ */
+static void writeTrace(const void *data, size_t size, void *context)
+{
+    fwrite(data,1,size,static_cast<FILE*>(context));
+}
+#endif //PROCESS_POOL_TRACE
+
+/**
+ * Run fn on threads threads, each with its own samples and live blocks
+ * \return the wall time in seconds of the slowest thread
+ */
+template<typename Fn>
+static double runThreads(unsigned int threads, vector<Samples>& samples,
+                         vector<vector<Block>>& live, Fn fn)
+{
+    samples.assign(threads,Samples());
+    live.assign(threads,vector<Block>());
+    atomic<unsigned int> ready(0);
+    vector<double> seconds(threads);
+    vector<thread> workers;
+    for(unsigned int i=0;i<threads;i++)
+    {
+        workers.emplace_back([&,i]() {
+            ready++;
+            while(ready.load()<threads) ; //Start all threads together
+            auto start=chrono::steady_clock::now();
+            fn(i,samples[i],live[i]);
+            auto end=chrono::steady_clock::now();
+            seconds[i]=chrono::duration<double>(end-start).count();
+            #ifdef PROCESS_POOL_MAGAZINES
+            //Blocks cached by this thread go back before it measures the pool
+            #ifndef BUDDY_CONCURRENT
+            lock_guard<mutex> l(poolMutex);
+            #endif //BUDDY_CONCURRENT
+            ProcessPool::instance().flushThreadCache();
+            #endif //PROCESS_POOL_MAGAZINES
+        });
+    }
+    for(auto& t : workers) t.join();
+    return *max_element(seconds.begin(),seconds.end());
+}
+
+/**
+ * Print the results of a workload as a JSON object, then free the blocks
+ * left live by the workload
+ */
+static void report(const char *workload, unsigned int threads, double seconds,
+                   vector<Samples>& samples, vector<vector<Block>>& live)
+{
+    vector<unsigned int> ns;
+    vector<Block> blocks;
+    unsigned long failed=0;
+    for(auto& s : samples)
+    {
+        ns.insert(ns.end(),s.ns.begin(),s.ns.end());
+        failed+=s.failed;
+    }
+    for(auto& l : live) blocks.insert(blocks.end(),l.begin(),l.end());
+    FreeSpace space=freeSpace(blocks);
+    auto percentile=[&ns](double p) -> unsigned int
+    {
+        if(ns.empty()) return 0;
+        size_t i=min(ns.size()-1,static_cast<size_t>(p*ns.size()));
+        nth_element(ns.begin(),ns.begin()+i,ns.end());
+        return ns[i];
+    };
+    unsigned int p50=percentile(0.5), p99=percentile(0.99);
+    unsigned int maxNs=ns.empty() ? 0 : *max_element(ns.begin(),ns.end());
+    printf("{\"backend\":\"%s\",\"shards\":%u,\"locking\":\"%s\",\"workload\":\"%s\","
+           "\"threads\":%u,\"ops\":%zu,\"failed\":%lu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p99_ns\":%u,\"max_ns\":%u,\"fragmentation\":%.4f,"
+           "\"largest_free\":%zu}\n",
+           backend,shards,locking,workload,threads,ns.size(),failed,
+           seconds>0 ? ns.size()/seconds : 0.0,p50,p99,maxNs,
+           space.fragmentation,space.largest);
+    fflush(stdout);
+    release(blocks);
+}
+
+/**
+ * Steady state: every thread keeps its share of churnLive blocks live and
+ * replaces a random one at a time
+ */
+static void churn(unsigned int threads)
+{
+    vector<Samples> samples;
+    vector<vector<Block>> live;
+    double seconds=runThreads(threads,samples,live,
+        [threads](unsigned int id, Samples& s, vector<Block>& blocks)
+    {
+        unsigned int state=0x2545f491+id;
+        unsigned int count=churnLive/threads;
+        Samples warmup;
+        for(unsigned int i=0;i<count;i++)
+        {
+            size_t size=uniformSize(state,4);
+            blocks.push_back({timedAllocate(size,warmup),size});
+        }
+        for(unsigned int i=0;i<churnOps/threads;i++)
+        {
+            Block& victim=blocks[xorshift(state) % count];
+            if(victim.ptr) timedDeallocate(victim,s);
+            victim.size=uniformSize(state,4);
+            victim.ptr=timedAllocate(victim.size,s);
+        }
+    });
+    report("churn",threads,seconds,samples,live);
+}
+
+/**
+ * Ramp-up and teardown: fill the pool until the first failure, then free
+ * everything in random order, as when all processes are started and killed
+ */
+static void ramp()
+{
+    vector<Samples> samples;
+    vector<vector<Block>> live;
+    double seconds=runThreads(1,samples,live,
+        [](unsigned int, Samples& s, vector<Block>& blocks)
+    {
+        unsigned int state=0x1234567;
+        for(unsigned int c=0;c<rampCycles;c++)
+        {
+            for(;;)
+            {
+                size_t size=uniformSize(state,4);
+                unsigned int *ptr=timedAllocate(size,s);
+                if(ptr==NULL) break;
+                blocks.push_back({ptr,size});
+            }
+            s.failed--; //The failure ending the ramp is expected
+            if(c==rampCycles-1) break; //Measure fragmentation when full
+            for(unsigned int i=blocks.size();i>1;i--)
+                swap(blocks[i-1],blocks[xorshift(state) % i]);
+            for(auto& b : blocks) timedDeallocate(b,s);
+            blocks.clear();
+        }
+    });
+    report("ramp",1,seconds,samples,live);
+}
+
+/**
+ * Mixed sizes: random allocations skewed towards small blocks interleaved
+ * with frees of random live blocks
+ */
+static void mixed(unsigned int threads)
+{
+    vector<Samples> samples;
+    vector<vector<Block>> live;
+    double seconds=runThreads(threads,samples,live,
+        [threads](unsigned int id, Samples& s, vector<Block>& blocks)
+    {
+        unsigned int state=0x9e3779b9+id;
+        unsigned int cap=churnLive/threads;
+        for(unsigned int i=0;i<mixedOps/threads;i++)
+        {
+            if(!blocks.empty() && (blocks.size()>=cap || xorshift(state) % 2))
+            {
+                unsigned int victim=xorshift(state) % blocks.size();
+                timedDeallocate(blocks[victim],s);
+                blocks[victim]=blocks.back();
+                blocks.pop_back();
+            } else {
+                size_t size=skewedSize(state);
+                unsigned int *ptr=timedAllocate(size,s);
+                if(ptr) blocks.push_back({ptr,size});
+            }
+        }
+    });
+    report("mixed",threads,seconds,samples,live);
+}
+
+/**
+ * Adversarial fragmentation: fill the pool with the smallest blocks, free
+ * every other one, then ask for blocks twice as large, which only fit if
+ * the backend can find or make room for them
+ */
+static void adversarial()
+{
+    vector<Samples> samples;
+    vector<vector<Block>> live;
+    double seconds=runThreads(1,samples,live,
+        [](unsigned int, Samples& s, vector<Block>& blocks)
+    {
+        Samples warmup;
+        for(;;)
+        {
+            unsigned int *ptr=timedAllocate(minBlock,warmup);
+            if(ptr==NULL) break;
+            blocks.push_back({ptr,minBlock});
+        }
+        sort(blocks.begin(),blocks.end(),
+            [](const Block& a, const Block& b) { return a.ptr<b.ptr; });
+        vector<Block> kept;
+        for(unsigned int i=0;i<blocks.size();i++)
+        {
+            if(i % 2) timedDeallocate(blocks[i],s);
+            else kept.push_back(blocks[i]);
+        }
+        blocks.swap(kept);
+        unsigned int attempts=blocks.size()/2;
+        for(unsigned int i=0;i<attempts;i++)
+        {
+            unsigned int *ptr=timedAllocate(2*minBlock,s);
+            if(ptr) blocks.push_back({ptr,2*minBlock});
+        }
+    });
+    report("adversarial",1,seconds,samples,live);
+}
+
+/**
+ * Nearly full pool: fill the pool until the first failure, free a few random
+ * blocks, then replace random blocks with blocks of a random size, so that
+ * every allocation has to find one of the few free slots left
+ */
+static void nearFull()
+{
+    vector<Samples> samples;
+    vector<vector<Block>> live;
+    double seconds=runThreads(1,samples,live,
+        [](unsigned int, Samples& s, vector<Block>& blocks)
+    {
+        unsigned int state=0xdeadbeef;
+        Samples warmup;
+        for(;;)
+        {
+            size_t size=uniformSize(state,4);
+            unsigned int *ptr=timedAllocate(size,warmup);
+            if(ptr==NULL) break;
+            blocks.push_back({ptr,size});
+        }
+        for(unsigned int i=0;i<blocks.size()/nearFullSlack;i++)
+        {
+            unsigned int victim=xorshift(state) % blocks.size();
+            timedDeallocate(blocks[victim],warmup);
+            blocks[victim]=blocks.back();
+            blocks.pop_back();
+        }
+        for(unsigned int i=0;i<nearFullOps;i++)
+        {
+            Block& victim=blocks[xorshift(state) % blocks.size()];
+            if(victim.ptr) timedDeallocate(victim,s);
+            victim.size=uniformSize(state,4);
+            victim.ptr=timedAllocate(victim.size,s);
+        }
+    });
+    report("near-full",1,seconds,samples,live);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int maxThreads=argc>1 ? atoi(argv[1]) : thread::hardware_concurrency();
+    if(maxThreads==0) maxThreads=1;
+    vector<unsigned int> threadCounts;
+    for(unsigned int threads=1;threads<maxThreads;threads*=2) threadCounts.push_back(threads);
+    threadCounts.push_back(maxThreads);
+
+    ProcessPool::instance();
+    #ifdef PROCESS_POOL_TRACE
+    FILE *traceFile=argc>2 ? fopen(argv[2],"wb") : NULL;
+    if(traceFile) ProcessPool::instance().startTrace(writeTrace,traceFile);
+    #endif //PROCESS_POOL_TRACE
+    for(unsigned int threads : threadCounts) churn(threads);
+    ramp();
+    for(unsigned int threads : threadCounts) mixed(threads);
+    adversarial();
+    nearFull();
+    #ifdef PROCESS_POOL_TRACE
+    if(traceFile)
+    {
+        ProcessPool::instance().stopTrace();
+        fclose(traceFile);
+    }
+    #endif //PROCESS_POOL_TRACE
+    return 0;
+}
@@ -0,0 +1,274 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Checks the process pool with a pool larger than 4GB, so that byte offsets,
+ * block counts and slot indices past 32 bits are exercised. The whole pool
+ * is allocated as a single block, then as blocks of every size down to the
+ * smallest one, then churned with random sizes. Every block must be inside
+ * the pool, aligned to its size in the address space and must not overlap
+ * the other live blocks, and once everything is deallocated the whole pool
+ * must be available again. With BMA, defragment() also has to make room for
+ * a large block in a fragmented pool with the fewest relocations, never
+ * relocating a pinned block. Prints the failed checks and returns 1 if any.
+ *
+ * g++ -O2 -pthread -o pplarge_bitmap -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=8589934592 \
+ *     -DTEST_ALLOC_POOL_BASE=0x200000000 process_pool_large.cpp process_pool.cpp
+ * g++ -O2 -pthread -o pplarge_bma -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=8589934592 \
+ *     -DTEST_ALLOC_POOL_BASE=0x200000000 -DBMA \
+ *     -DTEST_ALLOC_POOL_ALIGNMENT=1024 process_pool_large.cpp \
+ *     process_pool.cpp buddy_allocator.cpp buddy_concurrent.cpp
+ * ./pplarge_bitmap
+ * ./pplarge_bma
+ *
+ * The pool is never dereferenced, but it needs a 64 bit host. Add
+ * -DBUDDY_CONCURRENT or -DPROCESS_POOL_SHARDS=N to the BMA build to check the
+ * other pool configurations, the shards are then checked for blocks up to
+ * their size.
+ */
+
+#include "process_pool.h"
+#include <algorithm>
+#include <cstdio>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace miosix;
+
+///Smallest block requested, the block size of the bitmap backend
+static const size_t smallest=1024;
+///Random allocations and deallocations of the churn phase
+static const unsigned int churnOps=200000;
+
+static unsigned int errors=0;
+
+static void check(bool ok, const char *what, size_t size)
+{
+    if(ok) return;
+    if(errors<20) printf("FAILED: %s, block of %zu bytes\n",what,size);
+    errors++;
+}
+
+/**
+ * Small deterministic generator, so that runs are reproducible
+ */
+static unsigned int xorshift(unsigned int& state)
+{
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+/**
+ * \return the largest power of two not greater than size
+ */
+static size_t floorPow2(size_t size)
+{
+    size_t result=1;
+    while(result<=size/2) result*=2;
+    return result;
+}
+
+/**
+ * Allocate a block, checking it is inside the pool and aligned to its size
+ * \param live the block is appended here
+ * \param size size of the block, a power of two
+ * \return true on success, false if the pool is out of memory
+ */
+static bool allocateChecked(vector<pair<unsigned int*,size_t>>& live, size_t size)
+{
+    pair<unsigned int*,size_t> block;
+    try {
+        block=ProcessPool::instance().allocate(size);
+    } catch(bad_alloc&) {
+        return false;
+    }
+    uintptr_t start=reinterpret_cast<uintptr_t>(block.first);
+    check(block.second>=size,"allocated size too small",size);
+    check(start>=TEST_ALLOC_POOL_BASE && start-TEST_ALLOC_POOL_BASE+size<=TEST_ALLOC_POOL_SIZE,
+          "block outside the pool",size);
+    check(start % size==0,"block not aligned to its size",size);
+    live.push_back(block);
+    return true;
+}
+
+/**
+ * Check that the live blocks do not overlap, which also means that no
+ * address was returned twice
+ */
+static void checkOverlaps(vector<pair<unsigned int*,size_t>> live)
+{
+    sort(live.begin(),live.end());
+    for(size_t i=1;i<live.size();i++)
+    {
+        uintptr_t end=reinterpret_cast<uintptr_t>(live[i-1].first)+live[i-1].second;
+        check(end<=reinterpret_cast<uintptr_t>(live[i].first),"overlapping blocks",live[i].second);
+    }
+}
+
+static void deallocateAll(vector<pair<unsigned int*,size_t>>& live)
+{
+    for(auto& block : live) ProcessPool::instance().deallocate(block.first);
+    live.clear();
+}
+
+#if defined(BMA) && !defined(BUDDY_CONCURRENT)
+/**
+ * State of the defragmentation check, passed to the callbacks
+ */
+struct Relocations
+{
+    vector<pair<unsigned int*,size_t>> *live; ///< Updated with the new addresses
+    unsigned int *pinned;                     ///< Block that must not be relocated
+    unsigned int count;                       ///< Number of relocations
+    bool pinnedMoved;                         ///< Set if pinned was relocated
+};
+
+static bool poolMovable(unsigned int *block, void *context)
+{
+    return block!=static_cast<Relocations*>(context)->pinned;
+}
+
+static void poolRelocate(unsigned int *from, unsigned int *to, size_t size, void *context)
+{
+    Relocations *r=static_cast<Relocations*>(context);
+    r->count++;
+    if(from==r->pinned) r->pinnedMoved=true;
+    bool found=false;
+    for(auto& block : *r->live)
+    {
+        if(block.first!=from) continue;
+        check(block.second==size,"relocated block has the wrong size",size);
+        block.first=to;
+        found=true;
+    }
+    check(found,"relocated block is not allocated",size);
+}
+
+/**
+ * Fill the pool with blocks of 1/16 of the target size, keep two of them in
+ * each region of the target size and check that defragment() makes room
+ * for a target block with two relocations
+ * \param target size of the block to make room for
+ */
+static void checkDefragment(size_t target)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    vector<pair<unsigned int*,size_t>> all, live;
+    while(allocateChecked(all,target/16)) ;
+    sort(all.begin(),all.end());
+    for(size_t i=0;i<all.size();i++)
+    {
+        if(i % 16<2) live.push_back(all[i]);
+        else pool.deallocate(all[i].first);
+    }
+    check(allocateChecked(live,target)==false,"pool not fragmented",target);
+
+    Relocations r={&live,live[0].first,0,false};
+    check(pool.defragment(target,poolMovable,poolRelocate,&r),"defragment failed",target);
+    check(r.count==2,"defragment did not relocate the fewest blocks",target);
+    check(r.pinnedMoved==false,"defragment relocated a pinned block",target);
+    check(allocateChecked(live,target),"no block available after defragment",target);
+    checkOverlaps(live);
+    deallocateAll(live);
+}
+#endif //BMA, BUDDY_CONCURRENT
+
+int main()
+{
+    ProcessPool& pool=ProcessPool::instance();
+    #ifdef BMA
+    //With shards the largest block is limited by the size of a shard
+    size_t whole=floorPow2(TEST_ALLOC_POOL_SIZE/PROCESS_POOL_SHARDS);
+    #else //BMA
+    size_t whole=floorPow2(TEST_ALLOC_POOL_SIZE);
+    #endif //BMA
+    printf("Pool of %zu bytes at %#zx, largest block %zu bytes\n",
+           static_cast<size_t>(TEST_ALLOC_POOL_SIZE),static_cast<size_t>(TEST_ALLOC_POOL_BASE),whole);
+    vector<pair<unsigned int*,size_t>> live;
+
+    //The largest block, allocated twice to check it is given back
+    for(int i=0;i<2;i++)
+    {
+        check(allocateChecked(live,whole),"largest block not available",whole);
+        deallocateAll(live);
+    }
+
+    //Blocks of every size, halving down to the smallest one, fill the
+    //largest block
+    for(size_t size=whole/2;size>=smallest;size/=2)
+        check(allocateChecked(live,size),"halving allocation failed",size);
+    check(allocateChecked(live,smallest),"last block of the largest one failed",smallest);
+    checkOverlaps(live);
+    #if !defined(BMA) || PROCESS_POOL_SHARDS==1
+    if(whole==TEST_ALLOC_POOL_SIZE)
+    {
+        check(allocateChecked(live,smallest)==false,"allocation from a full pool succeeded",smallest);
+    }
+    #endif //BMA, PROCESS_POOL_SHARDS
+    deallocateAll(live);
+    check(allocateChecked(live,whole),"largest block not available after the halving phase",whole);
+    deallocateAll(live);
+
+    //Random sizes up to 1/16 of the largest block, biased towards the small
+    //ones, deallocated in random order
+    unsigned int state=0x2545f491;
+    unsigned int failed=0;
+    for(unsigned int i=0;i<churnOps;i++)
+    {
+        unsigned int r=xorshift(state);
+        if(live.empty()==false && r % 3==0)
+        {
+            size_t victim=xorshift(state) % live.size();
+            pool.deallocate(live[victim].first);
+            live[victim]=live.back();
+            live.pop_back();
+            continue;
+        }
+        size_t size=smallest;
+        for(unsigned int bits=r>>2;bits & 1 && size<whole/16;bits>>=1) size*=2;
+        if(xorshift(state) % 64==0) size=whole/16; //A few blocks past 4GB offsets
+        if(allocateChecked(live,size)==false) failed++;
+    }
+    checkOverlaps(live);
+    printf("Churn: %u operations, %zu live blocks, %u failed allocations\n",churnOps,live.size(),failed);
+    deallocateAll(live);
+    check(allocateChecked(live,whole),"largest block not available after the churn phase",whole);
+    deallocateAll(live);
+
+    #if defined(BMA) && !defined(BUDDY_CONCURRENT)
+    checkDefragment(whole/16);
+    #endif //BMA, BUDDY_CONCURRENT
+
+    printf("%u failed checks\n",errors);
+    return errors ? 1 : 0;
+}
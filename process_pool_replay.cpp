@@ -0,0 +1,473 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Terraneo Federico and Luigi Rucco               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   As a special exception, if other files instantiate templates or use   *
+ *   macros or inline functions from this file, or you compile this file   *
+ *   and link it with other works to produce a work based on this file,    *
+ *   this file does not by itself cause the resulting work to be covered   *
+ *   by the GNU General Public License. However the source code for this   *
+ *   file must still be made available in accordance with the GNU General  *
+ *   Public License. This exception does not invalidate any other reasons  *
+ *   why a work based on this file might be covered by the GNU General     *
+ *   Public License.                                                       *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, see <http://www.gnu.org/licenses/>   *
+ ***************************************************************************/
+
+/*
+ * Replays a trace recorded by ProcessPool::startTrace() against the backend
+ * selected at build time, for example a trace captured on a board against
+ * the bitmap and the buddy backends on the host:
+ *
+ * g++ -O2 -o replay_bitmap -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=<size of the traced pool> \
+ *     process_pool_replay.cpp process_pool.cpp
+ * g++ -O2 -o replay_bma -DTEST_ALLOC -DTEST_ALLOC_NO_MAIN \
+ *     -DWITH_PROCESSES -DTEST_ALLOC_POOL_SIZE=<size of the traced pool> \
+ *     -DBMA -DTEST_ALLOC_POOL_ALIGNMENT=<alignment of the traced pool> \
+ *     process_pool_replay.cpp process_pool.cpp buddy_allocator.cpp buddy_concurrent.cpp
+ * ./replay_bitmap trace.bin && ./replay_bma trace.bin
+ *
+ * The BMA build without BUDDY_CONCURRENT takes the placement policy as an
+ * optional second argument, one of busiest, lowest, best-fit or two-ended,
+ * followed for two-ended by the size in bytes of the blocks allocated from
+ * the high end, 16 blocks by default:
+ *
+ * for p in busiest lowest best-fit two-ended; do ./replay_bma trace.bin $p; done
+ *
+ * The trace is decoded before the replay, which then runs without any I/O.
+ * The summary is printed as a JSON object on stdout:
+ *
+ * {"backend":"bma","policy":"busiest","trace_pool_size":...,"pool_size":...,
+ *  "ops":...,"seconds":...,"ops_per_sec":...,"peak_live_bytes":...,
+ *  "peak_extent":...,"failed":...,"mean_fragmentation":...,
+ *  "max_fragmentation":...,"outcome_mismatches":...,"placement_mismatches":...}
+ *
+ * peak_live_bytes is the largest sum of the live blocks, and peak_extent the
+ * largest end offset of a live block, that is the part of the pool actually
+ * needed. failed counts the allocations and reallocations that failed in the
+ * replay. The fragmentation of the free address ranges, with the metric of
+ * process_pool_bench.cpp, is sampled every fragmentationPeriod operations
+ * outside of the timed part, and its mean and maximum are reported. An outcome mismatch is an operation that failed in the trace and
+ * succeeded in the replay or vice versa, and each one is also printed on
+ * stderr. A placement mismatch is a block returned at a different offset,
+ * which is expected when the backend differs from the traced one.
+ * Reallocations are replayed as an allocation and a deallocation by the
+ * bitmap backend, which has no reallocate().
+ */
+
+#include "process_pool.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+using namespace miosix;
+
+static const char backend[]=
+#ifndef BMA
+    "bitmap"
+#elif defined(BUDDY_CONCURRENT) //BMA
+    "bma-concurrent"
+#else //BMA
+    "bma"
+#endif //BMA
+    ;
+
+///Slot of the operations that do not refer to a block
+static const unsigned int noSlot=0xffffffff;
+///Outcome mismatches printed on stderr
+static const unsigned int maxPrintedMismatches=20;
+///Operations between two samples of the fragmentation
+static const unsigned int fragmentationPeriod=64;
+
+#if defined(BMA) && !defined(BUDDY_CONCURRENT)
+/**
+ * Placement policies selectable from the command line
+ */
+static const struct
+{
+    const char *name;
+    enum buddy_policy policy;
+} policies[]=
+{
+    {"busiest",BUDDY_POLICY_BUSIEST},
+    {"lowest",BUDDY_POLICY_LOWEST},
+    {"best-fit",BUDDY_POLICY_BEST_FIT},
+    {"two-ended",BUDDY_POLICY_TWO_ENDED}
+};
+#endif //BMA, BUDDY_CONCURRENT
+
+/**
+ * A decoded operation. Blocks are identified by a slot, the index of the
+ * allocation that created them, so that the replay does not depend on the
+ * offsets of the traced pool.
+ */
+struct Op
+{
+    unsigned char op;    ///< One of ProcessPool::TraceOp
+    unsigned char flags; ///< ProcessPool::TraceBatch or zero
+    size_t size;         ///< Requested size
+    unsigned int slot;   ///< Block passed to or created by the operation
+    uint64_t result;     ///< Offset returned in the trace, or TraceNone
+};
+
+/**
+ * Read a trace and decode it
+ * \param name file name
+ * \param header the header of the trace is stored here
+ * \param ops the decoded operations are stored here
+ * \return the number of slots, or zero on error
+ */
+static unsigned int decode(const char *name, ProcessPool::TraceHeader& header, vector<Op>& ops)
+{
+    FILE *f=fopen(name,"rb");
+    if(f==NULL)
+    {
+        perror(name);
+        return 0;
+    }
+    if(fread(&header,sizeof(header),1,f)!=1 || memcmp(header.magic,"PPTR",4)
+        || header.version!=ProcessPool::TraceVersion)
+    {
+        fprintf(stderr,"%s: not a version %u process pool trace\n",name,
+                ProcessPool::TraceVersion);
+        fclose(f);
+        return 0;
+    }
+    //Offsets of the blocks live in the trace, and their slot
+    unordered_map<uint64_t,unsigned int> live;
+    unsigned int slots=0;
+    ProcessPool::TraceRecord r;
+    while(fread(&r,sizeof(r),1,f)==1)
+    {
+        Op op={r.op,r.flags,static_cast<size_t>(r.size),noSlot,r.result};
+        auto it=live.find(r.block);
+        unsigned int existing=it==live.end() ? noSlot : it->second;
+        switch(r.op)
+        {
+            case ProcessPool::TraceAllocate:
+                op.slot=slots++;
+                if(r.result!=ProcessPool::TraceNone) live[r.result]=op.slot;
+                break;
+            case ProcessPool::TraceDeallocate:
+                op.slot=existing;
+                if(existing!=noSlot) live.erase(it);
+                break;
+            case ProcessPool::TraceReallocate:
+                //Like allocate for a NULL block, the block keeps its slot if moved
+                op.slot=existing!=noSlot ? existing : slots++;
+                if(r.result!=ProcessPool::TraceNone || r.size==0)
+                {
+                    if(existing!=noSlot) live.erase(it);
+                }
+                if(r.result!=ProcessPool::TraceNone) live[r.result]=op.slot;
+                break;
+            default:
+                fprintf(stderr,"%s: unknown operation %u\n",name,r.op);
+                fclose(f);
+                return 0;
+        }
+        ops.push_back(op);
+    }
+    fclose(f);
+    return max(slots,1u);
+}
+
+/**
+ * Replay state
+ */
+struct Replay
+{
+    vector<unsigned int*> blocks; ///< Replayed block of each slot
+    vector<size_t> sizes;         ///< Rounded size of each slot
+    map<size_t,size_t> ranges;    ///< Offset and size of the live blocks
+    size_t liveBytes=0, peakLiveBytes=0, peakExtent=0;
+    unsigned long failed=0;
+    unsigned long outcomeMismatches=0, placementMismatches=0;
+    double fragmentationSum=0, maxFragmentation=0;
+    unsigned long fragmentationSamples=0;
+    size_t alignment;
+
+    /**
+     * \return the size of the block the backends give for size
+     */
+    size_t rounded(size_t size) const
+    {
+        size_t result=alignment;
+        while(result<size) result*=2;
+        return result;
+    }
+
+    /**
+     * Account for a block becoming live in slot
+     */
+    void created(unsigned int slot, unsigned int *ptr, size_t size)
+    {
+        blocks[slot]=ptr;
+        sizes[slot]=rounded(size);
+        liveBytes+=sizes[slot];
+        peakLiveBytes=max(peakLiveBytes,liveBytes);
+        size_t offset=(ptr-reinterpret_cast<unsigned int*>(TEST_ALLOC_POOL_BASE))
+                      *sizeof(unsigned int);
+        ranges[offset]=sizes[slot];
+        peakExtent=max(peakExtent,offset+sizes[slot]);
+    }
+
+    /**
+     * Account for the block in slot being freed
+     */
+    void destroyed(unsigned int slot)
+    {
+        if(blocks[slot])
+        {
+            liveBytes-=sizes[slot];
+            ranges.erase((blocks[slot]-reinterpret_cast<unsigned int*>(TEST_ALLOC_POOL_BASE))
+                         *sizeof(unsigned int));
+        }
+        blocks[slot]=NULL;
+    }
+
+    /**
+     * Sample the fragmentation of the free address ranges of the pool, from
+     * 0 for a single free range to 1
+     */
+    void sampleFragmentation()
+    {
+        double quality=0, total=0;
+        auto addRange=[&](size_t from, size_t to)
+        {
+            if(to<=from) return;
+            double size=to-from;
+            quality+=size*size;
+            total+=size;
+        };
+        size_t cursor=0;
+        for(auto& r : ranges)
+        {
+            addRange(cursor,r.first);
+            cursor=max(cursor,r.first+r.second);
+        }
+        addRange(cursor,TEST_ALLOC_POOL_SIZE);
+        double fragmentation=0;
+        if(total>0)
+        {
+            double q=sqrt(quality)/total;
+            fragmentation=1-q*q;
+        }
+        fragmentationSum+=fragmentation;
+        maxFragmentation=max(maxFragmentation,fragmentation);
+        fragmentationSamples++;
+    }
+
+    /**
+     * Compare the outcome of an operation with the trace
+     */
+    void compare(unsigned int index, const Op& op, unsigned int *ptr)
+    {
+        bool traced=op.result!=ProcessPool::TraceNone;
+        if(ptr==NULL) failed++;
+        if(traced!=(ptr!=NULL))
+        {
+            if(outcomeMismatches++<maxPrintedMismatches)
+                fprintf(stderr,"operation %u: %s of %zu bytes %s in the trace, %s in the replay\n",
+                        index,op.op==ProcessPool::TraceAllocate ? "allocation" : "reallocation",
+                        op.size,traced ? "succeeded" : "failed",traced ? "failed" : "succeeded");
+        } else if(traced) {
+            uint64_t offset=(ptr-reinterpret_cast<unsigned int*>(TEST_ALLOC_POOL_BASE))
+                            *sizeof(unsigned int);
+            if(offset!=op.result) placementMismatches++;
+        }
+    }
+};
+
+/**
+ * Replay an allocation, or a batch of them starting at ops[i]
+ * \return the index of the last operation replayed
+ */
+static unsigned int allocate(const vector<Op>& ops, unsigned int i, Replay& replay)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    unsigned int first=i;
+    while(ops[i].flags & ProcessPool::TraceBatch && i+1<ops.size()) i++;
+    if(i==first)
+    {
+        unsigned int *ptr=NULL;
+        try {
+            ptr=pool.allocate(ops[i].size).first;
+        } catch(exception&) {}
+        replay.compare(i,ops[i],ptr);
+        if(ptr) replay.created(ops[i].slot,ptr,ops[i].size);
+        return i;
+    }
+    unsigned int count=i-first+1;
+    vector<size_t> sizes(count);
+    vector<unsigned int*> blocks(count);
+    for(unsigned int j=0;j<count;j++) sizes[j]=ops[first+j].size;
+    bool ok=true;
+    try {
+        pool.allocateBatch(sizes.data(),blocks.data(),count);
+    } catch(exception&) {
+        ok=false;
+    }
+    for(unsigned int j=0;j<count;j++)
+    {
+        const Op& op=ops[first+j];
+        unsigned int *ptr=ok ? blocks[j] : NULL;
+        replay.compare(first+j,op,ptr);
+        if(ptr) replay.created(op.slot,ptr,op.size);
+    }
+    return i;
+}
+
+/**
+ * Replay a deallocation, or a batch of them starting at ops[i]
+ * \return the index of the last operation replayed
+ */
+static unsigned int deallocate(const vector<Op>& ops, unsigned int i, Replay& replay)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    vector<unsigned int*> blocks;
+    for(;;)
+    {
+        unsigned int slot=ops[i].slot;
+        if(slot!=noSlot && replay.blocks[slot])
+        {
+            blocks.push_back(replay.blocks[slot]);
+            replay.destroyed(slot);
+        }
+        if(!(ops[i].flags & ProcessPool::TraceBatch) || i+1==ops.size()) break;
+        i++;
+    }
+    if(blocks.size()==1) pool.deallocate(blocks[0]);
+    else if(blocks.size()>1) pool.deallocateBatch(blocks.data(),blocks.size());
+    return i;
+}
+
+/**
+ * Replay a reallocation
+ */
+static void reallocate(const Op& op, unsigned int i, Replay& replay)
+{
+    ProcessPool& pool=ProcessPool::instance();
+    unsigned int *old=replay.blocks[op.slot];
+    unsigned int *ptr=NULL;
+    #ifdef BMA
+    ptr=pool.reallocate(old,op.size);
+    #else //BMA
+    if(op.size)
+    {
+        try {
+            ptr=pool.allocate(op.size).first;
+        } catch(exception&) {}
+    }
+    if(old && (ptr || op.size==0)) pool.deallocate(old);
+    #endif //BMA
+    if(op.size) replay.compare(i,op,ptr);
+    if(ptr || op.size==0) replay.destroyed(op.slot);
+    if(ptr) replay.created(op.slot,ptr,op.size);
+}
+
+int main(int argc, char *argv[])
+{
+    #if defined(BMA) && !defined(BUDDY_CONCURRENT)
+    if(argc<2 || argc>4)
+    {
+        fprintf(stderr,"usage: %s <trace> [busiest|lowest|best-fit|two-ended [threshold]]\n",argv[0]);
+        return 1;
+    }
+    const char *policy=argc>2 ? argv[2] : "busiest";
+    unsigned int policyIndex=0;
+    while(policyIndex<sizeof(policies)/sizeof(policies[0])
+        && strcmp(policies[policyIndex].name,policy)) policyIndex++;
+    if(policyIndex==sizeof(policies)/sizeof(policies[0]))
+    {
+        fprintf(stderr,"unknown policy %s\n",policy);
+        return 1;
+    }
+    #else //BMA, BUDDY_CONCURRENT
+    if(argc!=2)
+    {
+        fprintf(stderr,"usage: %s <trace>\n",argv[0]);
+        return 1;
+    }
+    const char *policy="default";
+    #endif //BMA, BUDDY_CONCURRENT
+    ProcessPool::TraceHeader header;
+    vector<Op> ops;
+    unsigned int slots=decode(argv[1],header,ops);
+    if(slots==0) return 1;
+    if(header.poolSize!=TEST_ALLOC_POOL_SIZE)
+        fprintf(stderr,"warning: trace pool is %llu bytes, replay pool is %zu bytes\n",
+                static_cast<unsigned long long>(header.poolSize),
+                static_cast<size_t>(TEST_ALLOC_POOL_SIZE));
+
+    Replay replay;
+    replay.blocks.assign(slots,static_cast<unsigned int*>(NULL));
+    replay.sizes.assign(slots,0);
+    replay.alignment=header.alignment;
+    ProcessPool& pool=ProcessPool::instance();
+    #if defined(BMA) && !defined(BUDDY_CONCURRENT)
+    pool.setPolicy(policies[policyIndex].policy,
+                   argc>3 ? strtoull(argv[3],NULL,10) : 16*header.alignment);
+    #endif //BMA, BUDDY_CONCURRENT
+
+    double seconds=0;
+    unsigned int nextSample=fragmentationPeriod;
+    auto start=chrono::steady_clock::now();
+    for(unsigned int i=0;i<ops.size();i++)
+    {
+        const Op& op=ops[i];
+        switch(op.op)
+        {
+            case ProcessPool::TraceAllocate:
+                i=allocate(ops,i,replay);
+                break;
+            case ProcessPool::TraceDeallocate:
+                i=deallocate(ops,i,replay);
+                break;
+            case ProcessPool::TraceReallocate:
+                reallocate(op,i,replay);
+                break;
+        }
+        if(i+1>=nextSample)
+        {
+            //Sampling is not part of the replay time
+            seconds+=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+            replay.sampleFragmentation();
+            nextSample=i+1+fragmentationPeriod;
+            start=chrono::steady_clock::now();
+        }
+    }
+    seconds+=chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+    for(unsigned int i=0;i<slots;i++) if(replay.blocks[i]) pool.deallocate(replay.blocks[i]);
+    printf("{\"backend\":\"%s\",\"policy\":\"%s\",\"trace_pool_size\":%llu,\"pool_size\":%zu,"
+           "\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.0f,\"peak_live_bytes\":%zu,"
+           "\"peak_extent\":%zu,\"failed\":%lu,\"mean_fragmentation\":%.4f,"
+           "\"max_fragmentation\":%.4f,\"outcome_mismatches\":%lu,\"placement_mismatches\":%lu}\n",
+           backend,policy,static_cast<unsigned long long>(header.poolSize),
+           static_cast<size_t>(TEST_ALLOC_POOL_SIZE),
+           ops.size(),seconds,seconds>0 ? ops.size()/seconds : 0.0,
+           replay.peakLiveBytes,replay.peakExtent,replay.failed,
+           replay.fragmentationSamples ? replay.fragmentationSum/replay.fragmentationSamples : 0.0,
+           replay.maxFragmentation,replay.outcomeMismatches,replay.placementMismatches);
+    return replay.outcomeMismatches ? 2 : 0;
+}